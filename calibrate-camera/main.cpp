@@ -208,10 +208,24 @@ int main(int argc, char **argv) {
 
 		// find chessboard corners in each image
 		std::vector<std::vector<cv::Point2f>> chessboard_corners;
+		// size of the input images, they should all be from the same camera at the same resolution
+		cv::Size image_size;
 		for (auto& file : input_files) {
 			auto image = cv::imread(file);
 			std::vector<cv::Point2f> points;
 
+			if (image.empty()) {
+				std::cout << "warning: could not open image '" << file << "', skipping" << std::endl;
+				continue;
+			}
+
+			if (image_size.empty()) {
+				image_size = image.size();
+			} else if (image.size() != image_size) {
+				std::cout << "warning: image '" << file << "' is a different size than the other images, skipping" << std::endl;
+				continue;
+			}
+
 			if (cv::findChessboardCornersSB(image, chessboard_size, points, cv::CALIB_CB_NORMALIZE_IMAGE)) {
 				chessboard_corners.push_back(std::move(points));
 			} else {
@@ -230,8 +244,7 @@ int main(int argc, char **argv) {
 		cv::Mat camera_matrix(3, 3, CV_64FC1);
 		cv::Mat distortion_matrix(4, 4, CV_64FC1);
 
-		// TODO: figure out if chessboard_size is right here
-		cv::calibrateCamera(object_points, chessboard_corners, chessboard_size, camera_matrix, distortion_matrix, cv::noArray(), cv::noArray());
+		cv::calibrateCamera(object_points, chessboard_corners, image_size, camera_matrix, distortion_matrix, cv::noArray(), cv::noArray());
 
 		// save the result to a file
 		cv::FileStorage file(output_file, cv::FileStorage::WRITE | cv::FileStorage::FORMAT_AUTO);
@@ -242,6 +255,9 @@ int main(int argc, char **argv) {
 
 		file.write("camera_matrix", camera_matrix);
 		file.write("distortion_matrix", distortion_matrix);
+		// vision needs to know what resolution the camera matrix is for, so it can be scaled to other resolutions
+		file.write("image_width", image_size.width);
+		file.write("image_height", image_size.height);
 
 		file.release();
 	}
@@ -0,0 +1,83 @@
+#include "alloc_counter.h"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+static std::atomic<u64> allocation_count { 0 };
+
+u64 heap_allocation_count() {
+	return allocation_count.load(std::memory_order_relaxed);
+}
+
+static void *counted_alloc(std::size_t size) {
+	allocation_count.fetch_add(1, std::memory_order_relaxed);
+
+	// malloc(0) is allowed to return null, but operator new is not
+	if (size == 0) {
+		size = 1;
+	}
+
+	void *ptr = std::malloc(size);
+	if (ptr == nullptr) {
+		throw std::bad_alloc();
+	}
+	return ptr;
+}
+
+static void *counted_aligned_alloc(std::size_t size, std::align_val_t align) {
+	allocation_count.fetch_add(1, std::memory_order_relaxed);
+
+	void *ptr = nullptr;
+	if (posix_memalign(&ptr, static_cast<std::size_t>(align), size == 0 ? 1 : size)) {
+		throw std::bad_alloc();
+	}
+	return ptr;
+}
+
+void *operator new(std::size_t size) {
+	return counted_alloc(size);
+}
+
+void *operator new[](std::size_t size) {
+	return counted_alloc(size);
+}
+
+void *operator new(std::size_t size, std::align_val_t align) {
+	return counted_aligned_alloc(size, align);
+}
+
+void *operator new[](std::size_t size, std::align_val_t align) {
+	return counted_aligned_alloc(size, align);
+}
+
+void operator delete(void *ptr) noexcept {
+	std::free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+	std::free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept {
+	std::free(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t) noexcept {
+	std::free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept {
+	std::free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept {
+	std::free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t, std::align_val_t) noexcept {
+	std::free(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t, std::align_val_t) noexcept {
+	std::free(ptr);
+}
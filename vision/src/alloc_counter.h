@@ -0,0 +1,8 @@
+#pragma once
+
+#include "types.h"
+
+// counts every call to the global operator new made by this process
+// this is used to check that the vision loop does not allocate memory once it has reached a steady state
+// NOTE: opencv allocates the data for cv::Mat with its own allocator, so those allocations are not counted here
+u64 heap_allocation_count();
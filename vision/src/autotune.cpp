@@ -0,0 +1,188 @@
+#include "autotune.h"
+#include "logging.h"
+#include <algorithm>
+
+// how many runs each candidate gets, the average of these is used to compare candidates
+static constexpr int samples_per_candidate = 10;
+
+const char *parallel_stage_to_string(ParallelStage stage) {
+	switch (stage) {
+		case ParallelStage::Hsv:
+			return "hsv";
+		case ParallelStage::Threshold:
+			return "threshold";
+		case ParallelStage::FusedThreshold:
+			return "fused_threshold";
+	}
+	// stop compiler warning
+	return "";
+}
+
+AutoTuner::AutoTuner(int max_threads) {
+	set_max_threads(max_threads);
+}
+
+void AutoTuner::set_max_threads(int max_threads) {
+	std::lock_guard lock(m_mutex);
+	m_max_threads = std::max(max_threads, 1);
+	m_stages.clear();
+
+	// only the thread count is tuned, since TileGrid never makes more tiles than threads, so a smaller tile size can't make more tiles
+	m_candidates.clear();
+	for (int threads = 1; threads <= m_max_threads; threads ++) {
+		m_candidates.push_back(StageConfig {
+			.threads = threads,
+			.grain = TileGrain {},
+		});
+	}
+}
+
+void AutoTuner::start() {
+	std::lock_guard lock(m_mutex);
+	// entries are recreated with fresh state the next time each stage runs
+	m_stages.clear();
+}
+
+bool AutoTuner::tuning() const {
+	std::lock_guard lock(m_mutex);
+	return std::any_of(m_stages.begin(), m_stages.end(), [] (const auto& entry) {
+		return !entry.second.done;
+	});
+}
+
+StageConfig AutoTuner::config(ParallelStage stage, cv::Size size, bool timed) {
+	std::lock_guard lock(m_mutex);
+
+	TuningKey key((int) stage, size.width, size.height);
+	auto it = m_stages.find(key);
+	if (it == m_stages.end()) {
+		// first run at this resolution, start tuning it
+		// this only allocates the first time a stage is seen at a resolution
+		it = m_stages.emplace(key, StageTuning {
+			.total_usec = std::vector<long>(m_candidates.size(), 0),
+			.best = default_config(),
+		}).first;
+	}
+
+	const auto& tuning = it->second;
+	if (tuning.done) {
+		return tuning.best;
+	}
+	return timed ? m_candidates[tuning.candidate] : default_config();
+}
+
+void AutoTuner::record(ParallelStage stage, cv::Size size, long elapsed_usec) {
+	std::lock_guard lock(m_mutex);
+
+	auto it = m_stages.find(TuningKey((int) stage, size.width, size.height));
+	if (it == m_stages.end() || it->second.done) {
+		return;
+	}
+
+	auto& tuning = it->second;
+	tuning.total_usec[tuning.candidate] += elapsed_usec;
+	tuning.samples ++;
+	if (tuning.samples < samples_per_candidate) {
+		return;
+	}
+
+	tuning.samples = 0;
+	tuning.candidate ++;
+	if (tuning.candidate < m_candidates.size()) {
+		return;
+	}
+
+	// every candidate has been tried, every candidate has the same number of samples so the totals can be compared directly
+	auto best = std::min_element(tuning.total_usec.begin(), tuning.total_usec.end());
+	tuning.best = m_candidates[best - tuning.total_usec.begin()];
+	tuning.done = true;
+	m_finished = true;
+
+	lg::info("tuned %s at %dx%d: %d threads, %ld usec average", parallel_stage_to_string(stage), size.width, size.height,
+		tuning.best.threads, *best / samples_per_candidate);
+}
+
+bool AutoTuner::take_finished() {
+	std::lock_guard lock(m_mutex);
+	bool finished = m_finished;
+	m_finished = false;
+	return finished;
+}
+
+Error AutoTuner::load(const std::string& filename) {
+	cv::FileStorage file(filename, cv::FileStorage::READ | cv::FileStorage::FORMAT_AUTO);
+	if (!file.isOpened()) {
+		return Error::resource_unavailable("could not open tuning profile '" + filename + "'");
+	}
+
+	std::lock_guard lock(m_mutex);
+	for (const auto& node : file["profiles"]) {
+		std::string stage_name = node["stage"];
+		int width = node["width"];
+		int height = node["height"];
+
+		std::optional<ParallelStage> stage;
+		for (usize i = 0; i < parallel_stage_count; i ++) {
+			if (stage_name == parallel_stage_to_string((ParallelStage) i)) {
+				stage = (ParallelStage) i;
+			}
+		}
+		if (!stage.has_value()) {
+			return Error::invalid_args("invalid stage '" + stage_name + "' in tuning profile '" + filename + "'");
+		}
+
+		StageConfig config = default_config();
+		// profiles from before only threads were tuned also have min_rows, which is ignored
+		config.threads = std::clamp((int) node["threads"], 1, m_max_threads);
+
+		m_stages[TuningKey((int) *stage, width, height)] = StageTuning {
+			.done = true,
+			.best = config,
+		};
+	}
+
+	return Error::ok();
+}
+
+Error AutoTuner::save(const std::string& filename) const {
+	cv::FileStorage file(filename, cv::FileStorage::WRITE | cv::FileStorage::FORMAT_AUTO);
+	if (!file.isOpened()) {
+		return Error::resource_unavailable("could not open tuning profile '" + filename + "' for writing");
+	}
+
+	std::lock_guard lock(m_mutex);
+	file.startWriteStruct("profiles", cv::FileNode::SEQ);
+	for (const auto& [key, tuning] : m_stages) {
+		if (!tuning.done) {
+			continue;
+		}
+
+		file.startWriteStruct("", cv::FileNode::MAP);
+		file.write("stage", std::string(parallel_stage_to_string((ParallelStage) std::get<0>(key))));
+		file.write("width", std::get<1>(key));
+		file.write("height", std::get<2>(key));
+		file.write("threads", tuning.best.threads);
+		file.endWriteStruct();
+	}
+	file.endWriteStruct();
+
+	file.release();
+	return Error::ok();
+}
+
+void AutoTuner::log_profile() const {
+	std::lock_guard lock(m_mutex);
+	for (const auto& [key, tuning] : m_stages) {
+		if (tuning.done) {
+			lg::info("%s at %dx%d: %d threads", parallel_stage_to_string((ParallelStage) std::get<0>(key)),
+				std::get<1>(key), std::get<2>(key), tuning.best.threads);
+		}
+	}
+}
+
+StageConfig AutoTuner::default_config() const {
+	return StageConfig {
+		.threads = m_max_threads,
+		.grain = TileGrain {},
+	};
+}
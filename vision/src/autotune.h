@@ -0,0 +1,87 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <array>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+#include "types.h"
+#include "error.h"
+#include "parallel.h"
+
+// stages of the pipeline that are split up with parallel_tiles, each one is tuned seperately
+enum class ParallelStage: int {
+	Hsv = 0,
+	Threshold = 1,
+	FusedThreshold = 2,
+};
+
+constexpr usize parallel_stage_count = 3;
+
+const char *parallel_stage_to_string(ParallelStage stage);
+
+// how a parallel stage is split up
+struct StageConfig {
+	int threads;
+	TileGrain grain;
+};
+
+// finds the fastest StageConfig for each parallel stage at each resolution by trying every candidate on real frames
+// a stage is tuned the first time it is run at a resolution that doesn't have a saved profile, or when start is called
+// this is safe to use from multiple threads, since stages for different targets run at the same time
+class AutoTuner {
+	public:
+		// candidates use up to max_threads threads
+		explicit AutoTuner(int max_threads);
+
+		// changes the most threads candidates can use, this throws away all tuned configs
+		void set_max_threads(int max_threads);
+
+		// retunes every stage at every resolution, starting from their next run
+		void start();
+		// true if any stage is still being tuned
+		bool tuning() const;
+
+		// the config stage should use for its next run on an image of the given size
+		// timed is false if the run won't be recorded, then the default config is used until the stage is tuned instead of a candidate,
+		// so a stage that is never timed doesn't get stuck on a candidate
+		StageConfig config(ParallelStage stage, cv::Size size, bool timed = true);
+		// records how long the stage took with the config last returned by config
+		void record(ParallelStage stage, cv::Size size, long elapsed_usec);
+
+		// returns true once after any stage has finished tuning, so the caller knows to save the profile
+		bool take_finished();
+
+		// loads tuned configs saved by save, stages in the file won't be tuned again unless start is called
+		Error load(const std::string& filename);
+		Error save(const std::string& filename) const;
+
+		void log_profile() const;
+
+	private:
+		// tuning state of one stage at one resolution
+		struct StageTuning {
+			// index of the candidate being tried
+			usize candidate { 0 };
+			// how many runs the current candidate has had
+			int samples { 0 };
+			// total time for each candidate
+			std::vector<long> total_usec {};
+			bool done { false };
+			StageConfig best;
+		};
+
+		// stage, width, height
+		typedef std::tuple<int, int, int> TuningKey;
+
+		StageConfig default_config() const;
+
+		int m_max_threads;
+		std::vector<StageConfig> m_candidates {};
+
+		mutable std::mutex m_mutex {};
+		std::map<TuningKey, StageTuning> m_stages {};
+		bool m_finished { false };
+};
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <optional>
+#include <vector>
+#include "types.h"
+
+// fixed capacity queue for passing items between threads
+// push blocks while the queue is full and pop blocks while it is empty, so a fast producer can never get more than capacity items ahead
+// items are stored in a ring buffer allocated up front, so pushing and popping never allocates
+template<typename T>
+class BoundedQueue {
+	public:
+		explicit BoundedQueue(usize capacity): m_items(capacity) {}
+
+		// returns false without pushing if the queue is closed
+		bool push(T item) {
+			std::unique_lock lock(m_mutex);
+			m_not_full.wait(lock, [&] () { return m_closed || m_count < m_items.size(); });
+			if (m_closed) {
+				return false;
+			}
+
+			m_items[(m_head + m_count) % m_items.size()] = std::move(item);
+			m_count ++;
+			m_not_empty.notify_one();
+			return true;
+		}
+
+		// same as push, but returns false straight away instead of waiting if the queue is full
+		bool try_push(T item) {
+			std::lock_guard lock(m_mutex);
+			if (m_closed || m_count == m_items.size()) {
+				return false;
+			}
+
+			m_items[(m_head + m_count) % m_items.size()] = std::move(item);
+			m_count ++;
+			m_not_empty.notify_one();
+			return true;
+		}
+
+		// returns none once the queue is closed
+		std::optional<T> pop() {
+			std::unique_lock lock(m_mutex);
+			m_not_empty.wait(lock, [&] () { return m_closed || m_count > 0; });
+			if (m_closed) {
+				return {};
+			}
+
+			T item = std::move(m_items[m_head]);
+			m_head = (m_head + 1) % m_items.size();
+			m_count --;
+			m_not_full.notify_one();
+			return item;
+		}
+
+		// wakes up every thread waiting on the queue, and makes all future pushes and pops fail until reopen is called
+		void close() {
+			std::lock_guard lock(m_mutex);
+			m_closed = true;
+			m_not_full.notify_all();
+			m_not_empty.notify_all();
+		}
+
+		// removes all items and lets the queue be used again
+		void reopen() {
+			std::lock_guard lock(m_mutex);
+			m_head = 0;
+			m_count = 0;
+			m_closed = false;
+		}
+
+	private:
+		std::vector<T> m_items;
+		// index of the oldest item
+		usize m_head { 0 };
+		usize m_count { 0 };
+		bool m_closed { false };
+
+		std::mutex m_mutex {};
+		std::condition_variable m_not_full {};
+		std::condition_variable m_not_empty {};
+};
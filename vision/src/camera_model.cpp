@@ -0,0 +1,122 @@
+#include "camera_model.h"
+#include <math.h>
+
+// fixed point iterations used to invert the distortion model, this is the same number opencv uses
+static constexpr int undistort_iterations = 5;
+
+CameraModel::CameraModel(double fov):
+m_fx(0.0),
+m_fy(0.0),
+m_cx(0.0),
+m_cy(0.0),
+m_fov(fov) {}
+
+Error CameraModel::load(const std::string& filename) {
+	cv::FileStorage file(filename, cv::FileStorage::READ | cv::FileStorage::FORMAT_AUTO);
+	if (!file.isOpened()) {
+		return Error::resource_unavailable("could not open camera calibration '" + filename + "'");
+	}
+
+	cv::Mat camera_matrix;
+	cv::Mat distortion_matrix;
+	file["camera_matrix"] >> camera_matrix;
+	file["distortion_matrix"] >> distortion_matrix;
+
+	if (camera_matrix.rows != 3 || camera_matrix.cols != 3) {
+		return Error::invalid_args("camera calibration '" + filename + "' has no 3x3 camera_matrix");
+	}
+	camera_matrix.convertTo(camera_matrix, CV_64F);
+
+	double fx = camera_matrix.at<double>(0, 0);
+	double fy = camera_matrix.at<double>(1, 1);
+	double cx = camera_matrix.at<double>(0, 2);
+	double cy = camera_matrix.at<double>(1, 2);
+	if (fx <= 0.0 || fy <= 0.0) {
+		return Error::invalid_args("camera calibration '" + filename + "' has a focal length that is not positive");
+	}
+
+	int width = file["image_width"];
+	int height = file["image_height"];
+	cv::Size calibration_size(width, height);
+	if (width <= 0 || height <= 0) {
+		// older calibrations don't have the image size, the principal point is usually close enough to the center to work it out
+		calibration_size = cv::Size(cvRound(cx * 2.0), cvRound(cy * 2.0));
+		if (calibration_size.width <= 0 || calibration_size.height <= 0) {
+			return Error::invalid_args("camera calibration '" + filename + "' has no image_width and image_height, and its principal point is not positive");
+		}
+	}
+
+	m_fov = 0.0;
+	m_fx = fx;
+	m_fy = fy;
+	m_cx = cx;
+	m_cy = cy;
+	m_calibration_size = calibration_size;
+
+	// only the 5 coefficient model calibrate-camera uses is supported, any extra coefficients are ignored
+	m_distortion.fill(0.0);
+	m_has_distortion = false;
+	if (!distortion_matrix.empty()) {
+		distortion_matrix.convertTo(distortion_matrix, CV_64F);
+		const double *coefficients = distortion_matrix.ptr<double>();
+		for (usize i = 0; i < m_distortion.size() && i < distortion_matrix.total(); i ++) {
+			m_distortion[i] = coefficients[i];
+			m_has_distortion |= coefficients[i] != 0.0;
+		}
+	}
+
+	// make the next call to set_frame_size recompute everything
+	m_frame_size = cv::Size();
+
+	return Error::ok();
+}
+
+void CameraModel::set_frame_size(cv::Size frame_size) {
+	if (frame_size == m_frame_size) {
+		return;
+	}
+	m_frame_size = frame_size;
+
+	if (m_fov > 0.0) {
+		// the field of view is horizontal, and pixels are square, so both focal lengths come from the width
+		double focal_length = (frame_size.width / 2.0) / tan(m_fov * M_PI / 360.0);
+		m_inv_fx = 1.0 / focal_length;
+		m_inv_fy = 1.0 / focal_length;
+		m_frame_cx = frame_size.width / 2.0;
+		m_frame_cy = frame_size.height / 2.0;
+		return;
+	}
+
+	// the camera matrix scales with the resolution, since a lower resolution is the same view with bigger pixels
+	double x_scale = (double) frame_size.width / m_calibration_size.width;
+	double y_scale = (double) frame_size.height / m_calibration_size.height;
+
+	m_inv_fx = 1.0 / (m_fx * x_scale);
+	m_inv_fy = 1.0 / (m_fy * y_scale);
+	m_frame_cx = m_cx * x_scale;
+	m_frame_cy = m_cy * y_scale;
+}
+
+cv::Point2d CameraModel::undistort_point(cv::Point2d pixel) const {
+	double x0 = (pixel.x - m_frame_cx) * m_inv_fx;
+	double y0 = (pixel.y - m_frame_cy) * m_inv_fy;
+	if (!m_has_distortion) {
+		return cv::Point2d(x0, y0);
+	}
+
+	auto [k1, k2, p1, p2, k3] = m_distortion;
+
+	// the distortion model has no closed form inverse, so guess the undistorted point and refine it
+	double x = x0;
+	double y = y0;
+	for (int i = 0; i < undistort_iterations; i ++) {
+		double r2 = x * x + y * y;
+		double inverse_radial = 1.0 / (1.0 + ((k3 * r2 + k2) * r2 + k1) * r2);
+		double delta_x = 2.0 * p1 * x * y + p2 * (r2 + 2.0 * x * x);
+		double delta_y = p1 * (r2 + 2.0 * y * y) + 2.0 * p2 * x * y;
+		x = (x0 - delta_x) * inverse_radial;
+		y = (y0 - delta_y) * inverse_radial;
+	}
+
+	return cv::Point2d(x, y);
+}
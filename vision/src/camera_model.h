@@ -0,0 +1,48 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <array>
+#include <string>
+#include "types.h"
+#include "error.h"
+
+// maps pixels in a frame to directions from the camera, using either calibrate-camera's output or just a field of view
+// only the few points of each target that are needed are undistorted, so frames never have to be remapped
+class CameraModel {
+	public:
+		// an ideal camera with no distortion and the given horizontal field of view in degrees
+		explicit CameraModel(double fov);
+
+		// loads camera_matrix, distortion_matrix, image_width and image_height from a file written by calibrate-camera
+		// files from before calibrate-camera saved the image size are assumed to be centered on the principal point
+		// returns error if the file can't be opened or is missing the camera matrix
+		Error load(const std::string& filename);
+
+		// works out everything that depends on the resolution, this only does anything if the size has changed
+		void set_frame_size(cv::Size frame_size);
+
+		// converts a pixel in a frame of the size passed to set_frame_size into normalized image coordinates with the distortion removed
+		// x is to the right and y is down, and each is the tangent of the angle from the center of view
+		cv::Point2d undistort_point(cv::Point2d pixel) const;
+
+	private:
+		// camera matrix values at the resolution the camera was calibrated at, only used once a calibration is loaded
+		double m_fx;
+		double m_fy;
+		double m_cx;
+		double m_cy;
+		cv::Size m_calibration_size {};
+		// horizontal field of view in degrees until a calibration is loaded, then 0
+		// the camera matrix for a field of view is made at the frame size, so it is never stretched to a different aspect ratio
+		double m_fov;
+		// k1, k2, p1, p2, k3, in the same order opencv uses
+		std::array<double, 5> m_distortion {};
+		bool m_has_distortion { false };
+
+		// values for the current frame size
+		cv::Size m_frame_size {};
+		double m_inv_fx { 1.0 };
+		double m_inv_fy { 1.0 };
+		double m_frame_cx { 0.0 };
+		double m_frame_cy { 0.0 };
+};
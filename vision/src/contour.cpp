@@ -0,0 +1,220 @@
+#include "contour.h"
+
+void ContourStore::clear() {
+	m_points.clear();
+	m_spans.clear();
+	m_contour_start = 0;
+}
+
+usize ContourStore::size() const {
+	return m_spans.size();
+}
+
+std::span<const cv::Point> ContourStore::operator[](usize index) const {
+	auto span = m_spans[index];
+	return std::span<const cv::Point>(m_points.data() + span.offset, span.length);
+}
+
+cv::Mat ContourStore::mat(usize index) const {
+	auto span = m_spans[index];
+	// opencv will not write to the data through this, so the const cast is fine
+	return cv::Mat(span.length, 1, CV_32SC2, (void *) (m_points.data() + span.offset));
+}
+
+void ContourStore::draw(cv::Mat& img, usize index, const cv::Scalar& color) const {
+	auto span = m_spans[index];
+	const cv::Point *points = m_points.data() + span.offset;
+	int point_count = span.length;
+	cv::polylines(img, &points, &point_count, 1, true, color);
+}
+
+void ContourStore::append(std::span<const cv::Point> contour) {
+	begin_contour();
+	m_points.insert(m_points.end(), contour.begin(), contour.end());
+	end_contour();
+}
+
+void ContourStore::append(const std::vector<std::vector<cv::Point>>& contours) {
+	for (const auto& contour : contours) {
+		append(std::span<const cv::Point>(contour));
+	}
+}
+
+void ContourStore::begin_contour() {
+	m_contour_start = m_points.size();
+}
+
+void ContourStore::push_point(cv::Point point) {
+	m_points.push_back(point);
+}
+
+void ContourStore::end_contour() {
+	m_spans.push_back(ContourSpan {
+		.offset = m_contour_start,
+		.length = m_points.size() - m_contour_start,
+	});
+}
+
+void ContourStore::compress_contour() {
+	usize length = m_points.size() - m_contour_start;
+	if (length <= 2) {
+		return;
+	}
+
+	cv::Point *points = m_points.data() + m_contour_start;
+
+	// the contour is a loop, so the point before the first point is the last point
+	cv::Point prev = points[length - 1];
+	cv::Point first = points[0];
+	usize out_index = 0;
+
+	for (usize i = 0; i < length; i ++) {
+		cv::Point current = points[i];
+		// points[0] may have already been overwritten when we wrap around, so use the saved first point
+		cv::Point next = i + 1 < length ? points[i + 1] : first;
+
+		// only keep points where the direction of the contour changes
+		if (current - prev != next - current) {
+			points[out_index] = current;
+			out_index ++;
+		}
+
+		prev = current;
+	}
+
+	m_points.resize(m_contour_start + out_index);
+}
+
+
+// offsets to each of the 8 neighbors of a pixel, going counterclockwise starting from the right
+static const cv::Point neighbor_offsets[8] = {
+	cv::Point(1, 0),
+	cv::Point(1, -1),
+	cv::Point(0, -1),
+	cv::Point(-1, -1),
+	cv::Point(-1, 0),
+	cv::Point(-1, 1),
+	cv::Point(0, 1),
+	cv::Point(1, 1),
+};
+
+// values used to mark pixels that have been visited by the border follower
+// in the paper these are NBD and -NBD, but we don't need the hierarchy so we don't need to keep track of which border they are from
+// foreground pixel that is on a border that has been followed
+static constexpr u8 MARK_VISITED = 2;
+// foreground pixel that is on a border that has been followed, and has a background pixel to the right of it
+static constexpr u8 MARK_RIGHT_EDGE = 3;
+// foreground pixel that has not been visited yet
+static constexpr u8 UNVISITED = 255;
+
+// follows the border starting at start, marking the pixels it passes over
+// from_dir is the direction of the background pixel next to start that caused this border to be found
+// if out is not null, the border is written to it as a new contour
+static void follow_border(cv::Mat& img, cv::Point start, int from_dir, ContourStore *out) {
+	auto pixel = [&] (cv::Point point) -> u8 {
+		// everything outside the image is treated as background
+		if (point.x < 0 || point.y < 0 || point.x >= img.cols || point.y >= img.rows) {
+			return 0;
+		}
+		return img.ptr<u8>(point.y)[point.x];
+	};
+
+	if (out != nullptr) {
+		out->begin_contour();
+	}
+
+	// search clockwise from the background pixel for the first foreground pixel
+	int first_dir = -1;
+	for (int i = 0; i < 8; i ++) {
+		int dir = (from_dir - i + 8) % 8;
+		if (pixel(start + neighbor_offsets[dir]) != 0) {
+			first_dir = dir;
+			break;
+		}
+	}
+
+	if (first_dir == -1) {
+		// this is a single isolated pixel
+		img.ptr<u8>(start.y)[start.x] = MARK_RIGHT_EDGE;
+		if (out != nullptr) {
+			out->push_point(start);
+			out->end_contour();
+		}
+		return;
+	}
+
+	// the second point of the border, once we get back to start from here we are done
+	cv::Point second = start + neighbor_offsets[first_dir];
+
+	cv::Point current = start;
+	// direction from current point to the previous point on the border
+	int prev_dir = first_dir;
+
+	for (;;) {
+		// search counterclockwise around the current point starting just after the previous point for the next point on the border
+		bool right_is_background = false;
+		int next_dir = prev_dir;
+		for (int i = 1; i <= 8; i ++) {
+			int dir = (prev_dir + i) % 8;
+			if (pixel(current + neighbor_offsets[dir]) != 0) {
+				next_dir = dir;
+				break;
+			}
+
+			if (dir == 0) {
+				right_is_background = true;
+			}
+		}
+
+		u8& value = img.ptr<u8>(current.y)[current.x];
+		if (right_is_background) {
+			value = MARK_RIGHT_EDGE;
+		} else if (value == UNVISITED) {
+			value = MARK_VISITED;
+		}
+
+		if (out != nullptr) {
+			out->push_point(current);
+		}
+
+		cv::Point next = current + neighbor_offsets[next_dir];
+		if (next == start && current == second) {
+			break;
+		}
+
+		prev_dir = (next_dir + 4) % 8;
+		current = next;
+	}
+
+	if (out != nullptr) {
+		out->compress_contour();
+		out->end_contour();
+	}
+}
+
+void trace_contours(cv::Mat& img, ContourStore& out) {
+	out.clear();
+
+	for (int y = 0; y < img.rows; y ++) {
+		u8 *row = img.ptr<u8>(y);
+
+		for (int x = 0; x < img.cols; x ++) {
+			u8 value = row[x];
+			if (value == 0) {
+				continue;
+			}
+
+			u8 left = x > 0 ? row[x - 1] : 0;
+			u8 right = x + 1 < img.cols ? row[x + 1] : 0;
+
+			if (value == UNVISITED && left == 0) {
+				// start of an outer border
+				follow_border(img, cv::Point(x, y), 4, &out);
+			} else if (value != MARK_RIGHT_EDGE && right == 0) {
+				// start of a hole border, this has to be followed so its pixels are marked,
+				// otherwise the other side of the hole would be mistaken for a new outer border
+				follow_border(img, cv::Point(x, y), 0, nullptr);
+			}
+		}
+	}
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <span>
+#include <vector>
+#include "types.h"
+
+// location of one contour inside of the ContourStore's point buffer
+struct ContourSpan {
+	usize offset;
+	usize length;
+};
+
+// stores many contours in one flat point buffer instead of a vector of vectors
+// the buffers are kept when cleared, so once they have grown big enough storing contours does not allocate
+class ContourStore {
+	public:
+		// removes all contours, but keeps the memory
+		void clear();
+
+		// number of contours stored
+		usize size() const;
+
+		std::span<const cv::Point> operator[](usize index) const;
+
+		// wraps the contour in a cv::Mat header without copying it
+		// this can be passed to opencv functions that take a contour, such as cv::boundingRect or cv::contourArea
+		cv::Mat mat(usize index) const;
+
+		// draws the contour onto the image
+		void draw(cv::Mat& img, usize index, const cv::Scalar& color) const;
+
+		// copies a contour into the store, used to store output of cv::findContours
+		void append(std::span<const cv::Point> contour);
+		void append(const std::vector<std::vector<cv::Point>>& contours);
+
+		// used to build up a new contour one point at a time
+		void begin_contour();
+		void push_point(cv::Point point);
+		void end_contour();
+
+		// removes points on the contour currently being built that are in the middle of a straight horizontal, vertical, or diagonal line
+		// this gives the same points as cv::CHAIN_APPROX_SIMPLE, and should be called before end_contour
+		void compress_contour();
+
+	private:
+		std::vector<cv::Point> m_points {};
+		std::vector<ContourSpan> m_spans {};
+		// offset of the contour currently being built
+		usize m_contour_start { 0 };
+};
+
+// finds the outer border of every connected region in a binary image using the border following algorithm from
+// Suzuki and Abe, "Topological Structural Analysis of Digitized Binary Images by Border Following"
+// this is the same algorithm cv::findContours uses, but contours are written straight into the ContourStore so no memory is allocated
+// this acts like cv::findContours with cv::RETR_LIST and cv::CHAIN_APPROX_SIMPLE, except borders of holes are not output
+// foreground pixels must be 255, as is output by cv::inRange
+// NOTE: img is used as scratch space by the algorithm, so it will be modified
+void trace_contours(cv::Mat& img, ContourStore& out);
@@ -0,0 +1,322 @@
+#include "detector.h"
+#include "util.h"
+#include <algorithm>
+#include <cmath>
+
+// returns a score from 0 to 1 of how similar 2 numbers are to eachother
+// the k value determines how fast the returned score falls off
+// the higher it is, the faster it falls off
+static double similarity(double a, double b, double k = 1.0) {
+	// currently this is just a function I came up with by myself, I am not sure how good it is
+	double squared_diff = pow((a - b), 2);
+
+	return 1 / (1 + exp(k * squared_diff));
+}
+
+TargetDetector::~TargetDetector() {}
+
+bool TargetDetector::uses_morphology() const {
+	return true;
+}
+
+void TargetDetector::record_time(long usec) {
+	m_stats.runs ++;
+	m_stats.total_usec += usec;
+	m_stats.max_usec = std::max(m_stats.max_usec, usec);
+}
+
+const DetectorStats& TargetDetector::stats() const {
+	return m_stats;
+}
+
+
+void ContourMatchDetector::detect(const TargetSearchData& target_data, DetectorFrame& frame) {
+	auto& contours = frame.contours;
+	time_if(frame.log_timing, target_data.contour_name.c_str(), [&] () {
+		if (frame.opencv_contours) {
+			cv::findContours(frame.mask, m_cv_contours, cv::RETR_LIST, cv::CHAIN_APPROX_SIMPLE);
+			contours.clear();
+			contours.append(m_cv_contours);
+		} else {
+			// this overwrites the mask, so it traces a copy if the mask has to be kept for the next frame
+			// copyTo reuses the scratch memory once it is big enough
+			if (frame.mask_writable) {
+				trace_contours(frame.mask, contours);
+			} else {
+				frame.mask.copyTo(m_scratch);
+				trace_contours(m_scratch, contours);
+			}
+		}
+	});
+
+	// TODO: maybe thow out targets that score so low on a certain test
+	auto& targets = frame.targets;
+	targets.clear();
+	for (usize i = 0; i < contours.size(); i ++) {
+		targets.push_back(IntermediateTarget(contours, i));
+	}
+
+	time_if(frame.log_timing, target_data.matching_name.c_str(), [&] () {
+		for (auto& target : targets) {
+			cv::Mat contour = contours.mat(target.contour);
+
+			// contour matching with cv::matchShapes
+			// matchShapes is a distance that is 0 for identical shapes, so it is inverted to make a better match score higher
+			double match_shapes_distance = cv::matchShapes(target_data.template_contour, contour, cv::CONTOURS_MATCH_I3, 0.0);
+			double match_shapes_score = 1.0 / (1.0 + match_shapes_distance);
+			target.score += match_shapes_score * target_data.weights.contour_match;
+
+			// compute fraction of bounding rectangle taken up by the actual contour
+			double area_frac = cv::contourArea(contour) / target.bounding_box.area();
+			// TODO: add a per target way to configure k
+			double frac_score = similarity(area_frac, target_data.template_area_frac, 70.0);
+			target.score += frac_score * target_data.weights.area_frac;
+
+			double aspect_ratio = (double) target.bounding_box.width / (double) target.bounding_box.height;
+			// make it so that doubling the aspec ratio results in a constant increase in score
+			double scaled_ratio = std::log2(aspect_ratio);
+			double aspect_score = similarity(scaled_ratio, target_data.template_aspect_ratio_scaled, 100.0);
+			target.score += aspect_score * target_data.weights.aspect_ratio;
+		}
+	});
+}
+
+
+BlobDetector::BlobDetector(bool fit_circles):
+m_fit_circles(fit_circles) {}
+
+void BlobDetector::detect(const TargetSearchData& target_data, DetectorFrame& frame) {
+	auto& targets = frame.targets;
+	targets.clear();
+
+	int component_count = 0;
+	time_if(frame.log_timing, target_data.contour_name.c_str(), [&] () {
+		component_count = cv::connectedComponentsWithStats(frame.mask, m_labels, m_stats, m_centroids, 8, CV_32S);
+	});
+
+	time_if(frame.log_timing, target_data.matching_name.c_str(), [&] () {
+		const auto& params = target_data.ball_params;
+
+		// component 0 is the background
+		for (int i = 1; i < component_count; i ++) {
+			const int *stats = m_stats.ptr<int>(i);
+			int area = stats[cv::CC_STAT_AREA];
+			if (area < params.min_area) {
+				continue;
+			}
+
+			cv::Rect box(stats[cv::CC_STAT_LEFT], stats[cv::CC_STAT_TOP], stats[cv::CC_STAT_WIDTH], stats[cv::CC_STAT_HEIGHT]);
+
+			// the smallest circle that contains the bounding box's longest side
+			// for a whole ball this is the ball's outline, so the ball should fill most of it
+			double radius = std::max(box.width, box.height) / 2.0;
+			double fill = area / (CV_PI * radius * radius);
+			double squareness = (double) std::min(box.width, box.height) / (double) std::max(box.width, box.height);
+
+			if (fill < params.min_fill && m_fit_circles) {
+				fit_circle(target_data, frame, area, box, fill, squareness);
+			}
+
+			IntermediateTarget target(box);
+			target.score = std::min(fill, 1.0) * target_data.weights.area_frac + squareness * target_data.weights.aspect_ratio;
+			targets.push_back(target);
+		}
+	});
+}
+
+void BlobDetector::fit_circle(const TargetSearchData& target_data, DetectorFrame& frame, int area, cv::Rect& box, double& fill, double& squareness) {
+	const auto& params = target_data.ball_params;
+	cv::Rect frame_rect(0, 0, frame.mask.cols, frame.mask.rows);
+	double radius = std::max(box.width, box.height) / 2.0;
+
+	// the ball might be partially blocked, so try to fit a circle to the edge of the mask near the component
+	// the whole ball could be up to twice as big as what is visible
+	int margin = (int) radius;
+	cv::Rect search = cv::Rect(box.x - margin, box.y - margin, box.width + 2 * margin, box.height + 2 * margin) & frame_rect;
+
+	m_circles.clear();
+	cv::HoughCircles(frame.mask(search), m_circles, cv::HOUGH_GRADIENT, 1.0, radius, 100, 10, (int) (radius * 0.5), (int) (radius * 2.0));
+
+	if (m_circles.size() == 0) {
+		return;
+	}
+
+	const auto& circle = m_circles[0];
+	double circle_radius = circle[2];
+	double circle_fill = std::min(area / (CV_PI * circle_radius * circle_radius), 1.0);
+
+	// the visible part is only some of the circle, so give it the benefit of the doubt as long as it covers a decent amount
+	if (circle_fill >= params.min_fill * 0.5) {
+		int x = search.x + (int) (circle[0] - circle_radius);
+		int y = search.y + (int) (circle[1] - circle_radius);
+		int diameter = (int) (2.0 * circle_radius);
+		// the ball may go past the edge of the frame, but the bounding box must stay inside of it
+		box = cv::Rect(x, y, diameter, diameter) & frame_rect;
+		// score it as if it just barely filled enough of its circle, since we can't see the rest of it
+		fill = params.min_fill;
+		squareness = 1.0;
+	}
+}
+
+
+CircleDetector::CircleDetector():
+BlobDetector(true) {}
+
+
+void WindowDetector::detect(const TargetSearchData& target_data, DetectorFrame& frame) {
+	const auto& params = target_data.window_params;
+	auto& targets = frame.targets;
+	targets.clear();
+	m_candidates.clear();
+
+	time_if(frame.log_timing, target_data.contour_name.c_str(), [&] () {
+		// the mask is 0 or 255, so this sums to 255 times the amount of pixels that passed the threshold
+		cv::integral(frame.mask, m_integral, CV_32S);
+	});
+
+	// number of pixels in a rectangle that passed the threshold
+	auto count = [&] (int x, int y, int width, int height) -> double {
+		const int *top = m_integral.ptr<int>(y);
+		const int *bottom = m_integral.ptr<int>(y + height);
+		return (bottom[x + width] - bottom[x] - top[x + width] + top[x]) / 255.0;
+	};
+
+	// fraction of a square window a circle that just fits in it fills
+	constexpr double circle_fill = CV_PI / 4.0;
+
+	// lowest scoring candidate at the front, so it is the one replaced once the candidates are full
+	auto worse = [] (const IntermediateTarget& a, const IntermediateTarget& b) {
+		return a.score > b.score;
+	};
+
+	time_if(frame.log_timing, target_data.matching_name.c_str(), [&] () {
+		cv::Rect frame_rect(0, 0, frame.mask.cols, frame.mask.rows);
+
+		for (double size_float = params.min_size; size_float <= params.max_size; size_float *= params.scale_step) {
+			int size = (int) size_float;
+			// the ring around the window that should be empty if this is a ball by itself
+			int pad = std::max(1, size / 4);
+			int stride = std::max(1, size / 4);
+
+			// windows are stride apart, with the last one on each row and column against the edge of the frame,
+			// so balls touching the edge are still covered
+			auto next_position = [&] (int position, int last) {
+				return position < last ? std::min(position + stride, last) : last + 1;
+			};
+			int last_x = frame.mask.cols - size;
+			int last_y = frame.mask.rows - size;
+
+			for (int y = 0; y <= last_y; y = next_position(y, last_y)) {
+				for (int x = 0; x <= last_x; x = next_position(x, last_x)) {
+					double inner = count(x, y, size, size);
+					double density = inner / (size * size);
+					if (density < params.min_density) {
+						continue;
+					}
+
+					// the part of the ring outside the frame can't be seen, so only the part inside it is counted
+					cv::Rect outer = cv::Rect(x - pad, y - pad, size + 2 * pad, size + 2 * pad) & frame_rect;
+					double ring = count(outer.x, outer.y, outer.width, outer.height) - inner;
+					int ring_area = outer.area() - size * size;
+					double ring_density = ring_area > 0 ? ring / ring_area : 0.0;
+
+					double fill_score = std::max(0.0, 1.0 - std::abs(density - circle_fill) / circle_fill);
+					double isolation_score = 1.0 - ring_density;
+
+					IntermediateTarget candidate(cv::Rect(x, y, size, size));
+					candidate.score = fill_score * target_data.weights.area_frac + isolation_score * target_data.weights.aspect_ratio;
+
+					// the candidates are a heap, so replacing the worst one doesn't have to search all of them
+					if (m_candidates.size() < max_candidates) {
+						m_candidates.push_back(candidate);
+						std::push_heap(m_candidates.begin(), m_candidates.end(), worse);
+					} else if (m_candidates.front().score < candidate.score) {
+						std::pop_heap(m_candidates.begin(), m_candidates.end(), worse);
+						m_candidates.back() = candidate;
+						std::push_heap(m_candidates.begin(), m_candidates.end(), worse);
+					}
+				}
+			}
+
+			// stop if the scale step is too small to ever make windows bigger
+			if ((int) (size_float * params.scale_step) == size) {
+				break;
+			}
+		}
+
+		// non max suppression, go through the windows from best to worst and throw away any that overlap a better window
+		std::sort(m_candidates.begin(), m_candidates.end(), [] (const auto& a, const auto& b) {
+			return a.score > b.score;
+		});
+
+		for (const auto& candidate : m_candidates) {
+			bool overlaps = false;
+			for (const auto& target : targets) {
+				double intersection = (candidate.bounding_box & target.bounding_box).area();
+				double union_area = candidate.bounding_box.area() + target.bounding_box.area() - intersection;
+				if (intersection / union_area > 0.3) {
+					overlaps = true;
+					break;
+				}
+			}
+
+			if (!overlaps) {
+				targets.push_back(candidate);
+			}
+		}
+	});
+}
+
+bool WindowDetector::uses_morphology() const {
+	return false;
+}
+
+
+DetectorRegistry::DetectorRegistry() {
+	add("contour", [] () -> std::unique_ptr<TargetDetector> {
+		return std::make_unique<ContourMatchDetector>();
+	});
+	add("blob", [] () -> std::unique_ptr<TargetDetector> {
+		return std::make_unique<BlobDetector>();
+	});
+	add("circle", [] () -> std::unique_ptr<TargetDetector> {
+		return std::make_unique<CircleDetector>();
+	});
+	add("window", [] () -> std::unique_ptr<TargetDetector> {
+		return std::make_unique<WindowDetector>();
+	});
+}
+
+DetectorRegistry& DetectorRegistry::global() {
+	static DetectorRegistry registry;
+	return registry;
+}
+
+void DetectorRegistry::add(const std::string& name, DetectorFactory factory) {
+	m_factories.insert_or_assign(name, factory);
+}
+
+std::unique_ptr<TargetDetector> DetectorRegistry::create(const std::string& name) const {
+	auto it = m_factories.find(name);
+	if (it == m_factories.end()) {
+		return nullptr;
+	}
+	return it->second();
+}
+
+std::string DetectorRegistry::names() const {
+	std::vector<std::string> names;
+	for (const auto& [name, factory] : m_factories) {
+		names.push_back(name);
+	}
+	std::sort(names.begin(), names.end());
+
+	std::string out;
+	for (const auto& name : names) {
+		if (out.length() > 0) {
+			out += ", ";
+		}
+		out += name;
+	}
+	return out;
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "types.h"
+#include "target.h"
+#include "contour.h"
+
+// buffers shared between Vision and the detectors for one target in one frame
+struct DetectorFrame {
+	// thresholded image after morphology, or straight from thresholding if the detector does not use morphology
+	cv::Mat& mask;
+	// if false, mask is kept between frames, so detectors must not write to it
+	// with motion gating, the threshold output is only partly updated each frame, so it is only writable if morphology makes a fresh copy of it
+	bool mask_writable;
+	// contour storage that any detector can use
+	ContourStore& contours;
+	// the detector should clear this and write every candidate target with its score to it
+	std::vector<IntermediateTarget>& targets;
+	// use cv::findContours instead of the built in contour tracer
+	bool opencv_contours;
+	// log how long each step of the detector takes
+	bool log_timing;
+};
+
+// how long a detector has taken to run
+struct DetectorStats {
+	u64 runs { 0 };
+	long total_usec { 0 };
+	long max_usec { 0 };
+};
+
+// algorithm used to find candidate targets in a thresholded image
+// every TargetSearchData gets its own detector, so detectors can keep scratch buffers between frames
+class TargetDetector {
+	public:
+		virtual ~TargetDetector();
+
+		virtual void detect(const TargetSearchData& target_data, DetectorFrame& frame) = 0;
+
+		// if this returns false, morphology is skipped and the detector gets the thresholded image directly
+		virtual bool uses_morphology() const;
+
+		// adds the time of one run of detect to the stats, called by Vision
+		void record_time(long usec);
+		const DetectorStats& stats() const;
+
+	private:
+		DetectorStats m_stats {};
+};
+
+// matches contours against the target's template contour
+class ContourMatchDetector: public TargetDetector {
+	public:
+		void detect(const TargetSearchData& target_data, DetectorFrame& frame) override;
+
+	private:
+		std::vector<std::vector<cv::Point>> m_cv_contours {};
+		// copy of the mask for the contour tracer to overwrite when the mask isn't writable
+		cv::Mat m_scratch {};
+};
+
+// scores connected components by how much of their enclosing circle they fill, and how square they are
+// this is much cheaper than contour matching, but only works for round targets
+class BlobDetector: public TargetDetector {
+	public:
+		// fit_circles turns on fitting circles to partially blocked balls, see CircleDetector
+		explicit BlobDetector(bool fit_circles = false);
+
+		void detect(const TargetSearchData& target_data, DetectorFrame& frame) override;
+
+	private:
+		// fits a circle to the edge of the mask around a component that doesn't fill enough of its circle to be a whole ball,
+		// and changes the box and score of the component to the whole ball's if the fit is good enough
+		void fit_circle(const TargetSearchData& target_data, DetectorFrame& frame, int area, cv::Rect& box, double& fill, double& squareness);
+
+		bool m_fit_circles;
+		// outputs of cv::connectedComponentsWithStats
+		cv::Mat m_labels {};
+		cv::Mat m_stats {};
+		cv::Mat m_centroids {};
+		std::vector<cv::Vec3f> m_circles {};
+};
+
+// same as the blob detector, but partially blocked balls have a circle fit to the edge of the mask around them to find the whole ball
+class CircleDetector: public BlobDetector {
+	public:
+		CircleDetector();
+};
+
+// slides fixed size square windows over an integral image of the threshold output at a few scales,
+// scores each window by how full it is and how empty the area around it is, then removes overlapping windows
+// this finds balls that are only a few pixels big, which morphology would erase, and it takes the same amount of time every frame
+// no matter what is in the image, unlike the contour based detectors
+class WindowDetector: public TargetDetector {
+	public:
+		void detect(const TargetSearchData& target_data, DetectorFrame& frame) override;
+		bool uses_morphology() const override;
+
+	private:
+		// maximum amount of windows kept before non max suppression, this bounds the time non max suppression takes
+		static constexpr usize max_candidates = 256;
+
+		cv::Mat m_integral {};
+		std::vector<IntermediateTarget> m_candidates {};
+};
+
+typedef std::unique_ptr<TargetDetector> (*DetectorFactory)();
+
+// maps detector names used in TargetSearchData to the detector implementation
+class DetectorRegistry {
+	public:
+		// registry with all of the built in detectors
+		static DetectorRegistry& global();
+
+		// adds a new detector, replacing any detector with the same name
+		void add(const std::string& name, DetectorFactory factory);
+
+		// returns null if there is no detector with that name
+		std::unique_ptr<TargetDetector> create(const std::string& name) const;
+
+		// comma seperated list of every detector name, for error messages
+		std::string names() const;
+
+	private:
+		DetectorRegistry();
+
+		std::unordered_map<std::string, DetectorFactory> m_factories {};
+};
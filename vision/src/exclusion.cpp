@@ -0,0 +1,136 @@
+#include "exclusion.h"
+#include <algorithm>
+#include <utility>
+
+// true if filename ends with extension
+static bool has_extension(const std::string& filename, const std::string& extension) {
+	return filename.size() >= extension.size() && filename.compare(filename.size() - extension.size(), extension.size(), extension) == 0;
+}
+
+Error ExclusionMask::load(const std::string& filename) {
+	if (has_extension(filename, ".yml") || has_extension(filename, ".yaml") || has_extension(filename, ".json")) {
+		return load_polygons(filename);
+	}
+
+	cv::Mat mask = cv::imread(filename, cv::IMREAD_GRAYSCALE);
+	if (mask.empty()) {
+		return Error::resource_unavailable("could not open exclusion mask '" + filename + "'");
+	}
+	m_mask = mask;
+
+	return Error::ok();
+}
+
+Error ExclusionMask::load_polygons(const std::string& filename) {
+	cv::FileStorage file(filename, cv::FileStorage::READ | cv::FileStorage::FORMAT_AUTO);
+	if (!file.isOpened()) {
+		return Error::resource_unavailable("could not open exclusion mask '" + filename + "'");
+	}
+
+	int width = file["width"];
+	int height = file["height"];
+	if (width <= 0 || height <= 0) {
+		return Error::invalid_args("exclusion mask '" + filename + "' needs a width and height");
+	}
+
+	cv::Mat mask(height, width, CV_8U, cv::Scalar(255));
+
+	int horizon = std::clamp((int) file["horizon"], 0, height);
+	mask.rowRange(0, horizon).setTo(0);
+
+	std::vector<std::vector<cv::Point>> polygons;
+	for (const auto& node : file["exclude"]) {
+		if (!node.isSeq() || node.size() < 6 || node.size() % 2 != 0) {
+			return Error::invalid_args("polygons in exclusion mask '" + filename + "' must be a list of at least 3 x y pairs");
+		}
+
+		std::vector<cv::Point> polygon;
+		for (usize i = 0; i < node.size(); i += 2) {
+			polygon.push_back(cv::Point((int) node[i], (int) node[i + 1]));
+		}
+		polygons.push_back(std::move(polygon));
+	}
+
+	if (!polygons.empty()) {
+		cv::fillPoly(mask, polygons, cv::Scalar(0));
+	}
+	m_mask = mask;
+
+	return Error::ok();
+}
+
+bool ExclusionMask::empty() const {
+	return m_mask.empty();
+}
+
+// bands of rows are merged into one until they are at least this tall, which bounds how many regions a slanted edge makes
+// each band processes every column any of its rows includes, so at most this many rows of excluded pixels along an edge are processed
+static constexpr int min_band_rows = 16;
+
+void ExclusionMask::included_regions(cv::Size frame_size, std::vector<cv::Rect>& regions) const {
+	regions.clear();
+
+	if (m_mask.empty()) {
+		regions.push_back(cv::Rect(cv::Point(0, 0), frame_size));
+		return;
+	}
+
+	cv::Mat mask = m_mask;
+	if (mask.size() != frame_size) {
+		// nearest keeps the mask binary
+		cv::resize(m_mask, mask, frame_size, 0, 0, cv::INTER_NEAREST);
+	}
+
+	// columns included in any row of the current band, 1 if included
+	std::vector<u8> band_cols(mask.cols, 0);
+	std::vector<u8> row_cols(mask.cols, 0);
+	int band_begin = 0;
+
+	auto finish_band = [&] (int band_end) {
+		int x = 0;
+		while (x < mask.cols) {
+			if (band_cols[x] == 0) {
+				x ++;
+				continue;
+			}
+
+			int begin = x;
+			while (x < mask.cols && band_cols[x] != 0) {
+				x ++;
+			}
+			regions.push_back(cv::Rect(begin, band_begin, x - begin, band_end - band_begin));
+		}
+	};
+
+	for (int y = 0; y < mask.rows; y ++) {
+		const u8 *row = mask.ptr<u8>(y);
+		for (int x = 0; x < mask.cols; x ++) {
+			row_cols[x] = row[x] != 0;
+		}
+
+		if (y == 0) {
+			band_cols.swap(row_cols);
+			continue;
+		}
+
+		// a row with the same columns as its band is merged into it for free,
+		// and a band shorter than min_band_rows takes every column of the next row too, so an edge that isn't horizontal or vertical
+		// makes one rect for every min_band_rows rows instead of one for every row
+		if (row_cols == band_cols) {
+			continue;
+		}
+		if (y - band_begin < min_band_rows) {
+			for (int x = 0; x < mask.cols; x ++) {
+				band_cols[x] |= row_cols[x];
+			}
+			continue;
+		}
+
+		finish_band(y);
+		band_cols.swap(row_cols);
+		band_begin = y;
+	}
+	if (mask.rows > 0) {
+		finish_band(mask.rows);
+	}
+}
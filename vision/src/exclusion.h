@@ -0,0 +1,39 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+#include "types.h"
+#include "error.h"
+
+// parts of a camera's view that can never contain a target, like the robot's own bumper and intake or anything above the horizon
+// excluded pixels are never converted or thresholded, so they cost nothing
+// an empty mask excludes nothing
+class ExclusionMask {
+	public:
+		// loads the mask from filename
+		// .yml, .yaml and .json files hold polygons to exclude and a horizon row, everything above the horizon is excluded:
+		// width: 640
+		// height: 480
+		// horizon: 120
+		// exclude:
+		//   - [ x0, y0, x1, y1, x2, y2, ... ]
+		// any other file is loaded as an image, where black pixels are excluded
+		// the mask is stretched to fit the frame if the frame is a different size than the mask was made for
+		// returns error if the file can't be opened or is not valid
+		Error load(const std::string& filename);
+
+		bool empty() const;
+
+		// writes the parts of a frame of frame_size that should be processed into regions
+		// rows are grouped into bands, and each rect covers one run of columns included in any row of its band
+		// rows with the same columns are always merged, and bands are at least 16 rows tall even if their rows differ,
+		// so a horizon and a few polygons only make a handful of rects, at the cost of processing a few excluded pixels along slanted edges
+		void included_regions(cv::Size frame_size, std::vector<cv::Rect>& regions) const;
+
+	private:
+		Error load_polygons(const std::string& filename);
+
+		// nonzero where pixels are processed, at the size the mask was made for
+		cv::Mat m_mask;
+};
@@ -0,0 +1,84 @@
+#include "flow.h"
+#include <algorithm>
+
+FlowTracker::FlowTracker(FlowParams params):
+m_params(params),
+m_interval(params.min_interval) {}
+
+void FlowTracker::reseed(const cv::Mat& frame, const std::vector<Target>& targets) {
+	// adapt the interval, back off quickly when tracking is poor and speed up slowly when it is good
+	// with nothing to follow, flow has nothing to do between detections, so detect every min_interval frames to find new targets quickly
+	if (targets.empty()) {
+		m_interval = m_params.min_interval;
+	} else if (m_lost_target || m_min_confidence < m_params.min_confidence) {
+		m_interval = std::max(m_interval / 2, m_params.min_interval);
+	} else if (m_min_confidence >= m_params.high_confidence) {
+		m_interval = std::min(m_interval + 1, m_params.max_interval);
+	}
+
+	m_min_confidence = 1.0;
+	m_lost_target = false;
+
+	// resize keeps the old patches' images so their memory can be reused
+	m_patches.resize(targets.size());
+	for (usize i = 0; i < targets.size(); i ++) {
+		const auto& target = targets[i];
+		auto& patch = m_patches[i];
+
+		cv::cvtColor(frame(target.bounding_box), patch.image, cv::COLOR_BGR2GRAY);
+		patch.type = target.type;
+		patch.score = target.score;
+	}
+}
+
+void FlowTracker::update(const cv::Mat& frame, const Vision& vision, std::vector<Target>& targets) {
+	cv::Rect frame_rect(0, 0, frame.cols, frame.rows);
+
+	usize out_index = 0;
+	for (usize i = 0; i < targets.size() && i < m_patches.size(); i ++) {
+		const auto& patch = m_patches[i];
+		cv::Rect box = targets[i].bounding_box;
+
+		int margin = std::max(2, (int) (std::max(box.width, box.height) * m_params.search_margin));
+		cv::Rect search_rect = cv::Rect(box.x - margin, box.y - margin, box.width + 2 * margin, box.height + 2 * margin) & frame_rect;
+
+		// target has moved too close to the edge to be found
+		if (search_rect.width < patch.image.cols || search_rect.height < patch.image.rows) {
+			m_lost_target = true;
+			continue;
+		}
+
+		cv::cvtColor(frame(search_rect), m_search_gray, cv::COLOR_BGR2GRAY);
+		cv::matchTemplate(m_search_gray, patch.image, m_match_result, cv::TM_CCOEFF_NORMED);
+
+		double confidence;
+		cv::Point match_location;
+		cv::minMaxLoc(m_match_result, nullptr, &confidence, nullptr, &match_location);
+
+		m_min_confidence = std::min(m_min_confidence, confidence);
+		if (confidence < m_params.min_confidence) {
+			m_lost_target = true;
+			continue;
+		}
+
+		cv::Rect new_box(search_rect.x + match_location.x, search_rect.y + match_location.y, box.width, box.height);
+		auto target = vision.target_from_box(patch.type, new_box, patch.score);
+		if (!target.has_value()) {
+			continue;
+		}
+
+		// move the patch along with the target, so targets and patches stay in the same order
+		if (out_index != i) {
+			std::swap(m_patches[out_index], m_patches[i]);
+		}
+		targets[out_index] = *target;
+		out_index ++;
+	}
+
+	targets.resize(out_index);
+	m_patches.resize(out_index);
+}
+
+int FlowTracker::detection_interval() const {
+	return m_interval;
+}
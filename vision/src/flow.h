@@ -0,0 +1,58 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include "types.h"
+#include "vision.h"
+
+struct FlowParams {
+	// how far around a target's last position to search for it, as a fraction of the target's size
+	double search_margin;
+	// targets that match their patch worse than this are considered lost
+	double min_confidence;
+	// if every target matched at least this well since the last detection, the detection interval is increased
+	double high_confidence;
+	// range the detection interval is adjusted within
+	int min_interval;
+	int max_interval;
+};
+
+// follows targets between frames that full detection is run on by searching for the patch of image the target was detected in
+// this only looks at a small window around each target, so it is much cheaper than running detection
+class FlowTracker {
+	public:
+		FlowTracker(FlowParams params);
+
+		// saves the patch of each target from a frame that detection was just run on
+		// this also adapts the detection interval based on how well targets were followed since the last reseed, and resets it to the minimum if there are no targets
+		void reseed(const cv::Mat& frame, const std::vector<Target>& targets);
+
+		// moves each target to where its patch is found in frame, and recomputes its distance and angle
+		// targets that can't be found are removed
+		void update(const cv::Mat& frame, const Vision& vision, std::vector<Target>& targets);
+
+		// how many frames should pass before detection is run again
+		int detection_interval() const;
+
+	private:
+		struct Patch {
+			// grayscale image of the target when it was last detected
+			cv::Mat image;
+			TargetType type;
+			double score;
+		};
+
+		FlowParams m_params;
+		// there is one patch for each target passed to the last reseed, in the same order
+		std::vector<Patch> m_patches {};
+		int m_interval;
+
+		// lowest confidence of any target since the last reseed
+		double m_min_confidence { 1.0 };
+		// true if any target was lost since the last reseed
+		bool m_lost_target { false };
+
+		// scratch buffers kept between frames
+		cv::Mat m_search_gray {};
+		cv::Mat m_match_result {};
+};
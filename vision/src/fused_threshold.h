@@ -0,0 +1,103 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <array>
+#include <utility>
+#include "types.h"
+#include "parallel.h"
+
+// the specialized kernels in this file are only written for 8 bit bgr frames, which is what the camera gives us
+// anything else has to go through the generic opencv path
+constexpr int fused_input_type = CV_8UC3;
+// the most targets a fused kernel is instantiated for, more targets than this use the generic path
+constexpr usize max_fused_targets = 4;
+
+// inclusive hsv bounds for one target, with opencv's 0 to 180 hue range
+struct HsvRange {
+	std::array<u8, 3> min;
+	std::array<u8, 3> max;
+
+	static HsvRange from_scalars(const cv::Scalar& min, const cv::Scalar& max) {
+		return HsvRange {
+			.min = { cv::saturate_cast<u8>(min[0]), cv::saturate_cast<u8>(min[1]), cv::saturate_cast<u8>(min[2]) },
+			.max = { cv::saturate_cast<u8>(max[0]), cv::saturate_cast<u8>(max[1]), cv::saturate_cast<u8>(max[2]) },
+		};
+	}
+};
+
+// fixed point lookup tables for the same integer bgr to hsv conversion that cv::cvtColor uses,
+// so the fused kernels give exactly the same masks as cvtColor followed by inRange
+constexpr int hsv_shift = 12;
+
+struct HsvTables {
+	// (255 << hsv_shift) / i, used to compute saturation
+	std::array<int, 256> sdiv;
+	// (180 << hsv_shift) / (6 * i), used to compute hue in the 0 to 180 range
+	std::array<int, 256> hdiv180;
+};
+
+constexpr HsvTables make_hsv_tables() {
+	HsvTables tables {};
+	for (int i = 1; i < 256; i ++) {
+		// rounded to nearest like cv::saturate_cast<int>
+		tables.sdiv[i] = (int) ((255 << hsv_shift) / (double) i + 0.5);
+		tables.hdiv180[i] = (int) ((180 << hsv_shift) / (6.0 * i) + 0.5);
+	}
+	return tables;
+}
+
+inline constexpr HsvTables hsv_tables = make_hsv_tables();
+
+// converts each pixel of bgr to hsv and checks it against every range, without ever writing the hsv image
+// masks[i] is set to 255 where the pixel is inside ranges[i] and 0 elsewhere
+// N is a template paramater so the loop over targets is unrolled
+template<usize N>
+inline void hsv_in_range_tile(const cv::Mat& bgr, const std::array<HsvRange, N>& ranges, std::array<cv::Mat, N>& masks) {
+	for (int y = 0; y < bgr.rows; y ++) {
+		const u8 *src = bgr.ptr<u8>(y);
+		std::array<u8 *, N> dst;
+		for (usize t = 0; t < N; t ++) {
+			dst[t] = masks[t].template ptr<u8>(y);
+		}
+
+		for (int x = 0; x < bgr.cols; x ++, src += 3) {
+			int b = src[0];
+			int g = src[1];
+			int r = src[2];
+
+			int v = std::max(b, std::max(g, r));
+			int vmin = std::min(b, std::min(g, r));
+			int diff = v - vmin;
+			int vr = v == r ? -1 : 0;
+			int vg = v == g ? -1 : 0;
+
+			int s = (diff * hsv_tables.sdiv[v] + (1 << (hsv_shift - 1))) >> hsv_shift;
+			int h = (vr & (g - b)) + (~vr & ((vg & (b - r + 2 * diff)) + (~vg & (r - g + 4 * diff))));
+			h = (h * hsv_tables.hdiv180[diff] + (1 << (hsv_shift - 1))) >> hsv_shift;
+			h += h < 0 ? 180 : 0;
+
+			for (usize t = 0; t < N; t ++) {
+				const auto& range = ranges[t];
+				bool inside = h >= range.min[0] && h <= range.max[0]
+					&& s >= range.min[1] && s <= range.max[1]
+					&& v >= range.min[2] && v <= range.max[2];
+				dst[t][x] = inside ? 255 : 0;
+			}
+		}
+	}
+}
+
+// runs hsv_in_range_tile over tiles of bgr on up to threads threads
+// every mask must already be allocated with the same size as bgr
+template<usize N>
+void fused_hsv_in_range(cv::Mat bgr, const std::array<HsvRange, N>& ranges, const std::array<cv::Mat, N>& masks, int threads, const TileGrain& grain) {
+	CV_Assert(bgr.type() == fused_input_type);
+
+	[&]<usize... I>(std::index_sequence<I...>) {
+		parallel_tiles(threads, grain, [&] (cv::Mat bgr_tile, auto... mask_tiles) {
+			std::array<cv::Mat, N> mask_array { mask_tiles... };
+			hsv_in_range_tile<N>(bgr_tile, ranges, mask_array);
+		}, bgr, masks[I]...);
+	}(std::make_index_sequence<N> {});
+}
@@ -0,0 +1,383 @@
+#include "graph.h"
+#include "logging.h"
+#include <stdio.h>
+#include <algorithm>
+
+const char *stage_kind_to_string(StageKind kind) {
+	switch (kind) {
+		case StageKind::Resize:
+			return "resize";
+		case StageKind::Color:
+			return "color";
+		case StageKind::Threshold:
+			return "threshold";
+		case StageKind::FusedThreshold:
+			return "fused_threshold";
+		case StageKind::Morph:
+			return "morph";
+		case StageKind::Label:
+			return "label";
+		case StageKind::Score:
+			return "score";
+		case StageKind::Sink:
+			return "sink";
+	}
+	// stop compiler warning
+	return "";
+}
+
+bool is_detect_stage(StageKind kind) {
+	return kind == StageKind::Label || kind == StageKind::Score || kind == StageKind::Sink;
+}
+
+bool is_transient_buffer(BufferKind kind) {
+	return kind == BufferKind::Resized || kind == BufferKind::Hsv;
+}
+
+// name of a stage that works on a whole scale, like "HSV Conversion x0.5"
+static std::string scale_stage_name(const char *name, double scale) {
+	char buf[64];
+	snprintf(buf, sizeof(buf), "%s x%g", name, scale);
+	return std::string(buf);
+}
+
+void FrameGraph::plan(const GraphDesc& desc) {
+	m_desc = desc;
+	m_stages.clear();
+	m_buffers.clear();
+	m_slots.clear();
+	m_wave_starts.clear();
+
+	build();
+	if (m_desc.max_fused_targets > 0) {
+		fuse();
+	}
+	schedule();
+	assign_memory();
+}
+
+const GraphDesc& FrameGraph::desc() const {
+	return m_desc;
+}
+
+const std::vector<GraphStage>& FrameGraph::stages() const {
+	return m_stages;
+}
+
+const std::vector<GraphBuffer>& FrameGraph::buffers() const {
+	return m_buffers;
+}
+
+const std::vector<GraphSlot>& FrameGraph::slots() const {
+	return m_slots;
+}
+
+const std::vector<usize>& FrameGraph::wave_starts() const {
+	return m_wave_starts;
+}
+
+usize FrameGraph::wave_count() const {
+	return m_wave_starts.empty() ? 0 : m_wave_starts.size() - 1;
+}
+
+void FrameGraph::log() const {
+	usize transient_count = 0;
+	usize transient_bytes = 0;
+	for (const auto& buffer : m_buffers) {
+		if (buffer.slot >= 0) {
+			transient_count ++;
+			transient_bytes += buffer.size.area() * CV_ELEM_SIZE(buffer.type);
+		}
+	}
+
+	usize slot_bytes = 0;
+	for (const auto& slot : m_slots) {
+		slot_bytes += slot.size.area() * CV_ELEM_SIZE(slot.type);
+	}
+
+	lg::info("frame graph: %zu stages in %zu waves, %zu transient buffers (%zu KiB) in %zu slots (%zu KiB)", m_stages.size(), wave_count(),
+		transient_count, transient_bytes / 1024, m_slots.size(), slot_bytes / 1024);
+
+	for (usize wave = 0; wave < wave_count(); wave ++) {
+		std::string names;
+		for (usize i = m_wave_starts[wave]; i < m_wave_starts[wave + 1]; i ++) {
+			if (!names.empty()) {
+				names += ", ";
+			}
+			names += m_stages[i].name;
+		}
+		lg::info("frame graph wave %zu: %s", wave, names.c_str());
+	}
+}
+
+usize FrameGraph::add_buffer(BufferKind kind, usize owner, cv::Size size, int type, std::string&& name) {
+	m_buffers.push_back(GraphBuffer {
+		.kind = kind,
+		.owner = owner,
+		.size = size,
+		.type = type,
+		.name = std::move(name),
+	});
+	return m_buffers.size() - 1;
+}
+
+void FrameGraph::add_stage(GraphStage&& stage) {
+	m_stages.push_back(std::move(stage));
+}
+
+void FrameGraph::build() {
+	usize source = add_buffer(BufferKind::Source, 0, m_desc.frame_size, m_desc.frame_type);
+
+	// the resize and hsv conversion are shared by every target at the same scale
+	std::vector<usize> scale_hsv(m_desc.scales.size(), 0);
+	for (usize scale_index = 0; scale_index < m_desc.scales.size(); scale_index ++) {
+		const auto& scale = m_desc.scales[scale_index];
+		bool used = std::any_of(m_desc.targets.begin(), m_desc.targets.end(), [&] (const GraphTarget& target) {
+			return target.scale_index == scale_index;
+		});
+		if (!used) {
+			continue;
+		}
+
+		usize input = source;
+		if (scale.scale != 1.0) {
+			input = add_buffer(BufferKind::Resized, scale_index, scale.size, m_desc.frame_type);
+			add_stage(GraphStage {
+				.kind = StageKind::Resize,
+				.threads = StageThreads::Branch,
+				.scale_index = scale_index,
+				.inputs = { source },
+				.outputs = { input },
+				.name = scale_stage_name("Resize", scale.scale),
+			});
+		}
+
+		// TODO: find a way to configure what type of colorspace image is input
+		scale_hsv[scale_index] = add_buffer(BufferKind::Hsv, scale_index, scale.size, m_desc.frame_type);
+		add_stage(GraphStage {
+			.kind = StageKind::Color,
+			.threads = StageThreads::Tiles,
+			.scale_index = scale_index,
+			.inputs = { input },
+			.outputs = { scale_hsv[scale_index] },
+			.name = scale_stage_name("HSV Conversion", scale.scale),
+		});
+	}
+
+	std::vector<usize> sink_inputs;
+	for (usize i = 0; i < m_desc.targets.size(); i ++) {
+		const auto& target = m_desc.targets[i];
+		cv::Size size = m_desc.scales[target.scale_index].size;
+
+		usize mask = add_buffer(BufferKind::Thresh, i, size, CV_8U, target.name + " Threshold");
+		add_stage(GraphStage {
+			.kind = StageKind::Threshold,
+			.threads = StageThreads::Tiles,
+			.scale_index = target.scale_index,
+			.targets = { i },
+			.inputs = { scale_hsv[target.scale_index] },
+			.outputs = { mask },
+			.name = target.name + " Threshold",
+		});
+
+		if (target.morphology) {
+			usize morph = add_buffer(BufferKind::Morph, i, size, CV_8U, target.name + " Morphology");
+			add_stage(GraphStage {
+				.kind = StageKind::Morph,
+				.threads = StageThreads::Branch,
+				.scale_index = target.scale_index,
+				.targets = { i },
+				.inputs = { mask },
+				.outputs = { morph },
+				.name = target.name + " Morphology",
+			});
+			mask = morph;
+		}
+
+		usize detections = add_buffer(BufferKind::Detections, i, cv::Size(), 0);
+		add_stage(GraphStage {
+			.kind = StageKind::Label,
+			.threads = StageThreads::Branch,
+			.scale_index = target.scale_index,
+			.targets = { i },
+			.inputs = { mask },
+			.outputs = { detections },
+			.name = target.name + " Detection",
+		});
+
+		usize targets = add_buffer(BufferKind::Targets, i, cv::Size(), 0);
+		add_stage(GraphStage {
+			.kind = StageKind::Score,
+			.threads = StageThreads::Branch,
+			.scale_index = target.scale_index,
+			.targets = { i },
+			.inputs = { detections },
+			.outputs = { targets },
+			.name = target.name + " Scoring",
+		});
+		sink_inputs.push_back(targets);
+	}
+
+	add_stage(GraphStage {
+		.kind = StageKind::Sink,
+		.threads = StageThreads::Serial,
+		.scale_index = 0,
+		.inputs = std::move(sink_inputs),
+		.name = "Targets",
+	});
+}
+
+void FrameGraph::fuse() {
+	std::vector<GraphStage> fused_stages;
+	fused_stages.reserve(m_stages.size());
+
+	std::vector<bool> removed(m_stages.size(), false);
+	for (usize i = 0; i < m_stages.size(); i ++) {
+		if (removed[i]) {
+			continue;
+		}
+
+		const auto& color = m_stages[i];
+		if (color.kind != StageKind::Color) {
+			fused_stages.push_back(std::move(m_stages[i]));
+			continue;
+		}
+
+		// the hsv image only has to exist if something other than a threshold reads it
+		usize hsv = color.outputs[0];
+		std::vector<usize> thresholds;
+		bool fusable = true;
+		for (usize j = i + 1; j < m_stages.size(); j ++) {
+			const auto& stage = m_stages[j];
+			if (std::find(stage.inputs.begin(), stage.inputs.end(), hsv) == stage.inputs.end()) {
+				continue;
+			}
+
+			if (stage.kind == StageKind::Threshold) {
+				thresholds.push_back(j);
+			} else {
+				fusable = false;
+			}
+		}
+
+		if (!fusable) {
+			fused_stages.push_back(std::move(m_stages[i]));
+			continue;
+		}
+
+		// each fused stage reads the input once no matter how many targets it thresholds,
+		// so targets are packed into as few stages as the fused kernels allow
+		double scale = m_desc.scales[color.scale_index].scale;
+		for (usize start = 0; start < thresholds.size(); start += m_desc.max_fused_targets) {
+			usize end = std::min(start + m_desc.max_fused_targets, thresholds.size());
+
+			GraphStage fused {
+				.kind = StageKind::FusedThreshold,
+				.threads = StageThreads::Tiles,
+				.scale_index = color.scale_index,
+				.inputs = color.inputs,
+				.name = scale_stage_name("Fused HSV Threshold", scale),
+			};
+			for (usize j = start; j < end; j ++) {
+				const auto& threshold = m_stages[thresholds[j]];
+				fused.targets.push_back(threshold.targets[0]);
+				fused.outputs.push_back(threshold.outputs[0]);
+				removed[thresholds[j]] = true;
+			}
+			fused_stages.push_back(std::move(fused));
+		}
+	}
+
+	m_stages = std::move(fused_stages);
+}
+
+void FrameGraph::schedule() {
+	// stages are built after the stages they read from, so one pass in order is enough
+	// a stage runs in the wave after the last of its inputs is written
+	std::vector<int> written_wave(m_buffers.size(), -1);
+	int wave_count = 0;
+	for (auto& stage : m_stages) {
+		stage.wave = 0;
+		for (usize input : stage.inputs) {
+			stage.wave = std::max(stage.wave, written_wave[input] + 1);
+		}
+		for (usize output : stage.outputs) {
+			written_wave[output] = stage.wave;
+		}
+		wave_count = std::max(wave_count, stage.wave + 1);
+	}
+
+	for (const auto& stage : m_stages) {
+		for (usize output : stage.outputs) {
+			auto& buffer = m_buffers[output];
+			buffer.first_wave = buffer.first_wave < 0 ? stage.wave : std::min(buffer.first_wave, stage.wave);
+			buffer.last_wave = std::max(buffer.last_wave, stage.wave);
+		}
+		for (usize input : stage.inputs) {
+			auto& buffer = m_buffers[input];
+			buffer.first_wave = buffer.first_wave < 0 ? stage.wave : std::min(buffer.first_wave, stage.wave);
+			buffer.last_wave = std::max(buffer.last_wave, stage.wave);
+		}
+	}
+
+	std::stable_sort(m_stages.begin(), m_stages.end(), [] (const GraphStage& a, const GraphStage& b) {
+		return a.wave < b.wave;
+	});
+
+	usize stage_index = 0;
+	for (int wave = 0; wave < wave_count; wave ++) {
+		m_wave_starts.push_back(stage_index);
+		while (stage_index < m_stages.size() && m_stages[stage_index].wave == wave) {
+			stage_index ++;
+		}
+	}
+	m_wave_starts.push_back(stage_index);
+}
+
+void FrameGraph::assign_memory() {
+	// buffers are given slots in the order they are first written, and a slot can be reused once every wave using its last buffer is done
+	std::vector<usize> transient;
+	for (usize i = 0; i < m_buffers.size(); i ++) {
+		if (is_transient_buffer(m_buffers[i].kind) && m_buffers[i].first_wave >= 0) {
+			transient.push_back(i);
+		}
+	}
+	std::stable_sort(transient.begin(), transient.end(), [&] (usize a, usize b) {
+		return m_buffers[a].first_wave < m_buffers[b].first_wave;
+	});
+
+	for (usize buffer_index : transient) {
+		auto& buffer = m_buffers[buffer_index];
+
+		// prefer the free slot that has to grow the least
+		int best = -1;
+		int best_growth = 0;
+		for (usize i = 0; i < m_slots.size(); i ++) {
+			const auto& slot = m_slots[i];
+			if (slot.type != buffer.type || slot.last_wave >= buffer.first_wave) {
+				continue;
+			}
+
+			cv::Size grown(std::max(slot.size.width, buffer.size.width), std::max(slot.size.height, buffer.size.height));
+			int growth = grown.area() - slot.size.area();
+			if (best < 0 || growth < best_growth) {
+				best = (int) i;
+				best_growth = growth;
+			}
+		}
+
+		if (best < 0) {
+			m_slots.push_back(GraphSlot {
+				.size = buffer.size,
+				.type = buffer.type,
+				.last_wave = buffer.last_wave,
+			});
+			buffer.slot = (int) m_slots.size() - 1;
+		} else {
+			auto& slot = m_slots[best];
+			slot.size = cv::Size(std::max(slot.size.width, buffer.size.width), std::max(slot.size.height, buffer.size.height));
+			slot.last_wave = buffer.last_wave;
+			buffer.slot = best;
+		}
+	}
+}
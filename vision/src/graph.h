@@ -0,0 +1,172 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+#include "types.h"
+
+// what a stage in a frame graph does
+enum class StageKind: int {
+	// resizes the input frame to one scale
+	Resize = 0,
+	// converts one scale to hsv
+	Color = 1,
+	// thresholds the hsv image of one scale for one target
+	Threshold = 2,
+	// converts and thresholds one scale for several targets in one pass, the planner makes these by fusing color and threshold stages
+	FusedThreshold = 3,
+	// cleans up one target's threshold mask
+	Morph = 4,
+	// runs one target's detector on its mask
+	Label = 5,
+	// filters one target's detections by score and works out their distance and angle
+	Score = 6,
+	// merges every target's results into the frame's output
+	Sink = 7,
+};
+
+const char *stage_kind_to_string(StageKind kind);
+
+// label and everything after it runs in detect, everything before it runs in preprocess
+bool is_detect_stage(StageKind kind);
+
+// how a stage uses threads
+enum class StageThreads: int {
+	// the stage is per pixel, so its image is split into tiles over the thread pool the way the tuner has found to be fastest
+	Tiles = 0,
+	// the stage runs on one thread, at the same time as the other stages in its wave
+	Branch = 1,
+	// the stage runs on the calling thread once everything before it has finished
+	Serial = 2,
+};
+
+enum class BufferKind: int {
+	// the input frame
+	Source = 0,
+	// the input frame resized to one scale
+	Resized = 1,
+	// one scale converted to hsv
+	Hsv = 2,
+	// one target's threshold mask
+	Thresh = 3,
+	// one target's mask after morphology
+	Morph = 4,
+	// what one target's detector found
+	Detections = 5,
+	// one target's scored targets
+	Targets = 6,
+};
+
+// resized and hsv buffers only hold data from when they are written until their last reader is done, so they can share memory
+// the others are kept between frames, since motion gating only updates the parts of the masks that changed
+bool is_transient_buffer(BufferKind kind);
+
+// a scale targets can be processed at
+struct GraphScale {
+	double scale { 1.0 };
+	cv::Size size {};
+
+	bool operator==(const GraphScale&) const = default;
+};
+
+// a target being searched for
+struct GraphTarget {
+	// index into the target data
+	usize target_index { 0 };
+	// index into the description's scales
+	usize scale_index { 0 };
+	bool morphology { false };
+	// used to name the target's stages
+	std::string name {};
+
+	bool operator==(const GraphTarget&) const = default;
+};
+
+// everything the shape of a frame's graph depends on
+struct GraphDesc {
+	cv::Size frame_size {};
+	int frame_type { 0 };
+	std::vector<GraphScale> scales {};
+	std::vector<GraphTarget> targets {};
+	// most targets one fused stage can threshold, 0 turns off fusion
+	usize max_fused_targets { 0 };
+
+	bool operator==(const GraphDesc&) const = default;
+};
+
+struct GraphBuffer {
+	BufferKind kind;
+	// index into the description's scales for source, resized and hsv buffers, and into its targets for the rest
+	usize owner;
+	// only used by image buffers
+	cv::Size size;
+	int type;
+	// first and last wave that use the buffer, -1 if nothing uses it
+	int first_wave { -1 };
+	int last_wave { -1 };
+	// index of the memory slot a transient buffer lives in, -1 for other buffers
+	int slot { -1 };
+	// window the buffer is shown in when displaying, empty if it isn't shown
+	std::string name {};
+};
+
+struct GraphStage {
+	StageKind kind;
+	StageThreads threads;
+	// index into the description's scales
+	usize scale_index;
+	// indexes into the description's targets of the targets this stage works on, only fused stages have more than one
+	std::vector<usize> targets {};
+	// indexes into the graph's buffers
+	std::vector<usize> inputs {};
+	std::vector<usize> outputs {};
+	// stages in the same wave don't depend on each other, so they can all run at once
+	int wave { 0 };
+	// name used for timing and for debug display windows
+	std::string name {};
+};
+
+// memory shared by transient buffers that are never in use at the same time
+// a buffer uses the top left of the slot, so a slot fits any buffer of its type that is no bigger than it
+struct GraphSlot {
+	cv::Size size;
+	int type;
+	// last wave a buffer in the slot is used in
+	int last_wave;
+};
+
+// the stages needed to process a frame, in the order they can be run
+// building the graph every frame would allocate, so it is only replanned when its description changes
+class FrameGraph {
+	public:
+		// builds the graph for desc, fuses what it can, groups the stages into waves, and assigns memory to transient buffers
+		void plan(const GraphDesc& desc);
+
+		const GraphDesc& desc() const;
+		// sorted by wave
+		const std::vector<GraphStage>& stages() const;
+		const std::vector<GraphBuffer>& buffers() const;
+		const std::vector<GraphSlot>& slots() const;
+		// first stage of each wave, with one extra entry at the end for the stage count
+		const std::vector<usize>& wave_starts() const;
+		usize wave_count() const;
+
+		// logs the stages in each wave and how much memory the transient buffers share
+		void log() const;
+
+	private:
+		usize add_buffer(BufferKind kind, usize owner, cv::Size size, int type, std::string&& name = {});
+		void add_stage(GraphStage&& stage);
+
+		void build();
+		// replaces each color stage and the threshold stages reading its output with fused threshold stages
+		void fuse();
+		void schedule();
+		void assign_memory();
+
+		GraphDesc m_desc {};
+		std::vector<GraphStage> m_stages {};
+		std::vector<GraphBuffer> m_buffers {};
+		std::vector<GraphSlot> m_slots {};
+		std::vector<usize> m_wave_starts {};
+};
@@ -6,6 +6,17 @@
 #include "util.h"
 #include "logging.h"
 #include "error.h"
+#include "alloc_counter.h"
+#include "tracker.h"
+#include "flow.h"
+#include "quality.h"
+#include "scheduler.h"
+#include "pipeline.h"
+#include "thread_pool.h"
+#include "realtime.h"
+#include "thermal.h"
+#include "params.h"
+#include "shadow.h"
 #include <cstdlib>
 #include <gst/gst.h>
 #include <opencv2/opencv.hpp>
@@ -22,6 +33,7 @@
 #include <iostream>
 #include <chrono>
 #include <thread>
+#include <atomic>
 
 enum class Mode {
 	Vision,
@@ -97,6 +109,10 @@ argparse::ArgumentParser parse_args(int argc, char **argv) {
 		.help("mqtt topic to recieve commands from to switch modes between remote viewing and vision, or to switch teams")
 		.default_value(std::string {"pi/cv/control"});
 
+	program.add_argument("--status-topic")
+		.help("mqtt topic to send status information on, such as the current quality level")
+		.default_value(std::string {"pi/cv/status"});
+
 	program.add_argument("-e", "--error-topic")
 		.help("mqtt topic to send error information on")
 		.default_value(std::string {"pi/cv/error"});
@@ -109,19 +125,15 @@ argparse::ArgumentParser parse_args(int argc, char **argv) {
 		.implicit_value(Mode::RemoteViewing);
 
 	program.add_argument("--target-type")
-		.help("what type of target to look for")
-		.default_value(TargetType::All)
-		.default_repr("all")
-		.action([] (const std::string& str) {
-			if (str == "red-ball") {
-				return TargetType::RedBall;
-			} else if (str == "blue-ball") {
-				return TargetType::BlueBall;
-			} else if (str == "all") {
-				return TargetType::All;
-			} else {
-				throw std::runtime_error("invalid argument for --team: must be either 'red-ball', 'blue-ball', or 'all'");
-			}
+		.help("what type of target to look for, a comma seperated list of target ids from the target config, or 'all'")
+		.default_value(std::string("all"));
+
+	program.add_argument("--target-config")
+		.help("yaml or json file listing the targets that can be looked for, defaults to targets.yml in the template directory")
+		.default_value(std::optional<std::string> {})
+		.default_repr("template-dir/targets.yml")
+		.action([] (const std::string& str) -> std::optional<std::string> {
+			return str;
 		});
 
 
@@ -170,12 +182,40 @@ argparse::ArgumentParser parse_args(int argc, char **argv) {
 		});
 
 
+	program.add_argument("--calibration")
+		.help("camera calibration file written by calibrate-camera, if given it is used instead of --fov to work out target distances and angles, and corrects for lens distortion");
+
 	program.add_argument("-d", "--display")
 		.help("display processing frames")
 		.default_value(false)
 		.implicit_value(true);
 
 
+	program.add_argument("--detector")
+		.help("use this detector for every target instead of the detector each target is configured with, useful for comparing detectors on the same video")
+		.default_value(std::optional<std::string> {})
+		.show_default(false)
+		.action([] (const std::string& str) -> std::optional<std::string> {
+			return str;
+		});
+
+	program.add_argument("--opencv-contours")
+		.help("use cv::findContours instead of the built in contour tracer, this allocates memory every frame so it is only useful for comparison")
+		.default_value(false)
+		.implicit_value(true);
+
+
+	program.add_argument("--generic-kernels")
+		.help("always use the generic opencv colour conversion and threshold instead of the fused kernels specialized for 8 bit bgr input, useful for comparing the two")
+		.default_value(false)
+		.implicit_value(true);
+
+
+	program.add_argument("--tuning-profile")
+		.help("file to load and save the tuned thread count for each parallel stage in, stages that are not in the file are tuned when they first run")
+		.default_value(std::string {"tuning-profile.yml"});
+
+
 	program.add_argument("-t", "--threads")
 		.help("amount of threads to use for parallel processing")
 		.default_value(4)
@@ -184,6 +224,115 @@ argparse::ArgumentParser parse_args(int argc, char **argv) {
 		});
 
 
+	program.add_argument("--worker-cpus")
+		.help("comma seperated list of cpus to pin the vision worker threads to, one worker is made for each cpu, pass an empty string to not pin workers")
+		.default_value(std::string {"1,2,3"});
+
+	program.add_argument("--main-cpus")
+		.help("comma seperated list of cpus to pin the main thread and every other thread it starts, like mqtt and gstreamer, to, pass an empty string to not pin them")
+		.default_value(std::string {"0"});
+
+
+	program.add_argument("--realtime")
+		.help("after warm up, lock memory and run the main, capture and worker threads with realtime priority, needs root or CAP_SYS_NICE and CAP_IPC_LOCK, without them it just logs a warning")
+		.default_value(false)
+		.implicit_value(true);
+
+	program.add_argument("--warmup-frames")
+		.help("how many frames to process before entering realtime mode, so every buffer has been allocated")
+		.default_value(60)
+		.action([] (const std::string& str) {
+			return std::atoi(str.c_str());
+		});
+
+	program.add_argument("--rt-priority")
+		.help("SCHED_FIFO priority of the main thread in realtime mode")
+		.default_value(50)
+		.action([] (const std::string& str) {
+			return std::atoi(str.c_str());
+		});
+
+	program.add_argument("--rt-capture-priority")
+		.help("SCHED_FIFO priority of the pipeline's capture thread in realtime mode")
+		.default_value(51)
+		.action([] (const std::string& str) {
+			return std::atoi(str.c_str());
+		});
+
+	program.add_argument("--rt-worker-priority")
+		.help("SCHED_FIFO priority of the thread pool workers in realtime mode")
+		.default_value(49)
+		.action([] (const std::string& str) {
+			return std::atoi(str.c_str());
+		});
+
+
+	program.add_argument("--track")
+		.help("track targets across frames, this smooths out the distance and angle and gives each target an id that stays the same between frames")
+		.default_value(false)
+		.implicit_value(true);
+
+	program.add_argument("--prediction-time")
+		.help("how many seconds into the future to predict tracked targets' distance and angle, used to compensate for latency")
+		.default_value(0.05)
+		.action([] (const std::string& str) {
+			return std::atof(str.c_str());
+		});
+
+	program.add_argument("--flow")
+		.help("follow targets with patch matching on frames where detection is not run, the detection interval is then adapted between 1 and --detect-every based on how well targets are followed")
+		.default_value(false)
+		.implicit_value(true);
+
+	program.add_argument("--detect-every")
+		.help("only run detection every n frames when tracking or using --flow, targets are predicted or followed on the frames in between")
+		.default_value(1)
+		.action([] (const std::string& str) {
+			return std::atoi(str.c_str());
+		});
+
+
+	program.add_argument("--pipeline-depth")
+		.help("read and preprocess the next frames on another thread while detection runs on the current frame, with at most this many frames in flight, 0 disables pipelining, 2 is enough to overlap the stages")
+		.default_value(0)
+		.action([] (const std::string& str) {
+			return std::atoi(str.c_str());
+		});
+
+	program.add_argument("--adaptive-quality")
+		.help("lower the processing quality when frames take longer than the frame interval from --fps, and raise it again when there is time to spare")
+		.default_value(false)
+		.implicit_value(true);
+
+	program.add_argument("--exclusion-mask")
+		.help("image or yaml polygon file marking the parts of this camera's view that can never contain a target, which are skipped entirely, see README.md");
+
+	program.add_argument("--motion-gating")
+		.help("only rethreshold the parts of each frame that changed since the last frame, and reuse the last targets if nothing changed")
+		.default_value(false)
+		.implicit_value(true);
+
+	program.add_argument("--motion-threshold")
+		.help("how much the average color of a part of the frame has to change before --motion-gating counts it as changed, from 0 to 255")
+		.default_value(6)
+		.action([] (const std::string& str) {
+			return std::atoi(str.c_str());
+		});
+
+	program.add_argument("--thermal")
+		.help("watch the cpu temperature and frequency and do less work as the pi heats up, before it starts throttling")
+		.default_value(false)
+		.implicit_value(true);
+
+	program.add_argument("--sysfs-root")
+		.help("where sysfs is mounted, the cpu temperature and frequency are read from here when --thermal is used")
+		.default_value(std::string("/sys"));
+
+	program.add_argument("--shadow")
+		.help("also run a changed configuration of the pipeline on a low priority thread, and publish how its targets and speed compare on the status topic, "
+			"given as key=value pairs like fused_kernels=0,every=4, see README.md");
+
+
 	program.add_argument("-a", "--camera")
 		.help("camera device file name to process, if no file name is given, use camera 0")
 		.default_value(std::optional<std::string> {})
@@ -207,16 +356,46 @@ argparse::ArgumentParser parse_args(int argc, char **argv) {
 	return program;
 }
 
+// writes every item to buf using format_item, seperated by newlines
+// format_item should work like snprintf
+// returns false if the items could not fit in the buffer
+template<typename T, typename F>
+bool serialize_list(char *buf, usize buf_len, const std::vector<T>& items, F format_item) {
+	usize i = 0;
+	buf[0] = '\0';
+
+	for (usize n = 0; n < items.size(); n ++) {
+		if (n > 0) {
+			if (i + 1 >= buf_len) {
+				return false;
+			}
+			buf[i] = '\n';
+			i ++;
+			buf[i] = '\0';
+		}
+
+		int result = format_item(buf + i, buf_len - i, items[n]);
+		if (result < 0 || (usize) result >= buf_len - i) {
+			return false;
+		}
+		i += result;
+	}
+
+	return true;
+}
+
 class AppState {
 	public:
 		// sets old mode to none to force mode init to be initially run
-		AppState(Mode mode, TargetType targets):
+		AppState(Mode mode, TargetType targets, const TargetRegistry& registry):
 		m_mode(mode),
 		m_targets(targets),
+		m_registry(registry),
 		m_old_mode(Mode::None) {}
 
 		Mode mode() const { return m_mode; }
 		TargetType targets() const { return m_targets; }
+		const TargetRegistry& registry() const { return m_registry; }
 
 		void set_mode(Mode new_mode) {
 			if (new_mode != m_mode) {
@@ -241,11 +420,36 @@ class AppState {
 			m_targets = targets;
 		}
 
+		// target paramater changes from the set control message are sent here, until this is set they are ignored
+		void set_param_updater(ParamUpdater *param_updater) {
+			m_param_updater = param_updater;
+		}
+
+		// returns false if the update is not valid or there is no param updater yet
+		bool submit_param_update(std::string_view command) {
+			ParamUpdater *param_updater = m_param_updater;
+			return param_updater != nullptr && param_updater->submit(command);
+		}
+
+		void request_tuning() {
+			m_tuning_requested = true;
+		}
+
+		// returns true once after request_tuning is called
+		bool take_tuning_request() {
+			return m_tuning_requested.exchange(false);
+		}
+
 	private:
 		Mode m_mode;
 		TargetType m_targets;
+		const TargetRegistry& m_registry;
 		// this will be none under normal circumstances, and set to Some(old mode) after mode change
 		std::optional<Mode> m_old_mode;
+		// set from the mqtt thread and taken by the main thread
+		std::atomic<bool> m_tuning_requested { false };
+		// set from the main thread and used from the mqtt thread
+		std::atomic<ParamUpdater *> m_param_updater { nullptr };
 };
 
 void mqtt_control_callback(std::string_view msg, AppState *data) {
@@ -256,12 +460,19 @@ void mqtt_control_callback(std::string_view msg, AppState *data) {
 		data->set_mode(Mode::RemoteViewing);
 	} else if (msg == "mode none") {
 		data->set_mode(Mode::None);
-	} else if (msg == "targets red_balls") {
-		data->set_targets(TargetType::RedBall);
-	} else if (msg == "targets blue_balls") {
-		data->set_targets(TargetType::BlueBall);
-	} else if (msg == "targets all") {
-		data->set_targets(TargetType::All);
+	} else if (msg.starts_with("targets ")) {
+		auto targets = data->registry().parse(msg.substr(strlen("targets ")));
+		if (targets.has_value()) {
+			data->set_targets(*targets);
+		} else {
+			lg::warn("recieved targets control message with unknown target");
+		}
+	} else if (msg.starts_with("set ")) {
+		if (!data->submit_param_update(msg.substr(strlen("set ")))) {
+			lg::warn("recieved invalid set control message");
+		}
+	} else if (msg == "tune") {
+		data->request_tuning();
 	} else {
 		lg::warn("recieved invalid control message");
 	}
@@ -271,31 +482,99 @@ int main(int argc, char **argv) {
 	auto program = parse_args(argc, argv);
 
 	lg::init(program.get<int>("--log-level"));
+
+	auto main_cpus = parse_cpu_list(program.get("--main-cpus"));
+	auto worker_cpus = parse_cpu_list(program.get("--worker-cpus"));
+	if (!main_cpus.has_value() || !worker_cpus.has_value()) {
+		lg::critical("error: --main-cpus and --worker-cpus must be comma seperated lists of cpu numbers");
+	}
+
+	// this is done before any other threads are started, so they inherit the main thread's cpus
+	if (!main_cpus->empty()) {
+		auto result = pin_current_thread(*main_cpus);
+		if (result.is_err()) {
+			lg::warn("%s", result.to_string().c_str());
+		}
+	}
+
 	gst_init(&argc, &argv);
 
 	const bool display_flag = program.get<bool>("--display");
 	const long max_fps = program.get<int>("--fps");
-	// the amount of time that will pass between each fram with the given framerate
-	std::chrono::milliseconds frame_interval(1000 / max_fps);
 	const int image_width = program.get<int>("--image-width");
 	const int image_height = program.get<int>("--image-height");
 	const int cam_width = program.is_used("--cam-width") ? program.get<int>("--cam-width") : image_width;
 	const int cam_height = program.is_used("--cam-height") ? program.get<int>("--cam-height") : image_height;
 	const double fov = program.get<double>("--fov");
 	const int threads = program.get<int>("--threads");
+	const bool track_flag = program.get<bool>("--track");
+	const double prediction_time = program.get<double>("--prediction-time");
+	const int detect_every = program.get<int>("--detect-every");
+	const bool flow_flag = program.get<bool>("--flow");
+	const bool adaptive_quality_flag = program.get<bool>("--adaptive-quality");
+	const bool thermal_flag = program.get<bool>("--thermal");
+	const bool motion_gating_flag = program.get<bool>("--motion-gating");
+	int pipeline_depth = program.get<int>("--pipeline-depth");
+	const bool realtime_flag = program.get<bool>("--realtime");
+	const long warmup_frames = program.get<int>("--warmup-frames");
+
+	if (max_fps < 1) {
+		// the frame scheduler and quality controller divide by it
+		lg::critical("error: --fps must be at least 1");
+	}
+
+	if (detect_every < 1) {
+		lg::critical("error: --detect-every must be at least 1");
+	}
+
+	if (pipeline_depth < 0) {
+		lg::critical("error: --pipeline-depth can't be negative");
+	}
+
+	if (pipeline_depth > 0 && display_flag) {
+		// opencv highgui windows can only be used from the main thread
+		lg::warn("pipelining can't be used with --display, disabling pipelining");
+		pipeline_depth = 0;
+	}
 
 	if (threads < 1) {
 		lg::critical("error: can't use less than 1 thread");
 	}
-	cv::setNumThreads(threads);
+
+	// vision work is split up by our own thread pool, so opencv's own threads would only compete with it
+	cv::setNumThreads(0);
+	usize worker_count = worker_cpus->empty() ? threads - 1 : worker_cpus->size();
+	// the shadow pipeline runs on the worker cpus, or on any cpu if the workers aren't pinned
+	std::vector<int> shadow_cpus = *worker_cpus;
+	if (shadow_cpus.empty()) {
+		for (int cpu = 0; cpu < (int) std::thread::hardware_concurrency(); cpu ++) {
+			shadow_cpus.push_back(cpu);
+		}
+	}
+	ThreadPool::init_global(worker_count, std::move(*worker_cpus));
 
 
 	const bool mqtt_flag = program.is_used("--mqtt");
 	const auto mqtt_topic = program.get("--topic");
 	const auto mqtt_control_topic = program.get("--control-topic");
 	const auto mqtt_error_topic = program.get("--error-topic");
+	const auto mqtt_status_topic = program.get("--status-topic");
 
-	AppState app_state(program.get<Mode>("--remote-viewing"), program.get<TargetType>("--target-type"));
+	auto template_dir = program.get("template-dir");
+	auto target_config = program.get<std::optional<std::string>>("--target-config").value_or(template_dir + "/targets.yml");
+
+	TargetRegistry target_registry;
+	auto target_config_res = target_registry.load(target_config);
+	if (target_config_res.is_err()) {
+		lg::critical("%s", target_config_res.to_string().c_str());
+	}
+
+	auto initial_targets = target_registry.parse(program.get("--target-type"));
+	if (!initial_targets.has_value()) {
+		lg::critical("error: invalid argument for --target-type: valid targets are %s, or all", target_registry.describe().c_str());
+	}
+
+	AppState app_state(program.get<Mode>("--remote-viewing"), *initial_targets, target_registry);
 
 	std::optional<MqttClient> mqtt_client {};
 	if (mqtt_flag) {
@@ -313,6 +592,11 @@ int main(int argc, char **argv) {
 		if (mqtt_client->subscribe(mqtt_control_topic, mqtt_control_callback, &app_state).is_err()) {
 			lg::warn("could not subscribe to mqtt control topic %s", mqtt_control_topic.c_str());
 		}
+
+		// lets clients work out which number in the vision data is which target
+		if (mqtt_client->publish(mqtt_status_topic, "targets " + target_registry.describe()).is_err()) {
+			lg::warn("could not publish target list to mqtt status topic %s", mqtt_status_topic.c_str());
+		}
 	}
 
 	// helper closure to report errors
@@ -349,13 +633,87 @@ int main(int argc, char **argv) {
 	auto file_name = program.get<std::optional<std::string>>("--camera");
 	VisionCamera camera(std::move(file_name), image_width, image_height, max_fps);
 
+	// sets up everything about a vision that comes from the command line, except its templates and detectors
+	// the shadow pipeline's visions are set up the same way as the primary one
+	auto configure_vision = [&] (Vision& vision) {
+		vision.set_opencv_contours(program.get<bool>("--opencv-contours"));
+		vision.set_fused_kernels(!program.get<bool>("--generic-kernels"));
+		if (program.is_used("--calibration")) {
+			CameraModel camera_model(fov);
+			auto result = camera_model.load(program.get("--calibration"));
+			if (result.is_err()) {
+				lg::critical("%s", result.to_string().c_str());
+			}
+			vision.set_camera_model(std::move(camera_model));
+		}
+		if (program.is_used("--exclusion-mask")) {
+			ExclusionMask exclusion_mask;
+			auto result = exclusion_mask.load(program.get("--exclusion-mask"));
+			if (result.is_err()) {
+				lg::critical("%s", result.to_string().c_str());
+			}
+			vision.set_exclusion_mask(std::move(exclusion_mask));
+		}
+		if (motion_gating_flag) {
+			vision.set_motion_gating(MotionParams {
+				.threshold = program.get<int>("--motion-threshold"),
+			});
+		}
+		vision.set_target_data(target_registry.targets());
+	};
+
 	Vision vis(fov, threads, display_flag);
-	auto template_dir = program.get("template-dir");
+	configure_vision(vis);
 	auto template_res = vis.process_templates(template_dir);
 	if (template_res.is_err()) {
 		lg::critical("%s", template_res.to_string().c_str());
 	}
 
+	const auto tuning_profile = program.get("--tuning-profile");
+	auto tuning_res = vis.tuner().load(tuning_profile);
+	if (tuning_res.is_err()) {
+		lg::info("%s, every parallel stage will be tuned", tuning_res.to_string().c_str());
+	}
+
+	const auto detector_override = program.get<std::optional<std::string>>("--detector");
+	auto detector_res = vis.create_detectors(detector_override);
+	if (detector_res.is_err()) {
+		lg::critical("%s", detector_res.to_string().c_str());
+	}
+
+	// target paramaters can be changed over mqtt once the templates have been processed
+	ParamUpdater param_updater(vis);
+	app_state.set_param_updater(&param_updater);
+
+	// runs a changed configuration on some of the frames the primary pipeline has finished with, to see how it compares
+	std::optional<ShadowRunner> shadow {};
+	if (program.is_used("--shadow")) {
+		ShadowConfig shadow_config;
+		auto result = parse_shadow_config(program.get("--shadow"), shadow_config);
+		if (result.is_err()) {
+			lg::critical("%s", result.to_string().c_str());
+		}
+
+		// both use 1 thread, so they never take threads in the thread pool away from the primary pipeline
+		// the templates don't have to be processed, since every frame is run with the primary pipeline's target data
+		auto baseline = std::make_unique<Vision>(fov, 1, false);
+		configure_vision(*baseline);
+		result = baseline->create_detectors(detector_override);
+		if (result.is_err()) {
+			lg::critical("%s", result.to_string().c_str());
+		}
+
+		auto shadow_vision = std::make_unique<Vision>(fov, 1, false);
+		configure_vision(*shadow_vision);
+		apply_shadow_config(*shadow_vision, shadow_config);
+		result = shadow_vision->create_detectors(shadow_config.detector.has_value() ? shadow_config.detector : detector_override);
+		if (result.is_err()) {
+			lg::critical("%s", result.to_string().c_str());
+		}
+
+		shadow.emplace(std::move(baseline), std::move(shadow_vision), shadow_config, std::move(shadow_cpus));
+	}
+
 
 	constexpr usize msg_buf_len = 2048;
 	char msg_buf[msg_buf_len];
@@ -363,17 +721,126 @@ int main(int argc, char **argv) {
 
 	long total_time = 0;
 	long frames = 0;
+	// frames where nothing changed and the last targets were reused, since the stats were last logged
+	long reused_frames = 0;
+
+	// these are kept across frames so their memory can be reused instead of reallocated every frame
+	cv::Mat frame;
+	std::vector<Target> targets;
+	targets.reserve(64);
+	std::vector<TrackedTarget> tracked_targets;
+	tracked_targets.reserve(64);
+	// settings the last frame was processed with
+	FrameSettings frame_settings {};
+
+	Tracker tracker(TrackerParams {
+		.gate_angle = 5.0,
+		.gate_distance = 1.0,
+		.max_missed = 10,
+		.angle_process_noise = 100.0,
+		.distance_process_noise = 1.0,
+		.angle_measurement_noise = 0.25,
+		.distance_measurement_noise = 0.01,
+	});
+	FlowTracker flow_tracker(FlowParams {
+		.search_margin = 0.5,
+		.min_confidence = 0.6,
+		.high_confidence = 0.85,
+		.min_interval = 1,
+		.max_interval = detect_every,
+	});
+
+	// frames since detection was last run, only used when tracking or using flow
+	int frames_since_detection = detect_every;
+
+	// whether detection will be run on the frame read into a slot released after this frame
+	// slots are read into in the order they are released, so that is the frame pipeline_depth frames from now
+	// this can be wrong if flow changes the detection interval, frames that weren't preprocessed are preprocessed on this thread if they are detected
+	auto detection_expected = [&] () {
+		if (!(track_flag || flow_flag)) {
+			return true;
+		}
 
-	for(;;) {
-		// the time we will need to wake up for next frame
-		auto next_frame_time = std::chrono::steady_clock::now() + frame_interval;
+		int detection_interval = flow_flag ? flow_tracker.detection_interval() : detect_every;
+		int since_detection = frames_since_detection;
+		for (int i = 1; i < pipeline_depth; i ++) {
+			since_detection = since_detection >= detection_interval ? 1 : since_detection + 1;
+		}
+		return since_detection >= detection_interval;
+	};
 
+	// paces the loop to max_fps
+	FrameScheduler scheduler(max_fps);
+	// the most frames that will be skipped at once after an overrun, this is about how many frames v4l2 keeps queued
+	constexpr u64 max_stale_frames = 4;
+
+	QualityController quality_controller(scheduler.period_usec(), default_quality_levels());
+
+	// the pi 4 starts soft throttling at 80 degrees, so start cutting back well before that
+	ThermalGovernor thermal_governor(program.get("--sysfs-root"), ThermalParams {
+		.warm_temp = 70.0,
+		.hot_temp = 75.0,
+		.critical_temp = 80.0,
+		.hysteresis = 3.0,
+	});
+	// temperature changes slowly, so sysfs only needs to be read about once a second
+	constexpr long thermal_interval_usec = 1000000;
+	long last_thermal_usec = 0;
+
+	// reads and preprocesses frames ahead of detection, only used if pipeline_depth is not 0
+	std::optional<FramePipeline> pipeline {};
+	if (pipeline_depth > 0) {
+		pipeline.emplace(camera, vis, pipeline_depth, app_state.targets());
+	}
+
+	// scheduler stats from before realtime mode was entered, used to show how much it helped
+	std::optional<SchedulerStats> pre_realtime_stats {};
+
+	// every step is tried even if an earlier one fails, so whatever is permitted still gets used
+	// entered once, after warmup_frames frames
+	bool realtime_entered = false;
+	auto enter_realtime = [&] () {
+		lg::info("entering realtime mode");
+		realtime_entered = true;
+
+		auto result = lock_memory();
+		if (result.is_err()) {
+			lg::warn("%s", result.to_string().c_str());
+		}
+		prefault_stack();
+
+		result = set_current_thread_realtime(program.get<int>("--rt-priority"));
+		if (result.is_err()) {
+			lg::warn("main thread: %s", result.to_string().c_str());
+		}
+
+		result = ThreadPool::global().set_realtime_priority(program.get<int>("--rt-worker-priority"));
+		if (result.is_err()) {
+			lg::warn("thread pool: %s", result.to_string().c_str());
+		}
+
+		if (pipeline.has_value()) {
+			result = pipeline->set_realtime_priority(program.get<int>("--rt-capture-priority"));
+			if (result.is_err()) {
+				lg::warn("pipeline: %s", result.to_string().c_str());
+			}
+		}
+
+		pre_realtime_stats = scheduler.reset_stats();
+	};
+
+	for(;;) {
 		// check if mode has changed
 		if (app_state.has_mode_changed()) {
 
 			// if there is an error when stopping cameras, it is not as important, so just emit a warning, don't tell rio or change state
 			switch (*app_state.old_mode()) {
 				case Mode::Vision: {
+					// the pipeline reads from the camera, so it has to be stopped first
+					if (pipeline.has_value()) {
+						pipeline->stop();
+					}
+
 					auto result = camera.stop();
 					if (result.is_err()) {
 						lg::warn("%s", result.to_string().c_str());
@@ -397,6 +864,8 @@ int main(int argc, char **argv) {
 					if (result.is_err()) {
 						app_state.set_mode(Mode::None);
 						report_mode_change(Mode::None, result);
+					} else if (pipeline.has_value()) {
+						pipeline->start();
 					}
 					break;
 				}
@@ -419,9 +888,32 @@ int main(int argc, char **argv) {
 
 		switch (app_state.mode()) {
 			case Mode::Vision: {
-				cv::Mat frame;
-				auto result = camera.read_to(frame);
+				// when pipelining, the frame has already been read and preprocessed on the pipeline's thread
+				FrameSlot *slot = nullptr;
+				double frame_timestamp;
+				auto result = Error::ok();
+				if (pipeline.has_value()) {
+					slot = pipeline->next_frame();
+					if (slot == nullptr) {
+						// the pipeline has stopped, so no more frames will be read
+						app_state.set_mode(Mode::None);
+						report_mode_change(Mode::None, Error::resource_unavailable("frame pipeline stopped"));
+						break;
+					}
+					frame = slot->frame;
+					frame_timestamp = slot->timestamp;
+					result = slot->read_result;
+				} else {
+					result = camera.read_to(frame);
+					// the tracker's velocities come from the time between frames, so this can't use the wall clock, which can jump
+					frame_timestamp = get_monotonic_nsec() / 1e9;
+				}
+
 				if (result.is_err()) {
+					if (slot != nullptr) {
+						pipeline->release(slot, vis.frame_settings(app_state.targets()), detection_expected());
+					}
+
 					if (result.is(ErrorType::ResourceUnavailable)) {
 						lg::warn("could not read frame from camera, skipping vision processing");
 						continue;
@@ -429,43 +921,235 @@ int main(int argc, char **argv) {
 						// some other error has occured, don't do vision anymore
 						app_state.set_mode(Mode::None);
 						report_mode_change(Mode::None, result);
+						break;
 					}
 				}
 
+				// kept since frame is released before the end of the frame when pipelining
+				cv::Size frame_size = frame.size();
+
+				if (app_state.take_tuning_request()) {
+					lg::info("retuning parallel stages");
+					vis.tuner().start();
+				}
+
+				u64 old_heap_allocations = heap_allocation_count();
+				u64 old_buffer_allocations = vis.buffer_allocations();
+
+				// when tracking or using flow, detection can be skipped on some frames
+				// and targets are followed with flow or predicted by the tracker instead
+				int detection_interval = flow_flag ? flow_tracker.detection_interval() : detect_every;
+				bool run_detection = !(track_flag || flow_flag) || frames_since_detection >= detection_interval;
+
+				// only set when detection reused the previous targets because nothing changed
+				bool reused_targets = false;
+
 				long elapsed_time;
-				auto targets = time<std::vector<Target>>("frame", [&] () {
-					return vis.process(frame, app_state.targets());
+				time("frame", [&] () {
+					if (run_detection) {
+						if (slot != nullptr) {
+							frame_settings = slot->settings;
+							if (!slot->preprocess) {
+								// detection wasn't expected on this frame when the slot was released, so the pipeline didn't preprocess it
+								vis.preprocess(frame, frame_settings, slot->buffers);
+							}
+							vis.detect(frame, slot->buffers, targets);
+						} else {
+							frame_settings = vis.frame_settings(app_state.targets());
+							vis.process(frame, frame_settings, targets);
+						}
+						frames_since_detection = 1;
+						reused_targets = vis.reused_targets();
+
+						if (flow_flag) {
+							flow_tracker.reseed(frame, targets);
+						}
+					} else {
+						frames_since_detection ++;
+
+						if (flow_flag) {
+							flow_tracker.update(frame, vis, targets);
+						}
+					}
+
+					if (track_flag) {
+						// flow gives new measurements every frame, so the tracker can be updated even if detection was not run
+						if (run_detection || flow_flag) {
+							tracker.update(targets, frame_timestamp);
+						} else {
+							tracker.predict(frame_timestamp);
+						}
+						tracker.get_tracks(tracked_targets, prediction_time);
+					}
 				}, &elapsed_time);
 
+				// the frame is given to the shadow pipeline once the targets have been published, so copying it never delays them
+				bool submit_shadow = shadow.has_value() && run_detection;
+
+				// the pipeline would read the next frame into the same memory, so the slot is kept until the frame has been copied
+				if (slot != nullptr && !submit_shadow) {
+					// drop the reference to the slot's frame so the pipeline can read the next frame into the same memory
+					frame.release();
+					pipeline->release(slot, vis.frame_settings(app_state.targets()), detection_expected());
+				}
+
+				// once the first frame has been processed, both of these should be 0
+				lg::info("frame heap allocations: %llu", (unsigned long long) (heap_allocation_count() - old_heap_allocations));
+				lg::info("frame buffer allocations: %llu", (unsigned long long) (vis.buffer_allocations() - old_buffer_allocations));
+				if (run_detection) {
+					lg::info("frame processed pixels: %llu", (unsigned long long) vis.processed_pixels());
+				}
+
 				total_time += elapsed_time;
 				frames ++;
+				if (reused_targets) {
+					reused_frames ++;
+				}
+
+				if (realtime_flag && !realtime_entered && frames >= warmup_frames) {
+					enter_realtime();
+				}
+
+				if (vis.tuner().take_finished()) {
+					auto result = vis.tuner().save(tuning_profile);
+					if (result.is_err()) {
+						lg::warn("%s", result.to_string().c_str());
+					}
+				}
+
+				if (adaptive_quality_flag) {
+					if (quality_controller.record_frame(elapsed_time)) {
+						vis.set_quality(quality_controller.settings());
+						lg::info("changed to quality level %lu", (unsigned long) quality_controller.level());
+
+						if (mqtt_flag) {
+							snprintf(msg_buf, msg_buf_len, "quality %lu", (unsigned long) quality_controller.level());
+							auto result = mqtt_client->publish(mqtt_status_topic, std::string_view(msg_buf));
+							if (result.is_err()) {
+								lg::error("could not publish quality level to mqtt: %s", result.to_string().c_str());
+							}
+						}
+					}
+
+				}
+
+				if (thermal_flag && get_usec() - last_thermal_usec >= thermal_interval_usec) {
+					last_thermal_usec = get_usec();
+
+					ThermalLevel old_level = thermal_governor.state().level;
+					auto result = thermal_governor.update();
+					if (result.is_err()) {
+						lg::warn("%s", result.to_string().c_str());
+					} else {
+						const ThermalState& state = thermal_governor.state();
+
+						if (state.level != old_level) {
+							lg::info("thermal level changed to %s at %.1f degrees", thermal_level_to_string(state.level), state.temperature);
+
+							bool quality_changed = quality_controller.set_min_level(thermal_governor.min_quality_level());
+							if (!adaptive_quality_flag) {
+								// nothing else will raise the quality again once the cpu cools down
+								quality_changed |= quality_controller.reset_to_min_level();
+							}
+							if (quality_changed) {
+								vis.set_quality(quality_controller.settings());
+							}
+							vis.set_thread_limit(thermal_governor.thread_limit(threads));
+						}
+
+						if (mqtt_flag) {
+							snprintf(msg_buf, msg_buf_len, "thermal %s %.1f %ld", thermal_level_to_string(state.level), state.temperature, state.frequency / 1000);
+							auto result = mqtt_client->publish(mqtt_status_topic, std::string_view(msg_buf));
+							if (result.is_err()) {
+								lg::error("could not publish thermal state to mqtt: %s", result.to_string().c_str());
+							}
+						}
+					}
+				}
 
-				lg::info("instantaneous fps: %ld", std::min(1000000 / elapsed_time, max_fps));
-				lg::info("average fps: %ld\n", std::min(1000000 * frames / total_time, max_fps));
+				if (adaptive_quality_flag || thermal_flag) {
+					// only look near where targets were last seen, this has no effect unless the quality level is roi only
+					vis.set_roi(roi_around_targets(targets, frame_size, 0.5));
+				}
+
+				// frames that skip detection when tracking or using flow can take under a microsecond
+				lg::info("instantaneous fps: %ld", std::min(1000000 / std::max(elapsed_time, 1L), max_fps));
+				lg::info("average fps: %ld\n", std::min(1000000 * frames / std::max(total_time, 1L), max_fps));
+
+				// every few seconds, show how expensive each detector has been
+				if (frames % 300 == 0) {
+					vis.log_detector_stats();
+					scheduler.log_stats();
+					if (pre_realtime_stats.has_value()) {
+						scheduler.log_comparison("realtime mode", *pre_realtime_stats);
+					}
+					ThreadPool::global().log_stats();
+					if (motion_gating_flag) {
+						lg::info("motion gating: reused targets on %ld of the last 300 frames", reused_frames);
+						reused_frames = 0;
+					}
+
+					if (shadow.has_value()) {
+						ShadowStats stats = shadow->take_stats();
+						double matched = (double) std::max<u64>(stats.matched, 1);
+						long shadow_frames = (long) std::max<u64>(stats.frames, 1);
+						double speedup = stats.shadow_usec > 0 ? (double) stats.baseline_usec / stats.shadow_usec : 0.0;
+
+						lg::info("shadow pipeline: %llu frames (%llu dropped), %llu identical, %llu matched, %llu missing, %llu extra targets, "
+							"%f distance error, %f angle error, %ld usec baseline, %ld usec shadow, %.2fx speedup",
+							(unsigned long long) stats.frames, (unsigned long long) stats.dropped, (unsigned long long) stats.identical_frames,
+							(unsigned long long) stats.matched, (unsigned long long) stats.missing, (unsigned long long) stats.extra,
+							stats.distance_error / matched, stats.angle_error / matched, stats.baseline_usec / shadow_frames, stats.shadow_usec / shadow_frames, speedup);
+
+						if (mqtt_flag) {
+							snprintf(msg_buf, msg_buf_len, "shadow %llu %llu %llu %llu %llu %llu %f %f %ld %ld %f",
+								(unsigned long long) stats.frames, (unsigned long long) stats.dropped, (unsigned long long) stats.identical_frames,
+								(unsigned long long) stats.matched, (unsigned long long) stats.missing, (unsigned long long) stats.extra,
+								stats.distance_error / matched, stats.angle_error / matched, stats.baseline_usec / shadow_frames, stats.shadow_usec / shadow_frames, speedup);
+							auto result = mqtt_client->publish(mqtt_status_topic, std::string_view(msg_buf));
+							if (result.is_err()) {
+								lg::error("could not publish shadow stats to mqtt: %s", result.to_string().c_str());
+							}
+						}
+					}
+				}
 
 				if (mqtt_flag) {
+					// with motion gating, every target has an extra field saying if it was reused from the last frame
+					const char *reused_field = !motion_gating_flag ? "" : (reused_targets ? " 1" : " 0");
+
 					// true if serialization succeeded
-					bool serialize_good = true;
-
-					usize i = 0;
-					for (auto& target : targets) {
-						char *ptr = msg_buf + i;
-						usize n = msg_buf_len - i;
-						int result = snprintf(ptr, n, "%d %f %f %f", (int) target.type, target.distance, target.angle, target.score);
-						if (result < 0 || result >= n) {
-							serialize_good = false;
-							lg::error("targets could not fit in mqtt send buffer, skipping sending data");
-							break;
-						}
+					bool serialize_good;
+					if (track_flag) {
+						serialize_good = serialize_list(msg_buf, msg_buf_len, tracked_targets, [&] (char *buf, usize n, const TrackedTarget& target) {
+							return snprintf(buf, n, "%u %llu %f %f %f %f %f %d%s", target.id, (unsigned long long) target.type, target.distance, target.angle,
+								target.score, target.predicted_distance, target.predicted_angle, target.missed, reused_field);
+						});
+					} else {
+						serialize_good = serialize_list(msg_buf, msg_buf_len, targets, [&] (char *buf, usize n, const Target& target) {
+							return snprintf(buf, n, "%llu %f %f %f%s", (unsigned long long) target.type, target.distance, target.angle, target.score, reused_field);
+						});
 					}
 
-					if (serialize_good) {
-						auto result = mqtt_client->publish(mqtt_topic, std::string(msg_buf));
+					if (!serialize_good) {
+						lg::error("targets could not fit in mqtt send buffer, skipping sending data");
+					} else {
+						auto result = mqtt_client->publish(mqtt_topic, std::string_view(msg_buf));
 						if (result.is_err()) {
 							lg::error("could not publish vision data to mqtt: %s", result.to_string().c_str());
 						}
 					}
 				}
+
+				if (submit_shadow) {
+					// this only copies the frame, the shadow pipeline runs on its own thread
+					shadow->submit(frame, frame_settings, targets);
+
+					if (slot != nullptr) {
+						frame.release();
+						pipeline->release(slot, vis.frame_settings(app_state.targets()), detection_expected());
+					}
+				}
 				break;
 			}
 			case Mode::RemoteViewing: {
@@ -490,8 +1174,20 @@ int main(int argc, char **argv) {
 		// this is necessary to poll events for opencv highgui
 		if (display_flag) cv::pollKey();
 
-		// sleep until next frame occurs, or just continue looping if it is already ready
-		std::this_thread::sleep_until(next_frame_time);
+		// sleep until next frame occurs, or just continue looping if it is already late
+		u64 missed_frames = scheduler.wait_next_frame();
+		if (missed_frames > 0 && app_state.mode() == Mode::Vision) {
+			// frames captured while we were overrunning are already old, so drop them instead of processing them late
+			u64 stale_frames = std::min(missed_frames, max_stale_frames);
+			if (pipeline.has_value()) {
+				pipeline->skip_frames(stale_frames);
+			} else {
+				auto result = camera.skip_frames(stale_frames);
+				if (result.is_err()) {
+					lg::warn("%s", result.to_string().c_str());
+				}
+			}
+		}
 	}
 
 	if (mqtt_flag) {
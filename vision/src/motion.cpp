@@ -0,0 +1,112 @@
+#include "motion.h"
+#include <stdlib.h>
+
+bool compute_signature(const cv::Mat& img, const MotionParams& params, FrameSignature& out) {
+	if (img.depth() != CV_8U || img.empty()) {
+		return false;
+	}
+
+	int channels = img.channels();
+	int step = std::max(params.sample_step, 1);
+
+	out.grid = TileGrid {
+		.size = img.size(),
+		.tile_rows = std::clamp(params.tile_rows, 1, img.rows),
+		.tile_cols = std::clamp(params.tile_cols, 1, img.cols),
+	};
+	out.channels = channels;
+	out.means.resize(out.grid.count() * channels);
+
+	for (int i = 0; i < out.grid.count(); i ++) {
+		cv::Rect tile = out.grid.tile(i);
+
+		// a tile is at most a few thousand samples, so this can't overflow
+		u32 sums[4] = { 0, 0, 0, 0 };
+		u32 samples = 0;
+		for (int y = tile.y; y < tile.y + tile.height; y += step) {
+			const u8 *row = img.ptr<u8>(y);
+			for (int x = tile.x; x < tile.x + tile.width; x += step) {
+				const u8 *pixel = row + x * channels;
+				for (int c = 0; c < channels && c < 4; c ++) {
+					sums[c] += pixel[c];
+				}
+				samples ++;
+			}
+		}
+
+		for (int c = 0; c < channels; c ++) {
+			out.means[i * channels + c] = c < 4 ? (u8) (sums[c] / samples) : 0;
+		}
+	}
+
+	return true;
+}
+
+usize find_changed_tiles(const FrameSignature& old_signature, const FrameSignature& new_signature, int threshold, std::vector<u8>& changed) {
+	usize tile_count = new_signature.grid.count();
+	changed.resize(tile_count);
+
+	bool same_layout = old_signature.grid.size == new_signature.grid.size
+		&& old_signature.grid.tile_rows == new_signature.grid.tile_rows
+		&& old_signature.grid.tile_cols == new_signature.grid.tile_cols
+		&& old_signature.channels == new_signature.channels;
+	if (!same_layout) {
+		std::fill(changed.begin(), changed.end(), 1);
+		return tile_count;
+	}
+
+	int channels = new_signature.channels;
+	usize changed_count = 0;
+	for (usize i = 0; i < tile_count; i ++) {
+		changed[i] = 0;
+		for (int c = 0; c < channels; c ++) {
+			int diff = abs((int) old_signature.means[i * channels + c] - (int) new_signature.means[i * channels + c]);
+			if (diff > threshold) {
+				changed[i] = 1;
+				changed_count ++;
+				break;
+			}
+		}
+	}
+
+	return changed_count;
+}
+
+void update_changed_tiles(FrameSignature& signature, const FrameSignature& new_signature, const std::vector<u8>& changed) {
+	if (signature.means.size() != new_signature.means.size()) {
+		signature = new_signature;
+		return;
+	}
+
+	int channels = new_signature.channels;
+	for (usize i = 0; i < changed.size(); i ++) {
+		if (changed[i]) {
+			std::copy_n(&new_signature.means[i * channels], channels, &signature.means[i * channels]);
+		}
+	}
+}
+
+void changed_regions(const FrameSignature& signature, const std::vector<u8>& changed, std::vector<cv::Rect>& regions) {
+	const TileGrid& grid = signature.grid;
+	regions.clear();
+
+	for (int row = 0; row < grid.tile_rows; row ++) {
+		int col = 0;
+		while (col < grid.tile_cols) {
+			if (!changed[row * grid.tile_cols + col]) {
+				col ++;
+				continue;
+			}
+
+			int run_begin = col;
+			while (col < grid.tile_cols && changed[row * grid.tile_cols + col]) {
+				col ++;
+			}
+
+			// the tiles in a row all have the same y and height, so the run is the span from the first to the last tile
+			cv::Rect first = grid.tile(row * grid.tile_cols + run_begin);
+			cv::Rect last = grid.tile(row * grid.tile_cols + col - 1);
+			regions.push_back(first | last);
+		}
+	}
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include "types.h"
+#include "parallel.h"
+
+struct MotionParams {
+	// the frame is split into this many tiles across and down
+	int tile_cols { 16 };
+	int tile_rows { 12 };
+	// only every sample_step'th pixel in each direction is read, so the signature is about as cheap as a tiny thumbnail
+	int sample_step { 4 };
+	// a tile has changed if the mean of any of its channels has moved by more than this
+	// this should be above the camera's noise, but below what a target moving into the tile would cause
+	int threshold { 6 };
+};
+
+// coarse summary of a frame, the mean of each channel of each tile
+struct FrameSignature {
+	TileGrid grid {};
+	int channels { 0 };
+	// channels means for each tile, tile by tile in the same order as the grid
+	std::vector<u8> means {};
+};
+
+// computes the signature of img, out's memory is reused so this does not allocate once out has been used once
+// returns false if img is not an 8 bit image, since the signature can't be computed for it
+bool compute_signature(const cv::Mat& img, const MotionParams& params, FrameSignature& out);
+
+// sets changed[i] to 1 for every tile that differs between old_signature and new_signature by more than threshold, and 0 otherwise
+// if the signatures are of different sized frames, every tile is changed
+// returns the number of changed tiles
+usize find_changed_tiles(const FrameSignature& old_signature, const FrameSignature& new_signature, int threshold, std::vector<u8>& changed);
+
+// copies only the changed tiles from new_signature to signature
+// this way a tile that slowly drifts will still be seen as changed once it has drifted far enough from when it was last processed
+void update_changed_tiles(FrameSignature& signature, const FrameSignature& new_signature, const std::vector<u8>& changed);
+
+// merges runs of changed tiles in each row of tiles into rects in frame coordinates, and writes them to regions
+void changed_regions(const FrameSignature& signature, const std::vector<u8>& changed, std::vector<cv::Rect>& regions);
@@ -1,4 +1,109 @@
+#pragma once
+
 #include <opencv2/opencv.hpp>
-#include <functional>
+#include <algorithm>
+#include <array>
+#include <utility>
+#include "types.h"
+#include "thread_pool.h"
+
+// limits how finely an image is split up, since each tile has some overhead
+struct TileGrain {
+	// tiles will not be shorter than this many rows
+	int min_rows { 8 };
+	// tiles will not be narrower than this many columns
+	int min_cols { 64 };
+	// tiles will not have fewer pixels than this, so tiny images are processed on the calling thread in one piece
+	int min_pixels { 4096 };
+};
+
+// how an image is split into a grid of tiles
+struct TileGrid {
+	cv::Size size;
+	int tile_rows;
+	int tile_cols;
+
+	// splits an image of the given size into at most threads tiles
+	// rows are split first, since a tile that covers whole rows is contiguous in memory
+	static TileGrid make(cv::Size size, int threads, const TileGrain& grain) {
+		int max_tiles = std::clamp(size.area() / std::max(grain.min_pixels, 1), 1, std::max(threads, 1));
+		int tile_rows = std::clamp(size.height / std::max(grain.min_rows, 1), 1, max_tiles);
+		int tile_cols = std::clamp(size.width / std::max(grain.min_cols, 1), 1, max_tiles / tile_rows);
+
+		return TileGrid {
+			.size = size,
+			.tile_rows = tile_rows,
+			.tile_cols = tile_cols,
+		};
+	}
+
+	int count() const {
+		return tile_rows * tile_cols;
+	}
+
+	// the rect of the tile at index, tiles are numbered left to right then top to bottom
+	cv::Rect tile(int index) const {
+		int row = index / tile_cols;
+		int col = index % tile_cols;
+
+		// the bounds are each computed from the full size, so rounding can never leave a gap between tiles
+		int row_begin = size.height * row / tile_rows;
+		int row_end = size.height * (row + 1) / tile_rows;
+		int col_begin = size.width * col / tile_cols;
+		int col_end = size.width * (col + 1) / tile_cols;
+
+		return cv::Rect(col_begin, row_begin, col_end - col_begin, row_end - row_begin);
+	}
+};
+
+// calls func with the view of rect in each of the mats
+template<typename F, usize N>
+inline void process_tile(F& func, const std::array<cv::Mat, N>& mats, cv::Rect rect) {
+	[&]<usize... I>(std::index_sequence<I...>) {
+		func(mats[I](rect)...);
+	}(std::make_index_sequence<N> {});
+}
+
+// splits all the mats into the same grid of tiles, and calls func on each tile using up to threads threads from the global thread pool
+// func is called with one view per mat, in the same order the mats are passed in, so it can have any number of inputs and outputs
+// every mat must be the same size, and outputs must already be allocated, since func only gets views into them
+// func is a template paramater instead of a std::function so the kernel can be inlined, and a lambda with captures never allocates
+template<typename F, typename... Mats>
+void parallel_tiles(int threads, const TileGrain& grain, F&& func, const Mats&... mats) {
+	static_assert(sizeof...(Mats) > 0, "parallel_tiles needs at least one mat");
+
+	// copying a cv::Mat only copies the header
+	const std::array<cv::Mat, sizeof...(Mats)> mat_array { mats... };
+	cv::Size size = mat_array[0].size();
+	for (const auto& mat : mat_array) {
+		CV_Assert(mat.size() == size);
+	}
+
+	TileGrid grid = TileGrid::make(size, threads, grain);
+	if (grid.count() == 1) {
+		process_tile(func, mat_array, cv::Rect(cv::Point(0, 0), size));
+	} else {
+		ThreadPool::global().parallel_for(grid.count(), [&] (int i) {
+			process_tile(func, mat_array, grid.tile(i));
+		}, grid.count());
+	}
+}
+
+// runs func on horizontal bands of in and out in parallel, func should only do per pixel operations
+template<typename F>
+void parallel_process(cv::Mat in, cv::Mat out, F&& func, int threads) {
+	parallel_tiles(threads, TileGrain {}, func, in, out);
+}
 
-void parallel_process(cv::Mat in, cv::Mat out, std::function<void(cv::Mat, cv::Mat)> func, int threads);
+// calls func with every index from 0 to count, using up to threads threads from the global thread pool
+// func is a template paramater instead of a std::function so a lambda with captures never allocates
+template<typename F>
+void parallel_for_index(int count, F&& func, int threads) {
+	if (threads <= 1 || count <= 1) {
+		for (int i = 0; i < count; i ++) {
+			func(i);
+		}
+	} else {
+		ThreadPool::global().parallel_for(count, func, threads);
+	}
+}
@@ -0,0 +1,161 @@
+#include "params.h"
+#include <stdlib.h>
+#include <algorithm>
+#include "logging.h"
+
+// updates that are waiting to be applied, more than this and submit drops the update
+static constexpr usize max_queued_updates = 32;
+
+std::optional<ParamUpdate> parse_param_update(std::string_view command) {
+	// split on spaces into target id, field and values
+	std::array<std::string_view, 5> words;
+	usize word_count = 0;
+	while (!command.empty()) {
+		usize space = command.find(' ');
+		std::string_view word = command.substr(0, space);
+		if (!word.empty()) {
+			if (word_count == words.size()) {
+				return {};
+			}
+			words[word_count] = word;
+			word_count ++;
+		}
+		command = space == std::string_view::npos ? std::string_view() : command.substr(space + 1);
+	}
+
+	if (word_count < 3) {
+		return {};
+	}
+
+	ParamUpdate update {
+		.target_id = std::string(words[0]),
+		.field = std::string(words[1]),
+		.values = { 0.0, 0.0, 0.0 },
+		.value_count = word_count - 2,
+	};
+
+	for (usize i = 0; i < update.value_count; i ++) {
+		// strtod needs a null terminated string
+		std::string value(words[i + 2]);
+		char *end;
+		update.values[i] = strtod(value.c_str(), &end);
+		if (end == value.c_str() || *end != '\0') {
+			return {};
+		}
+	}
+
+	return update;
+}
+
+Error apply_param_update(TargetSearchData& target, const ParamUpdate& update, bool& template_changed) {
+	const auto& field = update.field;
+	const auto& values = update.values;
+	template_changed = false;
+
+	if (field == "thresh_min" || field == "thresh_max") {
+		if (update.value_count != 3) {
+			return Error::invalid_args(field + " needs 3 values, h s v");
+		}
+
+		cv::Scalar& thresh = field == "thresh_min" ? target.params.thresh_min : target.params.thresh_max;
+		thresh = cv::Scalar(values[0], values[1], values[2]);
+		// the template is thresholded with the same values as the frames
+		template_changed = true;
+		return Error::ok();
+	}
+
+	if (update.value_count != 1) {
+		return Error::invalid_args(field + " needs 1 value");
+	}
+
+	if (field == "target_height") {
+		target.params.target_height = values[0];
+	} else if (field == "scale") {
+		target.params.scale = values[0];
+	} else if (field == "min_score") {
+		target.min_score = values[0];
+	} else if (field == "weights.contour_match") {
+		target.weights.contour_match = values[0];
+	} else if (field == "weights.area_frac") {
+		target.weights.area_frac = values[0];
+	} else if (field == "weights.aspect_ratio") {
+		target.weights.aspect_ratio = values[0];
+	} else {
+		return Error::invalid_args("unknown target paramater '" + field + "'");
+	}
+
+	// the same checks as when the target config is loaded
+	return target.check_params();
+}
+
+ParamUpdater::ParamUpdater(Vision& vision):
+m_vision(vision),
+m_updates(max_queued_updates),
+m_latest(vision.target_data()) {
+	m_thread = std::thread(&ParamUpdater::run, this);
+}
+
+ParamUpdater::~ParamUpdater() {
+	m_updates.close();
+	m_thread.join();
+}
+
+bool ParamUpdater::submit(std::string_view command) {
+	auto update = parse_param_update(command);
+	if (!update.has_value()) {
+		return false;
+	}
+
+	// the mqtt thread calls this, and blocking it would hold up every other control message, so a flood of updates is dropped instead
+	if (!m_updates.try_push(std::move(*update))) {
+		lg::warn("too many paramater updates waiting to be applied, dropped '%.*s'", (int) command.size(), command.data());
+	}
+	return true;
+}
+
+void ParamUpdater::run() {
+	for (;;) {
+		auto update = m_updates.pop();
+		if (!update.has_value()) {
+			return;
+		}
+
+		auto result = apply(*update);
+		if (result.is_err()) {
+			lg::warn("could not update %s %s: %s", update->target_id.c_str(), update->field.c_str(), result.to_string().c_str());
+		}
+	}
+}
+
+Error ParamUpdater::apply(const ParamUpdate& update) {
+	// the snapshot that was published can't be changed, so the change is made to a copy
+	// the template images are shared by the copies, only their headers are copied
+	std::vector<TargetSearchData> targets = m_latest->targets;
+
+	auto target = std::find_if(targets.begin(), targets.end(), [&] (const TargetSearchData& target_data) {
+		return target_data.id == update.target_id;
+	});
+	if (target == targets.end()) {
+		return Error::invalid_args("no target with id '" + update.target_id + "'");
+	}
+
+	bool template_changed;
+	auto result = apply_param_update(*target, update, template_changed);
+	if (result.is_err()) {
+		return result;
+	}
+
+	if (template_changed) {
+		cv::Mat processed;
+		if (!target->process_template(processed)) {
+			return Error::invalid_args("no contours are left in the template of " + target->name + " with the new thresholds");
+		}
+	}
+
+	m_latest = make_target_snapshot(std::move(targets), m_latest->version + 1);
+	m_vision.publish_target_data(m_latest);
+	lg::info("published target data version %llu with %s %s changed", (unsigned long long) m_latest->version,
+		update.target_id.c_str(), update.field.c_str());
+
+	return Error::ok();
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <array>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include "types.h"
+#include "error.h"
+#include "vision.h"
+#include "bounded_queue.h"
+
+// a change to one paramater of one target
+struct ParamUpdate {
+	std::string target_id;
+	std::string field;
+	std::array<double, 3> values;
+	usize value_count;
+};
+
+// parses "<target id> <field> <values...>", like "red_ball thresh_min 130 75 127" or "blue_ball weights.area_frac 0.5"
+// the fields are thresh_min, thresh_max, target_height, scale, min_score, weights.contour_match, weights.area_frac and weights.aspect_ratio
+// returns none if the command is not in that form, the target and field are checked when the update is applied
+std::optional<ParamUpdate> parse_param_update(std::string_view command);
+
+// applies update to target, and sets template_changed if the template has to be processed again
+// returns error if the field does not exist, has the wrong number of values, or is set to a value out of range
+// target may still have been changed when an error is returned, so it should be a copy that is thrown away on error
+Error apply_param_update(TargetSearchData& target, const ParamUpdate& update, bool& template_changed);
+
+// applies paramater updates on its own thread and publishes the result to vision as a new target snapshot
+// anything expensive that depends on the paramaters, like the template contours and threshold ranges, is rebuilt on this thread,
+// so the frame loop only ever has to pick up the finished snapshot
+class ParamUpdater {
+	public:
+		// vision's templates must already be processed
+		explicit ParamUpdater(Vision& vision);
+		~ParamUpdater();
+
+		// queues an update to be applied, can be called from any thread
+		// this never blocks, if too many updates are already waiting the update is dropped and a warning is logged
+		// returns false if the command could not be parsed
+		bool submit(std::string_view command);
+
+	private:
+		void run();
+		Error apply(const ParamUpdate& update);
+
+		Vision& m_vision;
+		BoundedQueue<ParamUpdate> m_updates;
+		// the newest snapshot, which the next update is applied on top of, only used by the updater thread
+		std::shared_ptr<const TargetSnapshot> m_latest;
+		std::thread m_thread;
+};
@@ -0,0 +1,122 @@
+#include "pipeline.h"
+#include "util.h"
+#include "logging.h"
+#include "realtime.h"
+#include "scheduler.h"
+
+FramePipeline::FramePipeline(VisionCamera& camera, Vision& vision, usize slots, TargetType targets):
+m_camera(camera),
+m_vision(vision),
+m_free(slots),
+m_ready(slots) {
+	// used until the slots are released with the caller's settings
+	FrameSettings settings = vision.frame_settings(targets);
+	for (usize i = 0; i < slots; i ++) {
+		m_slots.push_back(std::make_unique<FrameSlot>(FrameSlot {
+			.frame = cv::Mat(),
+			.read_result = Error::ok(),
+			.timestamp = 0.0,
+			.settings = settings,
+			.preprocess = true,
+			.buffers = FrameBuffers {},
+		}));
+		m_free.push(m_slots.back().get());
+	}
+}
+
+FramePipeline::~FramePipeline() {
+	stop();
+}
+
+void FramePipeline::start() {
+	if (m_running) {
+		return;
+	}
+
+	m_running = true;
+	m_thread = std::thread(&FramePipeline::run, this);
+
+	if (m_realtime_priority.has_value()) {
+		auto result = set_thread_realtime(m_thread.native_handle(), *m_realtime_priority);
+		if (result.is_err()) {
+			lg::warn("%s", result.to_string().c_str());
+		}
+	}
+}
+
+void FramePipeline::stop() {
+	if (!m_running) {
+		return;
+	}
+
+	m_free.close();
+	m_ready.close();
+	m_thread.join();
+	m_running = false;
+
+	// put every slot back so the pipeline can be started again
+	m_free.reopen();
+	m_ready.reopen();
+	for (auto& slot : m_slots) {
+		m_free.push(slot.get());
+	}
+}
+
+bool FramePipeline::running() const {
+	return m_running;
+}
+
+void FramePipeline::skip_frames(u64 count) {
+	m_skip_frames += count;
+}
+
+Error FramePipeline::set_realtime_priority(int priority) {
+	m_realtime_priority = priority;
+	if (m_running) {
+		return set_thread_realtime(m_thread.native_handle(), priority);
+	}
+	return Error::ok();
+}
+
+FrameSlot *FramePipeline::next_frame() {
+	return m_ready.pop().value_or(nullptr);
+}
+
+void FramePipeline::release(FrameSlot *slot, const FrameSettings& settings, bool preprocess) {
+	// pushing the slot hands it to the worker, so this is the last time this thread touches it
+	slot->settings = settings;
+	slot->preprocess = preprocess;
+	m_free.push(slot);
+}
+
+void FramePipeline::run() {
+	for (;;) {
+		auto next_slot = m_free.pop();
+		if (!next_slot.has_value()) {
+			// pipeline is stopping
+			return;
+		}
+		FrameSlot *slot = *next_slot;
+
+		u64 skip = m_skip_frames.exchange(0);
+		if (skip > 0) {
+			auto result = m_camera.skip_frames(skip);
+			if (result.is_err()) {
+				lg::warn("%s", result.to_string().c_str());
+			}
+		}
+
+		slot->read_result = m_camera.read_to(slot->frame);
+		slot->timestamp = get_monotonic_nsec() / 1e9;
+
+		if (slot->read_result.is_ok() && slot->preprocess) {
+			time("preprocess", [&] () {
+				m_vision.preprocess(slot->frame, slot->settings, slot->buffers);
+			});
+		}
+
+		if (!m_ready.push(slot)) {
+			return;
+		}
+	}
+}
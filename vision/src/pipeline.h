@@ -0,0 +1,72 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <vector>
+#include "types.h"
+#include "error.h"
+#include "vision.h"
+#include "bounded_queue.h"
+
+// one frame moving through the pipeline, along with the buffers it is preprocessed into
+struct FrameSlot {
+	cv::Mat frame;
+	// result of reading the frame from the camera, the frame is not preprocessed if this is an error
+	Error read_result { Error::ok() };
+	// time the frame was read in seconds on the monotonic clock
+	double timestamp { 0.0 };
+	FrameSettings settings;
+	// the worker only preprocesses the frame if this is set, so frames that won't be detected aren't preprocessed for nothing
+	bool preprocess { true };
+	FrameBuffers buffers {};
+};
+
+// overlaps the stages of consecutive frames
+// a worker thread reads frames from the camera and preprocesses them, while the caller runs detection on the previous frame
+// frames are passed around in a fixed number of slots, so the worker can never get more than that many frames ahead, which bounds latency
+class FramePipeline {
+	public:
+		// slots must be at least 2 for any stages to overlap
+		// targets are looked for in the frames read before the first slot is released
+		FramePipeline(VisionCamera& camera, Vision& vision, usize slots, TargetType targets);
+		~FramePipeline();
+
+		// starts the worker thread, the camera must already be started
+		void start();
+		// stops the worker thread, every slot from next_frame must have been released first
+		void stop();
+		bool running() const;
+
+		// the worker will drop this many frames before reading the next one
+		void skip_frames(u64 count);
+
+		// runs the worker with the SCHED_FIFO policy at priority, now if it is running and every time it is started again
+		Error set_realtime_priority(int priority);
+
+		// waits for the next preprocessed frame
+		// the slot must be given back with release once it is no longer needed
+		FrameSlot *next_frame();
+		// the next frame read into the slot is preprocessed with settings, if preprocess is true
+		// the settings go with the slot, so changing them doesn't need a lock of its own
+		void release(FrameSlot *slot, const FrameSettings& settings, bool preprocess);
+
+	private:
+		void run();
+
+		VisionCamera& m_camera;
+		Vision& m_vision;
+
+		std::vector<std::unique_ptr<FrameSlot>> m_slots {};
+		// slots waiting to be read into
+		BoundedQueue<FrameSlot *> m_free;
+		// slots that have been preprocessed and are waiting for detection
+		BoundedQueue<FrameSlot *> m_ready;
+
+		std::atomic<u64> m_skip_frames { 0 };
+
+		std::thread m_thread {};
+		bool m_running { false };
+		std::optional<int> m_realtime_priority {};
+};
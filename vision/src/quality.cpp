@@ -0,0 +1,97 @@
+#include "quality.h"
+#include <algorithm>
+
+// a frame taking longer than this fraction of the deadline counts as late
+static constexpr double late_fraction = 0.9;
+// a frame taking less than this fraction of the deadline counts as early
+static constexpr double early_fraction = 0.6;
+// how many late frames in a row it takes to lower the quality
+static constexpr int late_frames_to_step_down = 5;
+// how many early frames in a row it takes to raise the quality, this is longer so the quality does not go up too eagerly
+static constexpr int early_frames_to_step_up = 60;
+
+std::vector<QualitySettings> default_quality_levels() {
+	return std::vector<QualitySettings> {
+		full_quality,
+		QualitySettings { .scale = 1.0, .morph_iterations = 0, .max_targets = SIZE_MAX, .roi_only = false },
+		QualitySettings { .scale = 0.75, .morph_iterations = 0, .max_targets = SIZE_MAX, .roi_only = false },
+		QualitySettings { .scale = 0.5, .morph_iterations = 0, .max_targets = SIZE_MAX, .roi_only = false },
+		QualitySettings { .scale = 0.5, .morph_iterations = 0, .max_targets = SIZE_MAX, .roi_only = true },
+		QualitySettings { .scale = 0.5, .morph_iterations = 0, .max_targets = 1, .roi_only = true },
+	};
+}
+
+std::optional<cv::Rect> roi_around_targets(const std::vector<Target>& targets, cv::Size frame_size, double margin) {
+	if (targets.empty()) {
+		return {};
+	}
+
+	cv::Rect roi = targets[0].bounding_box;
+	for (const auto& target : targets) {
+		const auto& box = target.bounding_box;
+		int margin_x = (int) (box.width * margin);
+		int margin_y = (int) (box.height * margin);
+		roi |= cv::Rect(box.x - margin_x, box.y - margin_y, box.width + 2 * margin_x, box.height + 2 * margin_y);
+	}
+
+	return roi & cv::Rect(cv::Point(0, 0), frame_size);
+}
+
+QualityController::QualityController(long deadline_usec, std::vector<QualitySettings>&& levels):
+m_deadline_usec(deadline_usec),
+m_levels(std::move(levels)) {}
+
+bool QualityController::record_frame(long elapsed_usec) {
+	usize old_level = m_level;
+
+	if (elapsed_usec > m_deadline_usec * late_fraction) {
+		m_late_frames ++;
+		m_early_frames = 0;
+	} else if (elapsed_usec < m_deadline_usec * early_fraction) {
+		m_early_frames ++;
+		m_late_frames = 0;
+	} else {
+		m_late_frames = 0;
+		m_early_frames = 0;
+	}
+
+	if (m_late_frames >= late_frames_to_step_down && m_level + 1 < m_levels.size()) {
+		set_level(m_level + 1);
+	} else if (m_early_frames >= early_frames_to_step_up && m_level > m_min_level) {
+		set_level(m_level - 1);
+	}
+
+	return m_level != old_level;
+}
+
+usize QualityController::level() const {
+	return m_level;
+}
+
+const QualitySettings& QualityController::settings() const {
+	return m_levels[m_level];
+}
+
+bool QualityController::set_min_level(usize level) {
+	m_min_level = std::min(level, m_levels.size() - 1);
+	if (m_level < m_min_level) {
+		set_level(m_min_level);
+		return true;
+	}
+	return false;
+}
+
+bool QualityController::reset_to_min_level() {
+	if (m_level != m_min_level) {
+		set_level(m_min_level);
+		return true;
+	}
+	return false;
+}
+
+void QualityController::set_level(usize level) {
+	m_level = level;
+	// start counting again at the new level
+	m_late_frames = 0;
+	m_early_frames = 0;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <opencv2/core/types.hpp>
+#include <optional>
+#include <vector>
+#include "types.h"
+#include "target.h"
+
+// settings that trade detection quality for speed
+struct QualitySettings {
+	// multiplied with each target's own processing scale
+	double scale;
+	// iterations of morphology opening, 0 skips morphology
+	int morph_iterations;
+	// at most this many targets are looked for, in the order of the target data
+	usize max_targets;
+	// only process the area around the targets found in the last frame
+	bool roi_only;
+};
+
+// full quality, this is what Vision uses if the controller is not enabled
+constexpr QualitySettings full_quality = QualitySettings {
+	.scale = 1.0,
+	.morph_iterations = 1,
+	.max_targets = SIZE_MAX,
+	.roi_only = false,
+};
+
+// quality levels from best to worst used by default
+std::vector<QualitySettings> default_quality_levels();
+
+// region around all the targets to process on the next frame when roi_only is set
+// each target's box is grown by margin times its size on every side so moving targets stay inside the region
+// returns none if there are no targets, so the whole frame is searched again
+std::optional<cv::Rect> roi_around_targets(const std::vector<Target>& targets, cv::Size frame_size, double margin);
+
+// watches how long each frame takes to process compared to the frame deadline,
+// and steps the quality down when frames are running late, and back up when there is plenty of time left
+// levels only change after several frames in a row are late or early, so the level doesn't bounce back and forth
+class QualityController {
+	public:
+		QualityController(long deadline_usec, std::vector<QualitySettings>&& levels);
+
+		// call after each frame is processed
+		// returns true if the level has changed
+		bool record_frame(long elapsed_usec);
+
+		// 0 is the best quality level
+		usize level() const;
+		const QualitySettings& settings() const;
+
+		// the controller will never go to a level better than this, used to force lower quality
+		// returns true if the level has changed
+		bool set_min_level(usize level);
+		// goes straight to the min level, used when record_frame is not being called so the level can't step back up on its own
+		// returns true if the level has changed
+		bool reset_to_min_level();
+
+	private:
+		void set_level(usize level);
+
+		long m_deadline_usec;
+		std::vector<QualitySettings> m_levels;
+		usize m_level { 0 };
+		usize m_min_level { 0 };
+
+		// frames in a row that have been over or under the thresholds
+		int m_late_frames { 0 };
+		int m_early_frames { 0 };
+};
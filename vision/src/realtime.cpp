@@ -0,0 +1,60 @@
+#include "realtime.h"
+#include <errno.h>
+#include <malloc.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <string>
+
+// how much stack prefault_stack touches
+static constexpr usize prefault_stack_size = 256 * 1024;
+static constexpr usize page_size = 4096;
+
+Error lock_memory() {
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+		return Error::invalid_operation("could not lock memory: " + std::string(strerror(errno)));
+	}
+
+	// freed memory stays in the heap, so it is still locked and mapped when it is allocated again
+	mallopt(M_TRIM_THRESHOLD, -1);
+	// large allocations would otherwise get their own mmap, which is unmapped again when freed
+	mallopt(M_MMAP_MAX, 0);
+
+	return Error::ok();
+}
+
+void prefault_stack() {
+	u8 stack[prefault_stack_size];
+	// writing through a volatile pointer stops the compiler from removing the writes, since the array is never read
+	volatile u8 *pages = stack;
+	for (usize i = 0; i < prefault_stack_size; i += page_size) {
+		pages[i] = 0;
+	}
+}
+
+Error set_thread_realtime(pthread_t thread, int priority) {
+	struct sched_param param;
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = priority;
+
+	int result = pthread_setschedparam(thread, SCHED_FIFO, &param);
+	if (result != 0) {
+		return Error::invalid_operation("could not set SCHED_FIFO priority " + std::to_string(priority) + ": " + std::string(strerror(result)));
+	}
+	return Error::ok();
+}
+
+Error set_current_thread_realtime(int priority) {
+	return set_thread_realtime(pthread_self(), priority);
+}
+
+Error set_current_thread_idle() {
+	struct sched_param param;
+	memset(&param, 0, sizeof(param));
+
+	int result = pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+	if (result != 0) {
+		return Error::invalid_operation("could not set SCHED_IDLE: " + std::string(strerror(result)));
+	}
+	return Error::ok();
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <pthread.h>
+#include "types.h"
+#include "error.h"
+
+// these all need root or CAP_SYS_NICE and CAP_IPC_LOCK, without them they return an error and change nothing,
+// so the program can keep running normally
+
+// locks every page the process has now and will have in the future into memory,
+// and stops malloc from giving freed memory back to the os, so the frame loop never page faults
+// this should be done after warm up, once every buffer has been allocated
+Error lock_memory();
+
+// touches a chunk of stack so the pages are already mapped when deep calls need them
+void prefault_stack();
+
+// runs thread with the SCHED_FIFO policy at priority, which goes from 1 to 99
+// a SCHED_FIFO thread is never preempted by normal processes like the mqtt broker or sshd
+Error set_thread_realtime(pthread_t thread, int priority);
+Error set_current_thread_realtime(int priority);
+
+// runs the calling thread with the SCHED_IDLE policy, so it only gets cpu time that no other thread wants
+// unlike the rest of these, lowering a thread's priority doesn't need any permissions
+Error set_current_thread_idle();
@@ -0,0 +1,113 @@
+#include "scheduler.h"
+#include "logging.h"
+#include <errno.h>
+#include <time.h>
+
+static constexpr u64 nsec_per_sec = 1000000000;
+
+u64 get_monotonic_nsec() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64) ts.tv_sec * nsec_per_sec + (u64) ts.tv_nsec;
+}
+
+// sleeps until the monotonic clock reaches deadline_nsec
+static void sleep_until_nsec(u64 deadline_nsec) {
+	struct timespec ts;
+	ts.tv_sec = deadline_nsec / nsec_per_sec;
+	ts.tv_nsec = deadline_nsec % nsec_per_sec;
+
+	// the sleep is absolute, so it can just be restarted with the same deadline if a signal interrupts it
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {}
+}
+
+void JitterHistogram::record(long jitter_usec) {
+	usize bucket = 0;
+	while (bucket < bucket_bounds_usec.size() && jitter_usec > bucket_bounds_usec[bucket]) {
+		bucket ++;
+	}
+	buckets[bucket] ++;
+	total_usec += jitter_usec;
+	samples ++;
+
+	if (jitter_usec > max_usec) {
+		max_usec = jitter_usec;
+	}
+}
+
+FrameScheduler::FrameScheduler(long fps):
+m_period_nsec(nsec_per_sec / fps) {}
+
+u64 FrameScheduler::wait_next_frame() {
+	u64 now = get_monotonic_nsec();
+	m_stats.frames ++;
+
+	if (m_next_deadline == 0) {
+		// first frame, start the deadlines from now
+		m_next_deadline = now + m_period_nsec;
+		return 0;
+	}
+
+	u64 missed = 0;
+	if (now > m_next_deadline) {
+		// the deadline has already passed, so don't sleep, and work out how many whole periods were missed
+		missed = (now - m_next_deadline) / m_period_nsec;
+		if (missed > 0) {
+			m_stats.overruns ++;
+			m_stats.skipped_frames += missed;
+		}
+
+		// move to the deadline just before now, so the next frame still lines up with the original period
+		m_next_deadline += missed * m_period_nsec;
+		m_stats.jitter.record((long) ((now - m_next_deadline) / 1000));
+	} else {
+		sleep_until_nsec(m_next_deadline);
+		m_stats.jitter.record((long) ((get_monotonic_nsec() - m_next_deadline) / 1000));
+	}
+
+	m_next_deadline += m_period_nsec;
+	return missed;
+}
+
+long FrameScheduler::period_usec() const {
+	return (long) (m_period_nsec / 1000);
+}
+
+const SchedulerStats& FrameScheduler::stats() const {
+	return m_stats;
+}
+
+void FrameScheduler::log_stats() const {
+	lg::info("scheduler: %llu frames, %llu overruns, %llu skipped frames, %ld usec max jitter",
+		(unsigned long long) m_stats.frames, (unsigned long long) m_stats.overruns,
+		(unsigned long long) m_stats.skipped_frames, m_stats.jitter.max_usec);
+
+	const auto& bounds = JitterHistogram::bucket_bounds_usec;
+	for (usize i = 0; i < m_stats.jitter.buckets.size(); i ++) {
+		if (i < bounds.size()) {
+			lg::info("  jitter <= %ld usec: %llu", bounds[i], (unsigned long long) m_stats.jitter.buckets[i]);
+		} else {
+			lg::info("  jitter > %ld usec: %llu", bounds.back(), (unsigned long long) m_stats.jitter.buckets[i]);
+		}
+	}
+}
+
+SchedulerStats FrameScheduler::reset_stats() {
+	SchedulerStats old_stats = m_stats;
+	m_stats = SchedulerStats {};
+	return old_stats;
+}
+
+// average of a total, or 0 if there are no samples
+static double average(double total, u64 samples) {
+	return samples == 0 ? 0.0 : total / samples;
+}
+
+void FrameScheduler::log_comparison(const char *label, const SchedulerStats& before) const {
+	const auto& after = m_stats;
+	lg::info("%s: average jitter %.1f usec -> %.1f usec, max jitter %ld usec -> %ld usec, overruns per 1000 frames %.1f -> %.1f",
+		label,
+		average(before.jitter.total_usec, before.jitter.samples), average(after.jitter.total_usec, after.jitter.samples),
+		before.jitter.max_usec, after.jitter.max_usec,
+		average(1000.0 * before.overruns, before.frames), average(1000.0 * after.overruns, after.frames));
+}
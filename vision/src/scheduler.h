@@ -0,0 +1,59 @@
+#pragma once
+
+#include <array>
+#include "types.h"
+
+// gets nanoseconds on the monotonic clock, which is not affected by changes to the system time
+u64 get_monotonic_nsec();
+
+// how late the scheduler woke up compared to the deadline
+struct JitterHistogram {
+	// upper bound in microseconds of each bucket, the last bucket holds everything later than the last bound
+	static constexpr std::array<long, 7> bucket_bounds_usec { 50, 100, 250, 500, 1000, 2000, 5000 };
+
+	std::array<u64, bucket_bounds_usec.size() + 1> buckets {};
+	long max_usec { 0 };
+	long total_usec { 0 };
+	u64 samples { 0 };
+
+	void record(long jitter_usec);
+};
+
+struct SchedulerStats {
+	// frames that took so long a whole deadline was missed
+	u64 overruns { 0 };
+	// deadlines that were missed, the frames for those deadlines are stale and should be skipped
+	u64 skipped_frames { 0 };
+	u64 frames { 0 };
+	JitterHistogram jitter {};
+};
+
+// paces the main loop to a fixed frame rate using absolute deadlines
+// each deadline is exactly one period after the last, so unlike sleeping for a duration error does not build up over time
+class FrameScheduler {
+	public:
+		explicit FrameScheduler(long fps);
+
+		// sleeps until the next frame deadline
+		// if processing overran and deadlines were missed, it does not sleep,
+		// and returns how many deadlines were missed so the caller can drop the frames that are now stale
+		u64 wait_next_frame();
+
+		// the frame period in microseconds, useful as a processing time budget
+		long period_usec() const;
+
+		const SchedulerStats& stats() const;
+		void log_stats() const;
+
+		// starts counting stats from 0 again, and returns the old stats
+		// used to measure the effect of a change, like turning on realtime mode
+		SchedulerStats reset_stats();
+		// logs how the jitter and overruns since the last reset compare to before
+		void log_comparison(const char *label, const SchedulerStats& before) const;
+
+	private:
+		u64 m_period_nsec;
+		// 0 until the first frame
+		u64 m_next_deadline { 0 };
+		SchedulerStats m_stats {};
+};
@@ -0,0 +1,280 @@
+#include "shadow.h"
+#include <stdlib.h>
+#include <math.h>
+#include <algorithm>
+#include "realtime.h"
+#include "thread_pool.h"
+#include "util.h"
+#include "logging.h"
+
+// parses value as a number, returns false if it isn't one
+static bool parse_number(std::string_view value, double& out) {
+	// strtod needs a null terminated string
+	std::string value_str(value);
+	char *end;
+	out = strtod(value_str.c_str(), &end);
+	return end != value_str.c_str() && *end == '\0';
+}
+
+static bool parse_bool(std::string_view value, bool& out) {
+	if (value == "1" || value == "true") {
+		out = true;
+		return true;
+	} else if (value == "0" || value == "false") {
+		out = false;
+		return true;
+	}
+	return false;
+}
+
+Error parse_shadow_config(std::string_view config, ShadowConfig& out) {
+	out = ShadowConfig {};
+
+	while (!config.empty()) {
+		usize comma = config.find(',');
+		std::string_view option = config.substr(0, comma);
+		config = comma == std::string_view::npos ? std::string_view() : config.substr(comma + 1);
+		if (option.empty()) {
+			continue;
+		}
+
+		usize equals = option.find('=');
+		if (equals == std::string_view::npos) {
+			return Error::invalid_args("shadow option '" + std::string(option) + "' is not in the form key=value");
+		}
+		std::string key(option.substr(0, equals));
+		std::string_view value = option.substr(equals + 1);
+		auto invalid_value = [&] () {
+			return Error::invalid_args("invalid value '" + std::string(value) + "' for shadow option " + key);
+		};
+
+		double number;
+		bool flag;
+		if (key == "fused_kernels") {
+			if (!parse_bool(value, flag)) {
+				return invalid_value();
+			}
+			out.fused_kernels = flag;
+		} else if (key == "opencv_contours") {
+			if (!parse_bool(value, flag)) {
+				return invalid_value();
+			}
+			out.opencv_contours = flag;
+		} else if (key == "detector") {
+			if (value.empty()) {
+				return invalid_value();
+			}
+			out.detector = std::string(value);
+		} else if (key == "scale") {
+			if (!parse_number(value, number) || number <= 0.0 || number > 1.0) {
+				return invalid_value();
+			}
+			out.scale = number;
+		} else if (key == "morph_iterations") {
+			if (!parse_number(value, number) || number < 0.0) {
+				return invalid_value();
+			}
+			out.morph_iterations = (int) number;
+		} else if (key == "every") {
+			if (!parse_number(value, number) || number < 1.0) {
+				return invalid_value();
+			}
+			out.every = (int) number;
+		} else if (key == "match_iou") {
+			if (!parse_number(value, number) || number <= 0.0 || number > 1.0) {
+				return invalid_value();
+			}
+			out.match_iou = number;
+		} else {
+			return Error::invalid_args("unknown shadow option '" + key + "', valid options are fused_kernels, opencv_contours, detector, scale, morph_iterations, every and match_iou");
+		}
+	}
+
+	return Error::ok();
+}
+
+void apply_shadow_config(Vision& vision, const ShadowConfig& config) {
+	if (config.fused_kernels.has_value()) {
+		vision.set_fused_kernels(*config.fused_kernels);
+	}
+	if (config.opencv_contours.has_value()) {
+		vision.set_opencv_contours(*config.opencv_contours);
+	}
+}
+
+ShadowRunner::ShadowRunner(std::unique_ptr<Vision> baseline, std::unique_ptr<Vision> shadow, const ShadowConfig& config, std::vector<int>&& cpus):
+m_baseline(std::move(baseline)),
+m_shadow(std::move(shadow)),
+m_config(config),
+m_cpus(std::move(cpus)) {
+	// every stage would be logged twice for each sampled frame, and the comparison is already logged with the stats
+	m_baseline->set_stage_logging(false);
+	m_shadow->set_stage_logging(false);
+
+	for (auto& job : m_jobs) {
+		job.targets.reserve(64);
+	}
+	m_baseline_targets.reserve(64);
+	m_shadow_targets.reserve(64);
+
+	m_thread = std::thread(&ShadowRunner::run, this);
+}
+
+ShadowRunner::~ShadowRunner() {
+	m_stopping = true;
+	m_submitted ++;
+	m_submitted.notify_one();
+	m_thread.join();
+}
+
+void ShadowRunner::submit(const cv::Mat& frame, const FrameSettings& settings, const std::vector<Target>& targets) {
+	u64 sequence = m_offered ++;
+	if (sequence % m_config.every != 0) {
+		return;
+	}
+
+	auto job = std::find_if(m_jobs.begin(), m_jobs.end(), [] (const Job& job) {
+		return job.state.load(std::memory_order_acquire) == JobState::Free;
+	});
+	if (job == m_jobs.end()) {
+		m_dropped ++;
+		return;
+	}
+
+	// copyTo and assign reuse the job's memory once it is big enough
+	job->sequence = sequence;
+	frame.copyTo(job->frame);
+	job->settings = settings;
+	job->targets.assign(targets.begin(), targets.end());
+	job->state.store(JobState::Ready, std::memory_order_release);
+
+	// notifying never blocks, it at most wakes the shadow thread
+	m_submitted ++;
+	m_submitted.notify_one();
+}
+
+ShadowStats ShadowRunner::take_stats() {
+	std::lock_guard lock(m_stats_mutex);
+	ShadowStats stats = m_stats;
+	stats.dropped = m_dropped.exchange(0);
+	m_stats = ShadowStats {};
+	return stats;
+}
+
+ShadowRunner::Job *ShadowRunner::next_job() {
+	Job *next = nullptr;
+	for (auto& job : m_jobs) {
+		if (job.state.load(std::memory_order_acquire) == JobState::Ready && (next == nullptr || job.sequence < next->sequence)) {
+			next = &job;
+		}
+	}
+	return next;
+}
+
+void ShadowRunner::run() {
+	// this thread inherits the main thread's cpus, where it would only get the time left over by the main, mqtt and gstreamer threads
+	if (!m_cpus.empty()) {
+		auto result = pin_current_thread(m_cpus);
+		if (result.is_err()) {
+			lg::warn("shadow pipeline: %s", result.to_string().c_str());
+		}
+	}
+
+	auto result = set_current_thread_idle();
+	if (result.is_err()) {
+		lg::warn("shadow pipeline: %s", result.to_string().c_str());
+	}
+
+	u64 seen = 0;
+	for (;;) {
+		// returns straight away if anything was submitted since seen was read, so no job is missed
+		m_submitted.wait(seen);
+		seen = m_submitted.load();
+		if (m_stopping) {
+			return;
+		}
+
+		while (Job *job = next_job()) {
+			FrameSettings shadow_settings = job->settings;
+			if (m_config.scale.has_value()) {
+				shadow_settings.quality.scale = *m_config.scale;
+			}
+			if (m_config.morph_iterations.has_value()) {
+				shadow_settings.quality.morph_iterations = *m_config.morph_iterations;
+			}
+
+			// both configurations are timed the same way, so the difference between them is only from the configuration
+			long baseline_usec = get_usec();
+			m_baseline->preprocess(job->frame, job->settings, m_baseline_buffers);
+			m_baseline->detect(job->frame, m_baseline_buffers, m_baseline_targets);
+			baseline_usec = get_usec() - baseline_usec;
+
+			long shadow_usec = get_usec();
+			m_shadow->preprocess(job->frame, shadow_settings, m_shadow_buffers);
+			m_shadow->detect(job->frame, m_shadow_buffers, m_shadow_targets);
+			shadow_usec = get_usec() - shadow_usec;
+
+			ShadowStats frame_stats {
+				.frames = 1,
+				.baseline_usec = baseline_usec,
+				.shadow_usec = shadow_usec,
+			};
+			compare(job->targets, m_shadow_targets, frame_stats);
+
+			job->state.store(JobState::Free, std::memory_order_release);
+
+			std::lock_guard lock(m_stats_mutex);
+			m_stats.frames += frame_stats.frames;
+			m_stats.identical_frames += frame_stats.identical_frames;
+			m_stats.matched += frame_stats.matched;
+			m_stats.missing += frame_stats.missing;
+			m_stats.extra += frame_stats.extra;
+			m_stats.distance_error += frame_stats.distance_error;
+			m_stats.angle_error += frame_stats.angle_error;
+			m_stats.baseline_usec += frame_stats.baseline_usec;
+			m_stats.shadow_usec += frame_stats.shadow_usec;
+		}
+	}
+}
+
+void ShadowRunner::compare(const std::vector<Target>& primary, const std::vector<Target>& shadow, ShadowStats& stats) {
+	m_matched.assign(shadow.size(), false);
+
+	u64 matched = 0;
+	for (const auto& primary_target : primary) {
+		// match to the unmatched shadow target of the same type that overlaps the most
+		int best = -1;
+		double best_iou = m_config.match_iou;
+		for (usize i = 0; i < shadow.size(); i ++) {
+			if (m_matched[i] || shadow[i].type != primary_target.type) {
+				continue;
+			}
+
+			double intersection = (primary_target.bounding_box & shadow[i].bounding_box).area();
+			double combined = primary_target.bounding_box.area() + shadow[i].bounding_box.area() - intersection;
+			double iou = combined > 0.0 ? intersection / combined : 0.0;
+			if (iou >= best_iou) {
+				best = (int) i;
+				best_iou = iou;
+			}
+		}
+
+		if (best < 0) {
+			continue;
+		}
+
+		m_matched[best] = true;
+		matched ++;
+		stats.distance_error += fabs(shadow[best].distance - primary_target.distance);
+		stats.angle_error += fabs(shadow[best].angle - primary_target.angle);
+	}
+
+	u64 missing = primary.size() - matched;
+	u64 extra = shadow.size() - matched;
+	stats.matched += matched;
+	stats.missing += missing;
+	stats.extra += extra;
+	if (missing == 0 && extra == 0) {
+		stats.identical_frames ++;
+	}
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "types.h"
+#include "error.h"
+#include "vision.h"
+
+// how the shadow pipeline differs from the primary pipeline, anything not set is the same as the primary pipeline
+struct ShadowConfig {
+	std::optional<bool> fused_kernels {};
+	std::optional<bool> opencv_contours {};
+	// detector used for every target
+	std::optional<std::string> detector {};
+	// replace the quality scale and morphology iterations of every frame
+	std::optional<double> scale {};
+	std::optional<int> morph_iterations {};
+	// only every nth frame is offered to the shadow pipeline
+	int every { 1 };
+	// a shadow target and a primary target of the same type are the same target if their boxes overlap by at least this much
+	double match_iou { 0.5 };
+};
+
+// parses a comma seperated list of key=value pairs, like "fused_kernels=0,detector=contour,every=4"
+// the keys are fused_kernels, opencv_contours, detector, scale, morph_iterations, every and match_iou
+// returns error if a key does not exist or its value is invalid
+Error parse_shadow_config(std::string_view config, ShadowConfig& out);
+
+// sets the options in config on vision, the detectors and quality are not set here
+void apply_shadow_config(Vision& vision, const ShadowConfig& config);
+
+// how the shadow pipeline compared to the primary pipeline since the stats were last taken
+struct ShadowStats {
+	// frames the shadow pipeline has finished
+	u64 frames { 0 };
+	// frames that were offered while the shadow pipeline was still busy, so they were skipped
+	u64 dropped { 0 };
+	// frames where every target matched
+	u64 identical_frames { 0 };
+	// targets found by both pipelines
+	u64 matched { 0 };
+	// targets only the primary pipeline found
+	u64 missing { 0 };
+	// targets only the shadow pipeline found
+	u64 extra { 0 };
+	// summed over every matched target
+	double distance_error { 0.0 };
+	double angle_error { 0.0 };
+	// time the primary configuration and the shadow configuration took, summed over every frame
+	// both are run the same way on the shadow thread, so these can be compared with each other but not with the primary pipeline's frame time
+	long baseline_usec { 0 };
+	long shadow_usec { 0 };
+};
+
+// runs a second configuration of the pipeline on frames the primary pipeline has already finished, and compares the targets they find
+// this is used to check that an optimization is faster and doesn't change detections on real footage
+// everything runs on one SCHED_IDLE thread, and frames are dropped instead of waited for, so the primary pipeline is never slowed down
+class ShadowRunner {
+	public:
+		// baseline is set up the same way as the primary pipeline, and shadow with the changes in config
+		// both must have been made with 1 thread, so they never use the thread pool the primary pipeline runs on
+		// the shadow thread is pinned to cpus, which should be the worker cpus so it only gets the time the workers leave idle
+		// if cpus is empty, it keeps the cpus of the thread that made it
+		ShadowRunner(std::unique_ptr<Vision> baseline, std::unique_ptr<Vision> shadow, const ShadowConfig& config, std::vector<int>&& cpus);
+		~ShadowRunner();
+
+		// offers a frame the primary pipeline has found targets in, with the settings it used
+		// this never waits, if the frame isn't one of the sampled ones or the shadow thread is still busy, nothing is done
+		// frame is copied into memory that is reused, so this does not allocate once every job has been used
+		void submit(const cv::Mat& frame, const FrameSettings& settings, const std::vector<Target>& targets);
+
+		// returns the stats since this was last called, and starts counting again
+		ShadowStats take_stats();
+
+	private:
+		enum class JobState: int {
+			// only touched by submit
+			Free = 0,
+			// only touched by the shadow thread
+			Ready = 1,
+		};
+
+		// one frame for the shadow thread, with what the primary pipeline found in it
+		struct Job {
+			std::atomic<JobState> state { JobState::Free };
+			// jobs are run oldest first
+			u64 sequence { 0 };
+			cv::Mat frame {};
+			FrameSettings settings {};
+			std::vector<Target> targets {};
+		};
+
+		// there are only two jobs, so one can be filled while the other is processed
+		static constexpr usize job_count = 2;
+
+		void run();
+		// the oldest ready job, or null if there are none
+		Job *next_job();
+		// matches shadow targets to primary targets, and adds the differences to stats
+		void compare(const std::vector<Target>& primary, const std::vector<Target>& shadow, ShadowStats& stats);
+
+		std::unique_ptr<Vision> m_baseline;
+		std::unique_ptr<Vision> m_shadow;
+		ShadowConfig m_config;
+		std::vector<int> m_cpus;
+
+		// jobs are handed between the threads with their atomic state instead of a queue,
+		// since a queue's lock could be held by the shadow thread while it isn't getting any cpu time
+		std::array<Job, job_count> m_jobs {};
+		// goes up every time a job is ready, the shadow thread waits on this
+		std::atomic<u64> m_submitted { 0 };
+		std::atomic<bool> m_stopping { false };
+		// frames offered so far, used to pick every nth frame
+		u64 m_offered { 0 };
+		// kept out of m_stats so submit never has to take the lock
+		std::atomic<u64> m_dropped { 0 };
+
+		// only used by the shadow thread
+		FrameBuffers m_baseline_buffers {};
+		FrameBuffers m_shadow_buffers {};
+		std::vector<Target> m_baseline_targets {};
+		std::vector<Target> m_shadow_targets {};
+		std::vector<bool> m_matched {};
+
+		std::mutex m_stats_mutex {};
+		ShadowStats m_stats {};
+
+		std::thread m_thread;
+};
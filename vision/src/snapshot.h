@@ -0,0 +1,89 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+
+// hands immutable snapshots from writer threads to one reader thread, without the reader ever taking a lock
+// writers build a whole new snapshot and publish it, and the reader picks it up at a point where it is safe to switch, like a frame boundary
+// anything still using the old snapshot keeps its own shared_ptr to it, so it stays alive until the last user is done with it
+// the reader never frees anything, the snapshots it replaces are handed back and freed by the next publish
+template<typename T>
+class SnapshotMailbox {
+	public:
+		SnapshotMailbox() = default;
+		SnapshotMailbox(const SnapshotMailbox&) = delete;
+		SnapshotMailbox& operator=(const SnapshotMailbox&) = delete;
+
+		~SnapshotMailbox() {
+			delete m_pending.load(std::memory_order_acquire);
+			delete_boxes(m_retired.exchange(nullptr, std::memory_order_acquire));
+		}
+
+		// replaces any snapshot the reader has not picked up yet, can be called from any thread
+		// this is also where snapshots the reader has replaced are freed, so freeing them never slows down the reader
+		void publish(std::shared_ptr<const T> snapshot) {
+			free_retired();
+
+			// the shared_ptr itself can't be swapped atomically without a lock, so a pointer to a heap allocated one is swapped instead
+			// whoever takes a box out of m_pending owns it, so nothing else can be using a box that is deleted
+			Box *box = new Box { .snapshot = std::move(snapshot) };
+			delete m_pending.exchange(box, std::memory_order_acq_rel);
+		}
+
+		// called only by the reader, returns true and sets current if a new snapshot has been published since the last call
+		// this is a single atomic exchange when nothing is waiting
+		bool take(std::shared_ptr<const T>& current) {
+			Box *box = m_pending.exchange(nullptr, std::memory_order_acq_rel);
+			if (box == nullptr) {
+				return false;
+			}
+
+			// the box now holds the old snapshot, and is handed back to be freed by a writer
+			std::swap(current, box->snapshot);
+			push_retired(box);
+			return true;
+		}
+
+	private:
+		struct Box {
+			std::shared_ptr<const T> snapshot;
+			// next box in the retired list
+			Box *next { nullptr };
+		};
+
+		void push_retired(Box *box) {
+			box->next = m_retired.load(std::memory_order_relaxed);
+			while (!m_retired.compare_exchange_weak(box->next, box, std::memory_order_release, std::memory_order_relaxed)) {}
+		}
+
+		// frees every retired snapshot nothing else is using
+		// a frame that is still running may hold the last other reference, so those are put back and tried again on the next publish
+		void free_retired() {
+			// the whole list is taken at once, so boxes are never popped one at a time and there is no aba problem
+			Box *box = m_retired.exchange(nullptr, std::memory_order_acquire);
+			while (box != nullptr) {
+				Box *next = box->next;
+				// once this box has the only reference, nothing can make a new one, so the count can't go back up
+				if (box->snapshot.use_count() <= 1) {
+					// pairs with the release when the other references were dropped, so their reads of the snapshot finished first
+					std::atomic_thread_fence(std::memory_order_acquire);
+					delete box;
+				} else {
+					push_retired(box);
+				}
+				box = next;
+			}
+		}
+
+		static void delete_boxes(Box *box) {
+			while (box != nullptr) {
+				Box *next = box->next;
+				delete box;
+				box = next;
+			}
+		}
+
+		std::atomic<Box *> m_pending { nullptr };
+		// snapshots the reader has replaced, as a linked list of boxes that writers free
+		std::atomic<Box *> m_retired { nullptr };
+};
@@ -0,0 +1,265 @@
+#include "target.h"
+#include <algorithm>
+#include <sstream>
+#include <math.h>
+
+bool target_type_contains(TargetType input_type, TargetType contains_type) {
+	return (input_type & contains_type) == contains_type;
+}
+
+TargetSearchData::TargetSearchData(TargetType target_type, std::string&& in_name, cv::Scalar bounding_box_color, std::string&& template_name, PipelineParams params, double min_score, ScoreWeights weights,
+	std::string&& detector, BallParams ball_params, WindowParams window_params):
+target_type(target_type),
+name(std::move(in_name)),
+bounding_box_color(bounding_box_color),
+template_name(std::move(template_name)),
+params(params),
+min_score(min_score),
+weights(weights),
+detector(std::move(detector)),
+ball_params(ball_params),
+window_params(window_params) {
+	contour_name = name + " Contours";
+	matching_name = name + " Contour Matching";
+}
+
+bool TargetSearchData::is(TargetType type) const {
+	return target_type_contains(type, target_type);
+}
+
+Error TargetSearchData::check_params() const {
+	// each scaled image is the size of the frame divided by the scale
+	if (params.scale <= 0.0 || params.scale > 1.0) {
+		return Error::invalid_args("scale must be greater than 0 and at most 1");
+	}
+	if (params.target_height <= 0.0) {
+		return Error::invalid_args("target_height must be greater than 0");
+	}
+	// the window detector steps through sizes from min_size to max_size by multiplying with scale_step
+	if (window_params.min_size < 1) {
+		return Error::invalid_args("window.min_size must be at least 1");
+	}
+	if (window_params.max_size < window_params.min_size) {
+		return Error::invalid_args("window.max_size must be at least window.min_size");
+	}
+	if (window_params.scale_step <= 1.0) {
+		return Error::invalid_args("window.scale_step must be greater than 1");
+	}
+	return Error::ok();
+}
+
+bool TargetSearchData::process_template(cv::Mat& processed) {
+	// TODO: find a way to configure what type of colorspace image is input
+	cv::cvtColor(template_image, processed, cv::COLOR_RGB2HSV);
+	cv::inRange(processed, params.thresh_min, params.thresh_max, processed);
+	// TODO: pass kernel into morphologyEx instead of plain cv::Mat()
+	cv::morphologyEx(processed, processed, cv::MORPH_OPEN, cv::Mat());
+
+	std::vector<std::vector<cv::Point>> contours;
+	cv::findContours(processed, contours, cv::RETR_LIST, cv::CHAIN_APPROX_SIMPLE);
+
+	if (contours.size() == 0) {
+		return false;
+	}
+
+	// find largest contour
+	usize index = 0;
+	double max_area = 0;
+	for (usize i = 0; i < contours.size(); i ++) {
+		double area = cv::contourArea(contours[i]);
+		if (area > max_area) {
+			max_area = area;
+			index = i;
+		}
+	}
+
+	template_contour.swap(contours[index]);
+	auto bounding_box = cv::boundingRect(template_contour);
+	template_area_frac = max_area / bounding_box.area();
+	template_aspect_ratio_scaled = log2((double) bounding_box.width / (double) bounding_box.height);
+
+	return true;
+}
+
+
+IntermediateTarget::IntermediateTarget(const ContourStore& contours, usize contour):
+bounding_box(cv::boundingRect(contours.mat(contour))),
+contour(contour) {}
+
+IntermediateTarget::IntermediateTarget(cv::Rect bounding_box):
+bounding_box(bounding_box),
+contour(no_contour) {}
+
+
+// reads a 3 element list like [ 130, 75, 127 ] into a scalar
+static bool read_scalar(const cv::FileNode& node, cv::Scalar& out) {
+	if (!node.isSeq() || node.size() != 3) {
+		return false;
+	}
+
+	out = cv::Scalar((double) node[0], (double) node[1], (double) node[2]);
+	return true;
+}
+
+// reads a number that can be left out, in which case def is used
+static double read_double(const cv::FileNode& node, double def) {
+	return node.empty() || node.isNone() ? def : (double) node;
+}
+
+static int read_int(const cv::FileNode& node, int def) {
+	return node.empty() || node.isNone() ? def : (int) node;
+}
+
+Error TargetRegistry::load(const std::string& filename) {
+	std::vector<TargetSearchData> targets;
+
+	// opencv throws if the file is not valid yaml or json
+	try {
+		cv::FileStorage file(filename, cv::FileStorage::READ | cv::FileStorage::FORMAT_AUTO);
+		if (!file.isOpened()) {
+			return Error::resource_unavailable("could not open target config '" + filename + "'");
+		}
+
+		for (const auto& node : file["targets"]) {
+			if (targets.size() == max_targets) {
+				return Error::invalid_args("target config '" + filename + "' has more than 64 targets");
+			}
+
+			std::string id = node["id"].empty() ? "" : (std::string) node["id"];
+			if (id.empty()) {
+				return Error::invalid_args("target " + std::to_string(targets.size()) + " in '" + filename + "' has no id");
+			}
+			for (const auto& target : targets) {
+				if (target.id == id) {
+					return Error::invalid_args("target id '" + id + "' is used more than once in '" + filename + "'");
+				}
+			}
+			std::string name = node["name"].empty() ? id : (std::string) node["name"];
+
+			cv::Scalar thresh_min;
+			cv::Scalar thresh_max;
+			if (!read_scalar(node["thresh_min"], thresh_min) || !read_scalar(node["thresh_max"], thresh_max)) {
+				return Error::invalid_args("target '" + id + "' in '" + filename + "' needs thresh_min and thresh_max as [ h, s, v ]");
+			}
+
+			PipelineParams params {
+				.thresh_min = thresh_min,
+				.thresh_max = thresh_max,
+				.target_height = read_double(node["target_height"], 1.0),
+				.scale = read_double(node["scale"], 1.0),
+			};
+
+			cv::Scalar color(255, 255, 255);
+			read_scalar(node["color"], color);
+
+			if (node["template"].empty()) {
+				return Error::invalid_args("target '" + id + "' in '" + filename + "' has no template");
+			}
+
+			const auto& weights = node["weights"];
+			const auto& ball = node["ball"];
+			const auto& window = node["window"];
+
+			targets.emplace_back(
+				(TargetType) (1ull << targets.size()),
+				std::move(name),
+				color,
+				(std::string) node["template"],
+				params,
+				read_double(node["min_score"], 0.0),
+				ScoreWeights {
+					.contour_match = read_double(weights["contour_match"], 1.0),
+					.area_frac = read_double(weights["area_frac"], 1.0),
+					.aspect_ratio = read_double(weights["aspect_ratio"], 1.0),
+				},
+				node["detector"].empty() ? std::string("contour") : (std::string) node["detector"],
+				BallParams {
+					.min_area = read_int(ball["min_area"], 12),
+					.min_fill = read_double(ball["min_fill"], 0.6),
+				},
+				WindowParams {
+					.min_size = read_int(window["min_size"], 4),
+					.max_size = read_int(window["max_size"], 32),
+					.scale_step = read_double(window["scale_step"], 1.5),
+					.min_density = read_double(window["min_density"], 0.5),
+				}
+			);
+			targets.back().id = std::move(id);
+
+			auto params_result = targets.back().check_params();
+			if (params_result.is_err()) {
+				return Error::invalid_args("target '" + targets.back().id + "' in '" + filename + "': " + params_result.message());
+			}
+		}
+	} catch (const cv::Exception& error) {
+		return Error::invalid_args("could not parse target config '" + filename + "': " + error.what());
+	}
+
+	if (targets.empty()) {
+		return Error::invalid_args("target config '" + filename + "' has no targets");
+	}
+
+	m_targets = std::move(targets);
+	return Error::ok();
+}
+
+const std::vector<TargetSearchData>& TargetRegistry::targets() const {
+	return m_targets;
+}
+
+TargetType TargetRegistry::all() const {
+	return m_targets.size() == max_targets ? TargetType::All : (TargetType) ((1ull << m_targets.size()) - 1);
+}
+
+std::optional<TargetType> TargetRegistry::parse(std::string_view names) const {
+	if (names == "all") {
+		return all();
+	} else if (names == "none") {
+		return TargetType::None;
+	}
+
+	TargetType out = TargetType::None;
+	while (!names.empty()) {
+		usize comma = names.find(',');
+		auto type = find(names.substr(0, comma));
+		if (!type.has_value()) {
+			return {};
+		}
+		out |= *type;
+
+		names = comma == std::string_view::npos ? std::string_view() : names.substr(comma + 1);
+	}
+	return out;
+}
+
+std::optional<TargetType> TargetRegistry::find(std::string_view id) const {
+	std::string normalized(id);
+	std::replace(normalized.begin(), normalized.end(), '-', '_');
+
+	for (const auto& target : m_targets) {
+		if (target.id == normalized || target.id + "s" == normalized) {
+			return target.target_type;
+		}
+	}
+	return {};
+}
+
+std::optional<std::string_view> TargetRegistry::id(TargetType type) const {
+	for (const auto& target : m_targets) {
+		if (target.target_type == type) {
+			return target.id;
+		}
+	}
+	return {};
+}
+
+std::string TargetRegistry::describe() const {
+	std::stringstream out;
+	for (usize i = 0; i < m_targets.size(); i ++) {
+		if (i > 0) {
+			out << " ";
+		}
+		out << m_targets[i].id << "=" << (unsigned long long) m_targets[i].target_type;
+	}
+	return out.str();
+}
@@ -0,0 +1,214 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "types.h"
+#include "error.h"
+#include "contour.h"
+
+// bitflags for type of target
+// each target in the target config gets its own bit in the order it is listed, see TargetRegistry
+enum class TargetType: u64 {
+	None = 0x0,
+	All = ~0x0ull,
+};
+
+// operations for the TargetType bitflags
+inline TargetType operator|(TargetType lhs, TargetType rhs) {
+	using T = std::underlying_type_t <TargetType>;
+	return static_cast<TargetType>(static_cast<T>(lhs) | static_cast<T>(rhs));
+}
+
+inline TargetType& operator|=(TargetType& lhs, TargetType rhs) {
+	lhs = lhs | rhs;
+	return lhs;
+}
+
+inline TargetType operator&(TargetType lhs, TargetType rhs) {
+	using T = std::underlying_type_t <TargetType>;
+	return static_cast<TargetType>(static_cast<T>(lhs) & static_cast<T>(rhs));
+}
+
+inline TargetType& operator&=(TargetType& lhs, TargetType rhs) {
+	lhs = lhs & rhs;
+	return lhs;
+}
+
+// returns true if the left hand side contains all the bits from the right hand side
+bool target_type_contains(TargetType input_type, TargetType contains_type);
+
+
+// represents a detected target
+struct Target {
+	TargetType type;
+	double distance;
+	double angle;
+	double score;
+	// location of the target in the frame in pixels
+	cv::Rect bounding_box;
+};
+
+struct IntermediateTarget {
+	// value of contour for targets that were not found from a contour
+	static constexpr usize no_contour = SIZE_MAX;
+
+	IntermediateTarget(const ContourStore& contours, usize contour);
+	IntermediateTarget(cv::Rect bounding_box);
+
+	cv::Rect bounding_box;
+	// index of the contour in the frame's ContourStore
+	usize contour;
+	double score { 0.0 };
+};
+
+// paramaters for various stages in the vision pipeline
+struct PipelineParams {
+	// minimum and maximum hsv values for threshholding this object
+	// from https://docs.opencv.org/3.4/de/d25/imgproc_color_conversions.html
+	// NOTE: if input image is 8 bit rgb, the min and max values for h, s, and v area as follows:
+	// H: 180
+	// S: 255
+	// V: 255
+	// This is different from the normal H: 360, S: 100, V: 100 readings you will normally see,
+	// so be sure to scale these values to be in the correct range
+	cv::Scalar thresh_min;
+	cv::Scalar thresh_max;
+
+	// TODO: add morphology amount configuration
+
+	// height of the target, used for distance calculations
+	double target_height;
+
+	// scale the image is resized by before looking for this target, 0.5 processes the target at half resolution
+	// targets that are always big in the frame can use a smaller scale to save time
+	// NOTE: sizes in pixels in the detector paramaters are in the scaled image
+	double scale { 1.0 };
+};
+
+// weights for the scores of different operations to determine how closely the imsage matches the template
+struct ScoreWeights {
+	double contour_match;
+	double area_frac;
+	double aspect_ratio;
+};
+
+// paramaters for the blob and circle detectors
+struct BallParams {
+	// components with less pixels than this are ignored
+	int min_area;
+	// components that fill less of their enclosing circle than this are considered partially blocked,
+	// and the circle detector will try to fit a circle to them to find the whole ball
+	double min_fill;
+};
+
+// paramaters for the window detector
+struct WindowParams {
+	// smallest and largest window side length in pixels
+	int min_size;
+	int max_size;
+	// each window size is this many times bigger than the last
+	double scale_step;
+	// windows where less than this fraction of pixels pass the threshold are ignored
+	double min_density;
+};
+
+// data about a desired type of target used to help recognise it
+class TargetSearchData {
+	public:
+		TargetSearchData(TargetType target_type, std::string&& name, cv::Scalar bounding_box_color, std::string&& template_name, PipelineParams params, double min_score, ScoreWeights weights,
+			std::string&& detector = "contour", BallParams ball_params = BallParams { .min_area = 12, .min_fill = 0.6 },
+			WindowParams window_params = WindowParams { .min_size = 4, .max_size = 32, .scale_step = 1.5, .min_density = 0.5 });
+
+		// returns true if this is the passed in target type
+		bool is(TargetType type) const;
+
+		// returns an error naming the field if any paramater is outside of the range the pipeline can use
+		// used for both the target config and paramaters changed while running
+		Error check_params() const;
+
+		// thresholds template_image and finds the template contour in it, processed is set to the thresholded template
+		// this is run again whenever the thresholds change, since they change what the template looks like
+		// returns false if the thresholded template has no contours
+		bool process_template(cv::Mat& processed);
+
+		// type of target that this is
+		TargetType target_type;
+
+		// short name used to refer to this target on the command line and over mqtt, like red_ball
+		std::string id {};
+
+		// human readable name of this target
+		std::string name;
+
+		// names the detectors use for timing, the other stages are named by the frame graph
+		// these are here so that they are computed beforehand to avoid expensive allocation in hot loop
+		std::string contour_name {};
+		std::string matching_name {};
+
+		// color to use when displaying the bounding box
+		cv::Scalar bounding_box_color;
+
+		// name of the template file
+		// will try and open the template file in the passed in template directory
+		std::string template_name;
+
+		// paramaters for the vision pipeline
+		PipelineParams params;
+
+		// minumum score a controut must have to be considered a valid target
+		double min_score;
+
+		// for the blob and circle detectors, contour_match is not used, area_frac is the weight for how much of the enclosing circle is filled,
+		// and aspect_ratio is the weight for how square the bounding box is
+		// for the window detector, area_frac is the weight for how close the window's fill is to a circle's,
+		// and aspect_ratio is the weight for how empty the area around the window is
+		ScoreWeights weights;
+
+		// name of the detector in the DetectorRegistry used to find this target
+		std::string detector;
+		BallParams ball_params;
+		WindowParams window_params;
+
+		// template image as it was loaded, kept so the template can be processed again
+		cv::Mat template_image {};
+
+		// template contour to try and recognise
+		std::vector<cv::Point> template_contour {};
+		double template_area_frac { 0.0 };
+		double template_aspect_ratio_scaled { 0.0 };
+};
+
+// every target that can be looked for, loaded from the target config file
+// each target's TargetType is the bit for its position in the file, so there can be up to 64 targets
+class TargetRegistry {
+	public:
+		static constexpr usize max_targets = 64;
+
+		// loads every target from a yaml or json file, see templates/targets.yml for the format
+		// returns error if the file can't be opened, or if a target is missing required fields or has a duplicate name
+		Error load(const std::string& filename);
+
+		const std::vector<TargetSearchData>& targets() const;
+
+		// every registered target
+		TargetType all() const;
+
+		// parses a comma seperated list of target ids, or all or none
+		// '-' can be used instead of '_', and ids can be plural, so older names like red-ball and red_balls still work
+		// returns none if any id is not a registered target
+		std::optional<TargetType> parse(std::string_view names) const;
+
+		// returns the id of the target if type is exactly one target, if it is mixed or unknown returns none
+		std::optional<std::string_view> id(TargetType type) const;
+
+		// space seperated list of every target id and the number it is sent as over mqtt, like "red_ball=1 blue_ball=2"
+		std::string describe() const;
+
+	private:
+		std::optional<TargetType> find(std::string_view id) const;
+
+		std::vector<TargetSearchData> m_targets {};
+};
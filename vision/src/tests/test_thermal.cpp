@@ -0,0 +1,174 @@
+// runs the thermal governor against a fake sysfs directory and checks the level it picks as the temperature and throttling flags change
+// returns non zero and prints each failing step if the levels are wrong
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <filesystem>
+#include <string>
+#include "../thermal.h"
+
+static int g_failures = 0;
+
+static void write_file(const std::string& path, const std::string& contents) {
+	FILE *file = fopen(path.c_str(), "w");
+	if (file == nullptr) {
+		printf("could not write %s\n", path.c_str());
+		exit(1);
+	}
+	fputs(contents.c_str(), file);
+	fclose(file);
+}
+
+// fake sysfs with the same layout as the pi's
+class FakeSysfs {
+	public:
+		FakeSysfs() {
+			char dir_template[] = "/tmp/thermal_test_XXXXXX";
+			if (mkdtemp(dir_template) == nullptr) {
+				printf("could not make fake sysfs directory\n");
+				exit(1);
+			}
+			m_root = dir_template;
+
+			std::filesystem::create_directories(m_root + "/class/thermal/thermal_zone0");
+			std::filesystem::create_directories(m_root + "/devices/system/cpu/cpu0/cpufreq");
+			std::filesystem::create_directories(m_root + "/devices/platform/soc/soc:firmware");
+		}
+
+		~FakeSysfs() {
+			std::filesystem::remove_all(m_root);
+		}
+
+		const std::string& root() const {
+			return m_root;
+		}
+
+		void set_temperature(double degrees) {
+			write_file(temperature_path(), std::to_string((long) (degrees * 1000.0)) + "\n");
+		}
+
+		void set_frequency(long khz) {
+			write_file(m_root + "/devices/system/cpu/cpu0/cpufreq/scaling_cur_freq", std::to_string(khz) + "\n");
+		}
+
+		// the firmware writes the flags in hex without a 0x prefix
+		void set_throttled(const std::string& flags) {
+			write_file(throttled_path(), flags + "\n");
+		}
+
+		void remove_throttled() {
+			std::filesystem::remove(throttled_path());
+		}
+
+		void remove_temperature() {
+			std::filesystem::remove(temperature_path());
+		}
+
+	private:
+		std::string temperature_path() const {
+			return m_root + "/class/thermal/thermal_zone0/temp";
+		}
+
+		std::string throttled_path() const {
+			return m_root + "/devices/platform/soc/soc:firmware/get_throttled";
+		}
+
+		std::string m_root;
+};
+
+static void expect_level(ThermalGovernor& governor, const char *step, ThermalLevel expected) {
+	auto result = governor.update();
+	if (result.is_err()) {
+		printf("FAIL %s: update returned error: %s\n", step, result.to_string().c_str());
+		g_failures ++;
+		return;
+	}
+
+	ThermalLevel level = governor.state().level;
+	if (level != expected) {
+		printf("FAIL %s: level is %s, expected %s\n", step, thermal_level_to_string(level), thermal_level_to_string(expected));
+		g_failures ++;
+	}
+}
+
+int main() {
+	FakeSysfs sysfs;
+	sysfs.set_temperature(50.0);
+	sysfs.set_frequency(1500000);
+	sysfs.set_throttled("0");
+
+	// same as main
+	ThermalGovernor governor(sysfs.root(), ThermalParams {
+		.warm_temp = 70.0,
+		.hot_temp = 75.0,
+		.critical_temp = 80.0,
+		.hysteresis = 3.0,
+	});
+
+	expect_level(governor, "cool", ThermalLevel::Normal);
+
+	sysfs.set_temperature(70.0);
+	expect_level(governor, "warm threshold", ThermalLevel::Warm);
+
+	// ondemand and schedutil lower the frequency whenever the cpu is idle, that isn't throttling
+	sysfs.set_frequency(600000);
+	expect_level(governor, "warm at a low frequency", ThermalLevel::Warm);
+
+	// throttling happened since boot, but isn't happening now
+	sysfs.set_throttled("e0000");
+	expect_level(governor, "warm after past throttling", ThermalLevel::Warm);
+
+	sysfs.set_throttled("e0004");
+	expect_level(governor, "warm while throttled", ThermalLevel::Critical);
+	if (!governor.state().throttled) {
+		printf("FAIL warm while throttled: state is not marked throttled\n");
+		g_failures ++;
+	}
+
+	// the critical level is left once the temperature is hysteresis below the critical temperature
+	sysfs.set_throttled("e0000");
+	sysfs.set_temperature(78.0);
+	expect_level(governor, "inside critical hysteresis", ThermalLevel::Critical);
+
+	sysfs.set_temperature(76.0);
+	expect_level(governor, "below critical hysteresis", ThermalLevel::Hot);
+
+	sysfs.set_temperature(73.0);
+	expect_level(governor, "inside hot hysteresis", ThermalLevel::Hot);
+
+	sysfs.set_temperature(71.0);
+	expect_level(governor, "below hot hysteresis", ThermalLevel::Warm);
+
+	sysfs.set_temperature(66.0);
+	expect_level(governor, "below warm hysteresis", ThermalLevel::Normal);
+
+	// levels can be skipped in one update
+	sysfs.set_temperature(85.0);
+	expect_level(governor, "jump to critical", ThermalLevel::Critical);
+
+	sysfs.set_temperature(50.0);
+	expect_level(governor, "jump to normal", ThermalLevel::Normal);
+
+	// throttling only matters once it is warm
+	sysfs.set_throttled("4");
+	expect_level(governor, "cool while throttled", ThermalLevel::Normal);
+
+	// without the firmware driver, throttling is never assumed
+	sysfs.remove_throttled();
+	sysfs.set_temperature(72.0);
+	expect_level(governor, "warm without firmware driver", ThermalLevel::Warm);
+
+	// the level is kept if the temperature can't be read
+	sysfs.remove_temperature();
+	if (governor.update().is_ok()) {
+		printf("FAIL missing temperature: update did not return error\n");
+		g_failures ++;
+	}
+	if (governor.state().level != ThermalLevel::Warm) {
+		printf("FAIL missing temperature: level changed to %s\n", thermal_level_to_string(governor.state().level));
+		g_failures ++;
+	}
+
+	printf("%d failures\n", g_failures);
+	return g_failures == 0 ? 0 : 1;
+}
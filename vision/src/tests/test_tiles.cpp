@@ -0,0 +1,123 @@
+// checks that TileGrid and parallel_tiles cover every pixel of an image exactly once
+// returns non zero and prints each failing case if they don't
+
+#include <stdio.h>
+#include <vector>
+#include "../parallel.h"
+#include "../thread_pool.h"
+
+static int g_failures = 0;
+
+static void fail(const char *what, cv::Size size, int threads, const TileGrain& grain) {
+	printf("FAIL %s: size %dx%d, threads %d, grain %d rows %d cols %d pixels\n",
+		what, size.width, size.height, threads, grain.min_rows, grain.min_cols, grain.min_pixels);
+	g_failures ++;
+}
+
+// true if every element of counts is 1
+static bool covered_once(const cv::Mat& counts) {
+	for (int y = 0; y < counts.rows; y ++) {
+		for (int x = 0; x < counts.cols; x ++) {
+			if (counts.at<int>(y, x) != 1) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static void check_grid(cv::Size size, int threads, const TileGrain& grain) {
+	TileGrid grid = TileGrid::make(size, threads, grain);
+	if (grid.count() < 1 || grid.count() > std::max(threads, 1)) {
+		fail("tile count", size, threads, grain);
+		return;
+	}
+
+	cv::Mat counts = cv::Mat::zeros(size, CV_32S);
+	cv::Rect frame(cv::Point(0, 0), size);
+	for (int i = 0; i < grid.count(); i ++) {
+		cv::Rect tile = grid.tile(i);
+		if ((tile & frame) != tile) {
+			fail("tile outside image", size, threads, grain);
+			return;
+		}
+
+		for (int y = tile.y; y < tile.y + tile.height; y ++) {
+			for (int x = tile.x; x < tile.x + tile.width; x ++) {
+				counts.at<int>(y, x) ++;
+			}
+		}
+	}
+
+	if (!covered_once(counts)) {
+		fail("TileGrid coverage", size, threads, grain);
+	}
+}
+
+static void check_parallel_tiles(cv::Size size, int threads, const TileGrain& grain) {
+	// the counts are checked through a view, so tiles are offset from the start of the allocation like they are for an roi
+	cv::Mat padded = cv::Mat::zeros(size.height + 2, size.width + 2, CV_32S);
+	cv::Mat counts = padded(cv::Rect(1, 1, size.width, size.height));
+
+	// tiles never overlap, so each pixel is only written by one thread
+	parallel_tiles(threads, grain, [] (cv::Mat tile) {
+		for (int y = 0; y < tile.rows; y ++) {
+			for (int x = 0; x < tile.cols; x ++) {
+				tile.at<int>(y, x) ++;
+			}
+		}
+	}, counts);
+
+	if (!covered_once(counts)) {
+		fail("parallel_tiles coverage", size, threads, grain);
+	}
+
+	// nothing outside the view should have been touched
+	int total = 0;
+	for (int y = 0; y < padded.rows; y ++) {
+		for (int x = 0; x < padded.cols; x ++) {
+			total += padded.at<int>(y, x);
+		}
+	}
+	if (total != size.area()) {
+		fail("parallel_tiles wrote outside the image", size, threads, grain);
+	}
+}
+
+int main() {
+	// more workers than most test machines have cpus, so thread counts above the cpu count are still split up
+	ThreadPool::init_global(7, {});
+
+	// odd heights, heights smaller than the thread count, and a prime height that no tile count divides
+	const std::vector<int> heights { 1, 2, 3, 5, 7, 15, 31, 101, 479 };
+	const std::vector<int> widths { 1, 3, 64, 129, 640 };
+	const std::vector<int> thread_counts { 1, 2, 3, 4, 8, 16 };
+	const std::vector<TileGrain> grains {
+		TileGrain {},
+		TileGrain { .min_rows = 1, .min_cols = 1, .min_pixels = 1 },
+		TileGrain { .min_rows = 3, .min_cols = 16, .min_pixels = 64 },
+		// grains larger than the image
+		TileGrain { .min_rows = 1000, .min_cols = 64, .min_pixels = 1 },
+		TileGrain { .min_rows = 1, .min_cols = 1000, .min_pixels = 1 },
+		TileGrain { .min_rows = 8, .min_cols = 64, .min_pixels = 1000000 },
+		// invalid grains are treated as 1
+		TileGrain { .min_rows = 0, .min_cols = 0, .min_pixels = 0 },
+	};
+
+	int cases = 0;
+	for (int height : heights) {
+		for (int width : widths) {
+			for (int threads : thread_counts) {
+				for (const auto& grain : grains) {
+					cv::Size size(width, height);
+					check_grid(size, threads, grain);
+					check_parallel_tiles(size, threads, grain);
+					cases ++;
+				}
+			}
+		}
+	}
+
+	printf("%d cases, %d failures\n", cases, g_failures);
+	return g_failures == 0 ? 0 : 1;
+}
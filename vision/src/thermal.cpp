@@ -0,0 +1,145 @@
+#include "thermal.h"
+#include <stdio.h>
+#include <algorithm>
+
+const char *thermal_level_to_string(ThermalLevel level) {
+	switch (level) {
+		case ThermalLevel::Normal:
+			return "normal";
+		case ThermalLevel::Warm:
+			return "warm";
+		case ThermalLevel::Hot:
+			return "hot";
+		case ThermalLevel::Critical:
+			return "critical";
+	}
+	// stop compiler warning
+	return "";
+}
+
+// reads a single integer from a sysfs file
+// stdio is used instead of a stream so this doesn't allocate
+static bool read_sysfs_long(const std::string& path, long& out) {
+	FILE *file = fopen(path.c_str(), "r");
+	if (file == nullptr) {
+		return false;
+	}
+
+	bool success = fscanf(file, "%ld", &out) == 1;
+	fclose(file);
+	return success;
+}
+
+// bits of the firmware's get_throttled value that are set while throttling is happening right now
+// the higher bits say it has happened since boot, which doesn't matter here
+static constexpr long throttled_now_bits =
+	// arm frequency capped
+	(1 << 1)
+	// currently throttled
+	| (1 << 2)
+	// soft temperature limit active
+	| (1 << 3);
+
+// same as read_sysfs_long, but for values written in hex without a 0x prefix
+static bool read_sysfs_hex(const std::string& path, long& out) {
+	FILE *file = fopen(path.c_str(), "r");
+	if (file == nullptr) {
+		return false;
+	}
+
+	unsigned long value;
+	bool success = fscanf(file, "%lx", &value) == 1;
+	fclose(file);
+	out = (long) value;
+	return success;
+}
+
+ThermalGovernor::ThermalGovernor(const std::string& sysfs_root, ThermalParams params):
+m_temperature_path(sysfs_root + "/class/thermal/thermal_zone0/temp"),
+m_frequency_path(sysfs_root + "/devices/system/cpu/cpu0/cpufreq/scaling_cur_freq"),
+m_throttled_path(sysfs_root + "/devices/platform/soc/soc:firmware/get_throttled"),
+m_params(params),
+m_state(ThermalState {
+	.temperature = 0.0,
+	.frequency = 0,
+	.throttled = false,
+	.level = ThermalLevel::Normal,
+}) {}
+
+Error ThermalGovernor::update() {
+	long millidegrees;
+	if (!read_sysfs_long(m_temperature_path, millidegrees)) {
+		return Error::resource_unavailable("could not read cpu temperature from " + m_temperature_path);
+	}
+	m_state.temperature = millidegrees / 1000.0;
+
+	// frequency is optional, not every kernel has cpufreq
+	if (!read_sysfs_long(m_frequency_path, m_state.frequency)) {
+		m_state.frequency = 0;
+	}
+
+	// a frequency below the maximum doesn't mean anything under ondemand or schedutil, they lower it whenever the cpu is idle,
+	// so only the firmware can say if it is throttling, and without the firmware driver throttling is never assumed
+	long throttled_flags;
+	if (!read_sysfs_hex(m_throttled_path, throttled_flags)) {
+		throttled_flags = 0;
+	}
+	m_state.throttled = (throttled_flags & throttled_now_bits) != 0;
+
+	const double thresholds[] = { m_params.warm_temp, m_params.hot_temp, m_params.critical_temp };
+
+	// go up to the highest level whose temperature has been reached,
+	// and only go down past a level once the temperature is hysteresis below it
+	int level = (int) m_state.level;
+	while (level < 3 && m_state.temperature >= thresholds[level]) {
+		level ++;
+	}
+	while (level > 0 && m_state.temperature < thresholds[level - 1] - m_params.hysteresis) {
+		level --;
+	}
+
+	// if the firmware is already throttling, cutting back is the only way to keep a steady frame rate
+	if (m_state.throttled && level >= (int) ThermalLevel::Warm) {
+		level = (int) ThermalLevel::Critical;
+	}
+
+	m_state.level = (ThermalLevel) level;
+	return Error::ok();
+}
+
+const ThermalState& ThermalGovernor::state() const {
+	return m_state;
+}
+
+usize ThermalGovernor::min_quality_level() const {
+	// these are levels in default_quality_levels
+	switch (m_state.level) {
+		case ThermalLevel::Normal:
+			return 0;
+		case ThermalLevel::Warm:
+			// skip morphology
+			return 1;
+		case ThermalLevel::Hot:
+			// half resolution
+			return 3;
+		case ThermalLevel::Critical:
+			// half resolution, roi only, one target
+			return 5;
+	}
+	// stop compiler warning
+	return 0;
+}
+
+int ThermalGovernor::thread_limit(int max_threads) const {
+	switch (m_state.level) {
+		case ThermalLevel::Normal:
+		case ThermalLevel::Warm:
+			return max_threads;
+		case ThermalLevel::Hot:
+			return std::max(max_threads / 2, 1);
+		case ThermalLevel::Critical:
+			return 1;
+	}
+	// stop compiler warning
+	return max_threads;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <string>
+#include "types.h"
+#include "error.h"
+
+enum class ThermalLevel: int {
+	// cool enough to run at full quality
+	Normal = 0,
+	// getting warm, do a bit less work to slow down heating
+	Warm = 1,
+	// close to the soft throttling temperature, do a lot less work
+	Hot = 2,
+	// throttling or about to, do as little as possible
+	Critical = 3,
+};
+
+const char *thermal_level_to_string(ThermalLevel level);
+
+struct ThermalParams {
+	// temperatures in celsius at which each level is entered
+	double warm_temp;
+	double hot_temp;
+	double critical_temp;
+	// a level is only left once the temperature drops this far below where it was entered, so the level doesn't flicker
+	double hysteresis;
+};
+
+struct ThermalState {
+	double temperature;
+	// current cpu frequency in khz, this is only reported, since the governor lowers it whenever the cpu isn't busy
+	long frequency;
+	// true if the firmware says it is capping the frequency or throttling right now
+	bool throttled;
+	ThermalLevel level;
+};
+
+// reads cpu temperature, frequency and the firmware's throttling flags from sysfs, and decides how much to cut back on work before the pi starts throttling
+class ThermalGovernor {
+	public:
+		// sysfs_root is normally /sys, but can be pointed at a fake directory with the same layout for testing
+		ThermalGovernor(const std::string& sysfs_root, ThermalParams params);
+
+		// reads the sensors and updates the level
+		// returns error if the temperature can't be read, the level is not changed in that case
+		Error update();
+
+		const ThermalState& state() const;
+
+		// the worst quality level the quality controller should be held at for the current thermal level
+		usize min_quality_level() const;
+		// most threads to use for the current thermal level, out of max_threads
+		int thread_limit(int max_threads) const;
+
+	private:
+		std::string m_temperature_path;
+		std::string m_frequency_path;
+		std::string m_throttled_path;
+		ThermalParams m_params;
+		ThermalState m_state;
+};
@@ -0,0 +1,269 @@
+#include "thread_pool.h"
+#include "logging.h"
+#include "realtime.h"
+#include <pthread.h>
+#include <sched.h>
+#include <sstream>
+#include <string.h>
+
+// index of the worker the current thread is in the pool it belongs to, or none if it is not a pool worker
+static thread_local ThreadPool *t_pool = nullptr;
+static thread_local usize t_worker_index = 0;
+
+Error pin_current_thread(const std::vector<int>& cpus) {
+	cpu_set_t cpu_set;
+	CPU_ZERO(&cpu_set);
+	for (int cpu : cpus) {
+		CPU_SET(cpu, &cpu_set);
+	}
+
+	int result = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+	if (result != 0) {
+		return Error::invalid_args("could not pin thread to cpus: " + std::string(strerror(result)));
+	}
+	return Error::ok();
+}
+
+std::optional<std::vector<int>> parse_cpu_list(const std::string& list) {
+	std::vector<int> cpus;
+	std::istringstream iss(list);
+	std::string item;
+
+	while (std::getline(iss, item, ',')) {
+		std::istringstream item_stream(item);
+		int cpu;
+		if ((item_stream >> cpu).fail() || !(item_stream >> std::ws).eof() || cpu < 0 || cpu >= CPU_SETSIZE) {
+			return {};
+		}
+		cpus.push_back(cpu);
+	}
+
+	return cpus;
+}
+
+bool TaskQueue::push(const PoolTask& task) {
+	std::lock_guard lock(m_mutex);
+	if (m_count == capacity) {
+		return false;
+	}
+
+	m_tasks[(m_head + m_count) % capacity] = task;
+	m_count ++;
+	return true;
+}
+
+bool TaskQueue::pop(PoolTask& task) {
+	std::lock_guard lock(m_mutex);
+	if (m_count == 0) {
+		return false;
+	}
+
+	m_count --;
+	task = m_tasks[(m_head + m_count) % capacity];
+	return true;
+}
+
+bool TaskQueue::steal(PoolTask& task) {
+	std::lock_guard lock(m_mutex);
+	if (m_count == 0) {
+		return false;
+	}
+
+	task = m_tasks[m_head];
+	m_head = (m_head + 1) % capacity;
+	m_count --;
+	return true;
+}
+
+ThreadPool::ThreadPool(usize workers, std::vector<int>&& cpus) {
+	for (usize i = 0; i < workers; i ++) {
+		m_workers.push_back(std::make_unique<Worker>());
+	}
+
+	// the threads are only started once every worker exists, since they steal from each other
+	for (usize i = 0; i < workers; i ++) {
+		int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+		m_workers[i]->thread = std::thread(&ThreadPool::worker_main, this, i, cpu);
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	m_stopping = true;
+	{
+		std::lock_guard lock(m_sleep_mutex);
+	}
+	m_sleep_cv.notify_all();
+
+	for (auto& worker : m_workers) {
+		worker->thread.join();
+	}
+}
+
+// only taken when the global pool is created, after that global is a single atomic load
+static std::mutex g_global_pool_mutex;
+static std::unique_ptr<ThreadPool> g_global_pool;
+static std::atomic<ThreadPool *> g_global_pool_ptr { nullptr };
+
+ThreadPool& ThreadPool::global() {
+	ThreadPool *pool = g_global_pool_ptr.load(std::memory_order_acquire);
+	if (pool != nullptr) {
+		return *pool;
+	}
+
+	std::lock_guard lock(g_global_pool_mutex);
+	if (g_global_pool == nullptr) {
+		usize cpus = std::max(std::thread::hardware_concurrency(), 2u);
+		g_global_pool = std::make_unique<ThreadPool>(cpus - 1, std::vector<int> {});
+		g_global_pool_ptr.store(g_global_pool.get(), std::memory_order_release);
+	}
+	return *g_global_pool;
+}
+
+void ThreadPool::init_global(usize workers, std::vector<int>&& cpus) {
+	std::lock_guard lock(g_global_pool_mutex);
+	if (g_global_pool != nullptr) {
+		lg::warn("global thread pool has already been created, ignoring new configuration");
+		return;
+	}
+	g_global_pool = std::make_unique<ThreadPool>(workers, std::move(cpus));
+	g_global_pool_ptr.store(g_global_pool.get(), std::memory_order_release);
+}
+
+usize ThreadPool::worker_count() const {
+	return m_workers.size();
+}
+
+Error ThreadPool::set_realtime_priority(int priority) {
+	auto result = Error::ok();
+	for (auto& worker : m_workers) {
+		auto worker_result = set_thread_realtime(worker->thread.native_handle(), priority);
+		if (worker_result.is_err() && result.is_ok()) {
+			result = worker_result;
+		}
+	}
+	return result;
+}
+
+void ThreadPool::submit(const PoolTask& task, TaskPriority priority) {
+	// workers queue their own work so it stays on the same core unless another worker steals it
+	usize worker_index = t_pool == this ? t_worker_index : m_next_worker++ % m_workers.size();
+
+	// counted before pushing so a worker that steals it right away never sees the count go below 0
+	m_pending ++;
+	if (!m_workers[worker_index]->queues[(usize) priority].push(task)) {
+		// queue is full, nothing better to do than run it now
+		m_pending --;
+		run_task(task);
+		return;
+	}
+
+	{
+		// taking the lock makes sure a worker that is about to sleep sees the new task
+		std::lock_guard lock(m_sleep_mutex);
+	}
+	m_sleep_cv.notify_one();
+}
+
+void ThreadPool::wait(const std::atomic<int>& remaining) {
+	while (remaining.load() > 0) {
+		if (run_one_task()) {
+			continue;
+		}
+
+		// the last tasks are running on other threads, so block until a job finishes
+		// yielding would never let a normal thread run on this cpu once this thread is SCHED_FIFO
+		// finished is read before remaining, so a job that finishes in between changes it and wait returns straight away
+		u64 finished = m_finished_jobs.load();
+		if (remaining.load() > 0) {
+			m_finished_jobs.wait(finished);
+		}
+	}
+}
+
+bool ThreadPool::run_one_task() {
+	bool is_worker = t_pool == this;
+	usize start = is_worker ? t_worker_index : 0;
+
+	PoolTask task;
+	// all high priority work, on any worker, is run before low priority work
+	for (usize priority = 0; priority < task_priority_count; priority ++) {
+		if (is_worker && m_workers[start]->queues[priority].pop(task)) {
+			m_pending --;
+			run_task(task);
+			return true;
+		}
+
+		for (usize i = 0; i < m_workers.size(); i ++) {
+			usize victim = (start + i) % m_workers.size();
+			if (is_worker && victim == start) {
+				continue;
+			}
+
+			if (m_workers[victim]->queues[priority].steal(task)) {
+				m_pending --;
+				if (is_worker) {
+					m_workers[start]->steals ++;
+				}
+				run_task(task);
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+void ThreadPool::run_task(const PoolTask& task) {
+	task.run(task.job, task.begin, task.end);
+	if (t_pool == this) {
+		m_workers[t_worker_index]->tasks_run ++;
+	}
+	// remaining is on the waiting thread's stack and can be gone as soon as it reaches 0, so the pool's own counter is notified instead
+	if (task.remaining->fetch_sub(1) == 1) {
+		m_finished_jobs ++;
+		m_finished_jobs.notify_all();
+	}
+}
+
+void ThreadPool::worker_main(usize index, int cpu) {
+	t_pool = this;
+	t_worker_index = index;
+
+	if (cpu >= 0) {
+		auto result = pin_current_thread({ cpu });
+		if (result.is_err()) {
+			lg::warn("thread pool worker %lu: %s", (unsigned long) index, result.to_string().c_str());
+		}
+	}
+
+	while (!m_stopping) {
+		if (run_one_task()) {
+			continue;
+		}
+
+		std::unique_lock lock(m_sleep_mutex);
+		m_sleep_cv.wait(lock, [&] () { return m_stopping || m_pending > 0; });
+	}
+}
+
+ThreadPoolStats ThreadPool::stats() const {
+	ThreadPoolStats stats {
+		.workers = m_workers.size(),
+		.queue_depth = m_pending,
+		.tasks_run = 0,
+		.steals = 0,
+	};
+
+	for (const auto& worker : m_workers) {
+		stats.tasks_run += worker->tasks_run;
+		stats.steals += worker->steals;
+	}
+	return stats;
+}
+
+void ThreadPool::log_stats() const {
+	auto pool_stats = stats();
+	lg::info("thread pool: %lu workers, %lu queued tasks, %llu tasks run by workers, %llu steals",
+		(unsigned long) pool_stats.workers, (unsigned long) pool_stats.queue_depth,
+		(unsigned long long) pool_stats.tasks_run, (unsigned long long) pool_stats.steals);
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include <algorithm>
+#include "types.h"
+#include "error.h"
+
+// pins the calling thread so it only runs on the given cpus
+Error pin_current_thread(const std::vector<int>& cpus);
+
+// parses a comma seperated list of cpus, like "1,2,3"
+// returns none if the list is invalid
+std::optional<std::vector<int>> parse_cpu_list(const std::string& list);
+
+enum class TaskPriority: int {
+	// work that the current frame is waiting on
+	High = 0,
+	// background work, only run when there is no high priority work
+	Low = 1,
+};
+
+constexpr usize task_priority_count = 2;
+
+// a chunk of a parallel_for, runs the items from begin to end of job
+struct PoolTask {
+	void (*run)(void *job, int begin, int end);
+	void *job;
+	int begin;
+	int end;
+	// decremented once the task has run
+	std::atomic<int> *remaining;
+};
+
+// fixed capacity double ended queue of tasks
+// the owning worker pushes and pops from the back, and other workers steal from the front,
+// so a worker keeps working on the most recent (and most likely cached) work while thieves take the oldest
+class TaskQueue {
+	public:
+		static constexpr usize capacity = 256;
+
+		// returns false if the queue is full
+		bool push(const PoolTask& task);
+		bool pop(PoolTask& task);
+		bool steal(PoolTask& task);
+
+	private:
+		std::mutex m_mutex {};
+		std::array<PoolTask, capacity> m_tasks {};
+		usize m_head { 0 };
+		usize m_count { 0 };
+};
+
+struct ThreadPoolStats {
+	usize workers;
+	// tasks waiting to be run
+	usize queue_depth;
+	u64 tasks_run;
+	// tasks that were run by a different worker than the one they were queued on
+	u64 steals;
+};
+
+// persistent pool of worker threads that each have their own task queues, and steal from each other when they run out of work
+// a thread waiting on a parallel_for runs queued tasks itself before blocking, so parallel_for can be nested
+class ThreadPool {
+	public:
+		// makes workers threads, worker i is pinned to cpus[i % cpus.size()], or not pinned at all if cpus is empty
+		ThreadPool(usize workers, std::vector<int>&& cpus);
+		~ThreadPool();
+
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+
+		// the pool used by parallel_tiles and parallel_for_index
+		// if init_global has not been called, a pool with a worker for every cpu but one and no pinning is made on first use
+		static ThreadPool& global();
+		// must be called before anything uses the global pool
+		static void init_global(usize workers, std::vector<int>&& cpus);
+
+		usize worker_count() const;
+
+		// runs every worker with the SCHED_FIFO policy at priority
+		// returns the first error, but still tries every worker
+		Error set_realtime_priority(int priority);
+
+		// calls func with every index from 0 to count, split into at most max_chunks tasks
+		// the calling thread runs the first chunk and helps with the rest, and returns once every index has been run
+		// func is a template paramater so it can be inlined, and a lambda with captures never allocates
+		template<typename F>
+		void parallel_for(int count, F&& func, int max_chunks, TaskPriority priority = TaskPriority::High) {
+			int chunks = std::min({ count, max_chunks, (int) m_workers.size() + 1 });
+			if (chunks <= 1) {
+				for (int i = 0; i < count; i ++) {
+					func(i);
+				}
+				return;
+			}
+
+			auto run = [] (void *job, int begin, int end) {
+				auto& job_func = *(std::remove_reference_t<F> *) job;
+				for (int i = begin; i < end; i ++) {
+					job_func(i);
+				}
+			};
+			void *job = (void *) std::addressof(func);
+
+			std::atomic<int> remaining(chunks - 1);
+			for (int chunk = 1; chunk < chunks; chunk ++) {
+				submit(PoolTask {
+					.run = run,
+					.job = job,
+					.begin = count * chunk / chunks,
+					.end = count * (chunk + 1) / chunks,
+					.remaining = &remaining,
+				}, priority);
+			}
+
+			run(job, 0, count / chunks);
+			wait(remaining);
+		}
+
+		ThreadPoolStats stats() const;
+		void log_stats() const;
+
+	private:
+		struct Worker {
+			std::array<TaskQueue, task_priority_count> queues {};
+			std::atomic<u64> tasks_run { 0 };
+			std::atomic<u64> steals { 0 };
+			std::thread thread {};
+		};
+
+		// queues the task, or runs it right away if the queue is full
+		void submit(const PoolTask& task, TaskPriority priority);
+		// runs other tasks until remaining reaches 0, and blocks once there are none left to run
+		void wait(const std::atomic<int>& remaining);
+		// finds a task, looking at this thread's own queue first if it is a worker, then stealing from the other workers
+		// returns false if there was no task to run
+		bool run_one_task();
+		void run_task(const PoolTask& task);
+		void worker_main(usize index, int cpu);
+
+		std::vector<std::unique_ptr<Worker>> m_workers {};
+		// tasks queued but not yet started
+		std::atomic<usize> m_pending { 0 };
+		// used to pick which worker's queue tasks submitted from outside the pool go on
+		std::atomic<usize> m_next_worker { 0 };
+		std::atomic<bool> m_stopping { false };
+		// goes up every time the last task of a parallel_for finishes, threads waiting on a parallel_for wait on this
+		std::atomic<u64> m_finished_jobs { 0 };
+
+		// only used for sleeping when there is no work
+		std::mutex m_sleep_mutex {};
+		std::condition_variable m_sleep_cv {};
+};
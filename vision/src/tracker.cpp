@@ -0,0 +1,176 @@
+#include "tracker.h"
+#include <algorithm>
+
+// variance given to the velocity of a new track, since nothing is known about it yet
+static constexpr double initial_velocity_variance = 100.0;
+
+ConstantVelocityFilter::ConstantVelocityFilter(double initial_value, double process_noise, double measurement_noise):
+m_value(initial_value),
+m_p00(measurement_noise),
+m_p11(initial_velocity_variance),
+m_process_noise(process_noise),
+m_measurement_noise(measurement_noise) {}
+
+void ConstantVelocityFilter::predict(double dt) {
+	m_value += m_velocity * dt;
+
+	// P = F * P * F^T + Q, where F = [[1, dt], [0, 1]]
+	// Q is the covariance from a random acceleration over dt
+	double dt2 = dt * dt;
+	double q00 = m_process_noise * dt2 * dt / 3.0;
+	double q01 = m_process_noise * dt2 / 2.0;
+	double q11 = m_process_noise * dt;
+
+	double p00 = m_p00 + dt * (m_p01 + m_p10) + dt2 * m_p11 + q00;
+	double p01 = m_p01 + dt * m_p11 + q01;
+	double p10 = m_p10 + dt * m_p11 + q01;
+	double p11 = m_p11 + q11;
+
+	m_p00 = p00;
+	m_p01 = p01;
+	m_p10 = p10;
+	m_p11 = p11;
+}
+
+void ConstantVelocityFilter::update(double measurement) {
+	// only the value is measured, so H = [1, 0]
+	double innovation = measurement - m_value;
+	double innovation_variance = m_p00 + m_measurement_noise;
+
+	double k0 = m_p00 / innovation_variance;
+	double k1 = m_p10 / innovation_variance;
+
+	m_value += k0 * innovation;
+	m_velocity += k1 * innovation;
+
+	double p00 = (1.0 - k0) * m_p00;
+	double p01 = (1.0 - k0) * m_p01;
+	double p10 = m_p10 - k1 * m_p00;
+	double p11 = m_p11 - k1 * m_p01;
+
+	m_p00 = p00;
+	m_p01 = p01;
+	m_p10 = p10;
+	m_p11 = p11;
+}
+
+
+Tracker::Tracker(TrackerParams params):
+m_params(params) {}
+
+void Tracker::update(const std::vector<Target>& detections, double timestamp) {
+	advance(timestamp);
+
+	// find every detection track pair that is inside of the gate
+	m_matches.clear();
+	for (usize i = 0; i < m_tracks.size(); i ++) {
+		const auto& track = m_tracks[i];
+
+		for (usize j = 0; j < detections.size(); j ++) {
+			const auto& detection = detections[j];
+			if (detection.type != track.type) {
+				continue;
+			}
+
+			double angle_diff = (detection.angle - track.angle.value()) / m_params.gate_angle;
+			double distance_diff = (detection.distance - track.distance.value()) / m_params.gate_distance;
+			double cost = angle_diff * angle_diff + distance_diff * distance_diff;
+
+			if (cost <= 1.0) {
+				m_matches.push_back(Match {
+					.track = i,
+					.detection = j,
+					.cost = cost,
+				});
+			}
+		}
+	}
+
+	// greedily assign the closest pairs first
+	// there are only ever a few targets, so this is almost always the same as the optimal assignment
+	std::sort(m_matches.begin(), m_matches.end(), [] (const Match& a, const Match& b) {
+		return a.cost < b.cost;
+	});
+
+	m_track_matched.assign(m_tracks.size(), false);
+	m_detection_matched.assign(detections.size(), false);
+
+	for (const auto& match : m_matches) {
+		if (m_track_matched[match.track] || m_detection_matched[match.detection]) {
+			continue;
+		}
+
+		m_track_matched[match.track] = true;
+		m_detection_matched[match.detection] = true;
+
+		auto& track = m_tracks[match.track];
+		const auto& detection = detections[match.detection];
+		track.angle.update(detection.angle);
+		track.distance.update(detection.distance);
+		track.score = detection.score;
+		track.missed = 0;
+	}
+
+	for (usize i = 0; i < m_tracks.size(); i ++) {
+		if (!m_track_matched[i]) {
+			m_tracks[i].missed ++;
+		}
+	}
+
+	// remove tracks that have not been seen for too long
+	std::erase_if(m_tracks, [&] (const Track& track) {
+		return track.missed > m_params.max_missed;
+	});
+
+	// every detection that was not assigned starts a new track
+	for (usize i = 0; i < detections.size(); i ++) {
+		if (m_detection_matched[i]) {
+			continue;
+		}
+
+		const auto& detection = detections[i];
+		m_tracks.push_back(Track {
+			.id = m_next_id,
+			.type = detection.type,
+			.angle = ConstantVelocityFilter(detection.angle, m_params.angle_process_noise, m_params.angle_measurement_noise),
+			.distance = ConstantVelocityFilter(detection.distance, m_params.distance_process_noise, m_params.distance_measurement_noise),
+			.score = detection.score,
+			.missed = 0,
+		});
+		m_next_id ++;
+	}
+}
+
+void Tracker::predict(double timestamp) {
+	advance(timestamp);
+}
+
+void Tracker::get_tracks(std::vector<TrackedTarget>& out, double prediction_time) const {
+	out.clear();
+
+	for (const auto& track : m_tracks) {
+		out.push_back(TrackedTarget {
+			.id = track.id,
+			.type = track.type,
+			.distance = track.distance.value(),
+			.angle = track.angle.value(),
+			.predicted_distance = track.distance.extrapolate(prediction_time),
+			.predicted_angle = track.angle.extrapolate(prediction_time),
+			.score = track.score,
+			.missed = track.missed,
+		});
+	}
+}
+
+void Tracker::advance(double timestamp) {
+	if (m_has_timestamp) {
+		double dt = timestamp - m_last_timestamp;
+		for (auto& track : m_tracks) {
+			track.angle.predict(dt);
+			track.distance.predict(dt);
+		}
+	}
+
+	m_last_timestamp = timestamp;
+	m_has_timestamp = true;
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <vector>
+#include "types.h"
+#include "vision.h"
+
+// kalman filter for a single value that is assumed to be moving at a constant velocity
+class ConstantVelocityFilter {
+	public:
+		// process_noise is how much the velocity is expected to randomly change per second
+		// measurement_noise is the variance of the measurements
+		ConstantVelocityFilter(double initial_value, double process_noise, double measurement_noise);
+
+		// moves the state forward by dt seconds
+		void predict(double dt);
+		// corrects the state using a new measurement
+		void update(double measurement);
+
+		double value() const { return m_value; }
+		double velocity() const { return m_velocity; }
+
+		// value extrapolated dt seconds into the future, without changing the state
+		double extrapolate(double dt) const { return m_value + m_velocity * dt; }
+
+	private:
+		double m_value;
+		double m_velocity { 0.0 };
+
+		// covariance matrix of value and velocity
+		double m_p00;
+		double m_p01 { 0.0 };
+		double m_p10 { 0.0 };
+		double m_p11;
+
+		double m_process_noise;
+		double m_measurement_noise;
+};
+
+struct TrackerParams {
+	// detections further than this from a track's predicted position can't be assigned to it
+	double gate_angle;
+	double gate_distance;
+	// a track is deleted after this many frames without a detection
+	int max_missed;
+	double angle_process_noise;
+	double distance_process_noise;
+	double angle_measurement_noise;
+	double distance_measurement_noise;
+};
+
+// a target that has been followed across frames
+struct TrackedTarget {
+	// stays the same for as long as the target is tracked
+	u32 id;
+	TargetType type;
+	// filtered distance and angle
+	double distance;
+	double angle;
+	// distance and angle extrapolated forward by the prediction time
+	double predicted_distance;
+	double predicted_angle;
+	double score;
+	// how many frames in a row this target has not been detected
+	int missed;
+};
+
+// associates targets detected each frame with targets from previous frames
+// every track has a kalman filter for its angle and distance so jitter is smoothed out,
+// and so the target can be predicted on frames where detection is not run
+class Tracker {
+	public:
+		Tracker(TrackerParams params);
+
+		// timestamp is in seconds on the monotonic clock, and must be increasing
+		void update(const std::vector<Target>& detections, double timestamp);
+
+		// moves all tracks forward to timestamp without any new detections
+		// this is used on frames where detection is skipped, so missed counts are not increased
+		void predict(double timestamp);
+
+		// writes all current tracks into out, out is cleared first
+		// predicted_distance and predicted_angle are extrapolated prediction_time seconds after the last update
+		void get_tracks(std::vector<TrackedTarget>& out, double prediction_time) const;
+
+	private:
+		struct Track {
+			u32 id;
+			TargetType type;
+			ConstantVelocityFilter angle;
+			ConstantVelocityFilter distance;
+			double score;
+			int missed;
+		};
+
+		// potential assignment of a detection to a track
+		struct Match {
+			usize track;
+			usize detection;
+			double cost;
+		};
+
+		void advance(double timestamp);
+
+		TrackerParams m_params;
+		std::vector<Track> m_tracks {};
+		u32 m_next_id { 1 };
+		double m_last_timestamp { 0.0 };
+		bool m_has_timestamp { false };
+
+		// these are kept between frames to avoid reallocating them
+		std::vector<Match> m_matches {};
+		std::vector<bool> m_track_matched {};
+		std::vector<bool> m_detection_matched {};
+};
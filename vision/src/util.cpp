@@ -8,13 +8,3 @@ long get_usec() {
 	gettimeofday(&tv, nullptr);
 	return 1000000 * tv.tv_sec + tv.tv_usec;
 }
-
-void time(const char *op_name, std::function<void ()> op, long *out_time) {
-	long old_usec = get_usec();
-	op();
-	long new_usec = get_usec();
-	long elapsed_usec = new_usec - old_usec;
-
-	lg::info("%s elapsed time: %ld usec", op_name, elapsed_usec);
-	if (out_time != nullptr) *out_time = elapsed_usec;
-}
@@ -1,7 +1,7 @@
 #pragma once
 
 #include "logging.h"
-#include <functional>
+#include <type_traits>
 #include <stdio.h>
 #include <string>
 
@@ -15,16 +15,33 @@ class PanicException {
 
 long get_usec();
 
-template<typename T>
-T time(const char *op_name, std::function<T ()> op, long *out_time = nullptr) {
+// times how long op takes to run and logs it
+// op is taken as a template paramater instead of a std::function so timing a lambda with captures never allocates
+template<typename F>
+auto time(const char *op_name, F&& op, long *out_time = nullptr) {
 	long old_usec = get_usec();
-	auto ret = op();
-	long new_usec = get_usec();
-	long elapsed_usec = new_usec - old_usec;
 
-	lg::info("%s elapsed time: %ld usec", op_name, elapsed_usec);
-	if (out_time != nullptr) *out_time = elapsed_usec;
-	return ret;
+	if constexpr (std::is_void_v<decltype(op())>) {
+		op();
+		long elapsed_usec = get_usec() - old_usec;
+
+		lg::info("%s elapsed time: %ld usec", op_name, elapsed_usec);
+		if (out_time != nullptr) *out_time = elapsed_usec;
+	} else {
+		auto ret = op();
+		long elapsed_usec = get_usec() - old_usec;
+
+		lg::info("%s elapsed time: %ld usec", op_name, elapsed_usec);
+		if (out_time != nullptr) *out_time = elapsed_usec;
+		return ret;
+	}
 }
 
-void time(const char *op_name, std::function<void ()> op, long *out_time = nullptr);
+// same as time, but op is just run without being timed or logged if log is false
+template<typename F>
+auto time_if(bool log, const char *op_name, F&& op) {
+	if (log) {
+		return time(op_name, op);
+	}
+	return op();
+}
@@ -2,7 +2,10 @@
 #include "vision.h"
 #include "util.h"
 #include "parallel.h"
+#include "fused_threshold.h"
+#include "graph.h"
 #include "logging.h"
+#include <algorithm>
 #include <cmath>
 #include <math.h>
 #include <opencv2/imgproc.hpp>
@@ -42,6 +45,9 @@ Error VisionCamera::start() {
 	}
 
 	m_enabled = m_cap.isOpened();
+	if (m_enabled && !m_filename.has_value()) {
+		m_wait_caps.assign(1, m_cap);
+	}
 	if (!m_enabled) {
 		return Error::resource_unavailable("could not start vision camera");
 	} else {
@@ -51,6 +57,8 @@ Error VisionCamera::start() {
 
 Error VisionCamera::stop() {
 	if (m_enabled) {
+		// the copy shares the camera, so it would stay open if this was kept
+		m_wait_caps.clear();
 		m_cap.release();
 		m_enabled = false;
 		return Error::ok();
@@ -71,244 +79,878 @@ Error VisionCamera::read_to(cv::Mat& mat) {
 	}
 }
 
+Error VisionCamera::skip_frames(u64 count) {
+	if (!m_enabled) {
+		return Error::invalid_operation("can not skip frames from vision camera if it is stopped");
+	}
 
-bool target_type_contains(TargetType input_type, TargetType contains_type) {
-	return (input_type & contains_type) == contains_type;
-}
+	// frames from a file never go stale, they are only read as fast as they are processed
+	if (m_filename.has_value()) {
+		return Error::ok();
+	}
 
-std::optional<std::string_view> target_type_to_string(TargetType type) {
-	switch (type) {
-		case TargetType::BlueBall:
-			return "blue_ball";
-		case TargetType::RedBall:
-			return "red_ball";
-		case TargetType::None:
-			return "none";
-		default:
-			return {};
+	for (u64 i = 0; i < count; i ++) {
+		// grab blocks until the camera has a frame, so only frames that are already queued are dropped
+		// a timeout of 0 waits forever, so the shortest timeout is 1 nanosecond
+		try {
+			if (!cv::VideoCapture::waitAny(m_wait_caps, m_ready, 1) || m_ready.empty()) {
+				return Error::ok();
+			}
+		} catch (const cv::Exception& error) {
+			return Error::invalid_operation("could not check for queued camera frames: " + std::string(error.what()));
+		}
+
+		if (!m_cap.grab()) {
+			return Error::resource_unavailable("could not skip frame from camera");
+		}
 	}
+	return Error::ok();
 }
 
 
-TargetSearchData::TargetSearchData(TargetType target_type, std::string&& in_name, cv::Scalar bounding_box_color, std::string&& template_name, PipelineParams params, double min_score, ScoreWeights weights):
-target_type(target_type),
-name(std::move(in_name)),
-bounding_box_color(bounding_box_color),
-template_name(std::move(template_name)),
-params(params),
-min_score(min_score),
-weights(weights) {
-	hsv_name = name + " HSV Conversion";
-	threshold_name = name + " Threshold";
-	morphology_name = name + " Morphology";
-	contour_name = name + " Contours";
-	matching_name = name + " Contour Matching";
+Vision::Vision(double fov, int threads, bool display):
+m_camera(fov),
+m_threads(threads),
+m_display(display),
+m_tuner(threads) {}
+
+Vision::~Vision() {}
+
+void Vision::set_threads(int threads) {
+	m_threads = threads;
+	m_tuner.set_max_threads(threads);
 }
 
-bool TargetSearchData::is(TargetType type) const {
-	return target_type_contains(type, target_type);
+void Vision::set_opencv_contours(bool opencv_contours) {
+	m_opencv_contours = opencv_contours;
 }
 
+void Vision::set_fused_kernels(bool fused_kernels) {
+	m_fused_kernels = fused_kernels;
+}
 
-IntermediateTarget::IntermediateTarget(std::vector<cv::Point>&& contour):
-bounding_box(cv::boundingRect(contour)),
-contour(std::move(contour)) {}
+void Vision::set_stage_logging(bool stage_logging) {
+	m_stage_logging = stage_logging;
+}
 
+void Vision::set_thread_limit(int thread_limit) {
+	m_thread_limit = thread_limit;
+}
 
-Vision::Vision(double fov, int threads, bool display):
-m_fov(fov),
-m_threads(threads),
-m_display(display) {}
+void Vision::set_motion_gating(std::optional<MotionParams> params) {
+	m_motion = params;
+}
 
-Vision::~Vision() {}
+bool Vision::reused_targets() const {
+	return m_reused_targets;
+}
 
-void Vision::set_threads(int threads) {
-	m_threads = threads;
+void Vision::set_exclusion_mask(ExclusionMask&& mask) {
+	m_exclusion = std::move(mask);
+}
+
+void Vision::set_camera_model(CameraModel&& camera) {
+	m_camera = std::move(camera);
+}
+
+u64 Vision::processed_pixels() const {
+	return m_processed_pixels;
+}
+
+std::shared_ptr<const TargetSnapshot> make_target_snapshot(std::vector<TargetSearchData>&& targets, u64 version) {
+	auto snapshot = std::make_shared<TargetSnapshot>();
+	snapshot->version = version;
+	snapshot->targets = std::move(targets);
+
+	for (const auto& target_data : snapshot->targets) {
+		snapshot->hsv_ranges.push_back(HsvRange::from_scalars(target_data.params.thresh_min, target_data.params.thresh_max));
+	}
+
+	return snapshot;
+}
+
+void Vision::set_target_data(const std::vector<TargetSearchData>& target_data) {
+	m_target_data = make_target_snapshot(std::vector<TargetSearchData>(target_data), 0);
+}
+
+std::shared_ptr<const TargetSnapshot> Vision::target_data() const {
+	return m_target_data;
+}
+
+void Vision::publish_target_data(std::shared_ptr<const TargetSnapshot> target_data) {
+	m_target_mailbox.publish(std::move(target_data));
 }
 
 Error Vision::process_templates(const std::string& template_directory) {
-	for (auto& target_data : m_target_data) {
+	// this is only done at startup, so the snapshot can just be replaced
+	std::vector<TargetSearchData> targets = m_target_data->targets;
+
+	for (auto& target_data : targets) {
 		auto template_file = std::string(template_directory) + "/" + target_data.template_name;
-		auto img_template = cv::imread(template_file, -1);
-		if (img_template.empty()) {
+		target_data.template_image = cv::imread(template_file, -1);
+		if (target_data.template_image.empty()) {
 			return Error::resource_unavailable("could not open template file: " + template_file);
 		}
 
-		// TODO: find a way to configure what type of colorspace image is input
-		cv::cvtColor(img_template, img_template, cv::COLOR_RGB2HSV);
-		cv::inRange(img_template, target_data.params.thresh_min, target_data.params.thresh_max, img_template);
-		// TODO: pass kernel into morphologyEx instead of plain cv::Mat()
-		cv::morphologyEx(img_template, img_template, cv::MORPH_OPEN, cv::Mat());
-
-		std::vector<std::vector<cv::Point>> contours;
-		cv::findContours(img_template, contours, cv::RETR_LIST, cv::CHAIN_APPROX_SIMPLE);
-
-		if (contours.size() == 0) {
+		cv::Mat img_template;
+		if (!target_data.process_template(img_template)) {
 			lg::critical("could not find any contours in the template image");
 		}
 
 		show_wait(target_data.template_name, img_template);
+	}
 
-		// find largest contour
-		usize index = 0;
-		double max_area = 0;
-		for (usize i = 0; i < contours.size(); i ++) {
-			double area = cv::contourArea(contours[i]);
-			if (area > max_area) {
-				max_area = area;
-				index = i;
-			}
-		}
+	m_target_data = make_target_snapshot(std::move(targets), m_target_data->version);
+	return Error::ok();
+}
+
+Error Vision::create_detectors(const std::optional<std::string>& override_detector) {
+	const auto& registry = DetectorRegistry::global();
+
+	m_detectors.clear();
+	m_detection_buffers.resize(m_target_data->targets.size());
+	for (const auto& target_data : m_target_data->targets) {
+		const auto& name = override_detector.has_value() ? *override_detector : target_data.detector;
 
-		auto bounding_box = cv::boundingRect(target_data.template_contour);
-		target_data.template_contour.swap(contours[index]);
-		target_data.template_area_frac = max_area / bounding_box.area();
-		target_data.template_aspect_ratio_scaled = log2((double) bounding_box.width / (double) bounding_box.height);
+		auto detector = registry.create(name);
+		if (detector == nullptr) {
+			return Error::invalid_args("no detector called '" + name + "' for target " + target_data.name + ", valid detectors are: " + registry.names());
+		}
+		m_detectors.push_back(std::move(detector));
 	}
 
 	return Error::ok();
 }
 
-std::vector<Target> Vision::process(cv::Mat img, TargetType type) const {
+void Vision::log_detector_stats() const {
+	for (usize i = 0; i < m_detectors.size(); i ++) {
+		const auto& stats = m_detectors[i]->stats();
+		if (stats.runs == 0) {
+			continue;
+		}
+
+		lg::info("%s detector: %ld usec average, %ld usec max over %llu runs", m_target_data->targets[i].name.c_str(),
+			stats.total_usec / (long) stats.runs, stats.max_usec, (unsigned long long) stats.runs);
+	}
+}
+
+// smallest rect in an image scaled by scale that covers all of rect
+static cv::Rect scaled_rect(cv::Rect rect, double scale) {
+	int x0 = (int) std::floor(rect.x * scale);
+	int y0 = (int) std::floor(rect.y * scale);
+	int x1 = (int) std::ceil((rect.x + rect.width) * scale);
+	int y1 = (int) std::ceil((rect.y + rect.height) * scale);
+	return cv::Rect(x0, y0, x1 - x0, y1 - y0);
+}
+
+// inverse of scaled_rect, the rect in the full resolution image that is resized into rect
+static cv::Rect full_resolution_rect(cv::Rect rect, double scale) {
+	return scaled_rect(rect, 1.0 / scale);
+}
+
+// the part of the roi of scale_buffers covered by region, which is in full resolution coordinates
+static cv::Rect scaled_region(cv::Rect region, const ScaleBuffers& scale_buffers) {
+	return scaled_rect(region, scale_buffers.scale) & scale_buffers.roi;
+}
+
+template<typename F>
+void Vision::task(ParallelStage stage, const ScaleBuffers& scale_buffers, const FrameBuffers& buffers, bool alone, cv::Mat in, cv::Mat out, F&& func) {
+	bool timed = is_timed(buffers, alone);
+	StageConfig config = m_tuner.config(stage, scale_buffers.size, timed);
+	int threads = limit_threads(config.threads);
+
+	long start_usec = get_usec();
+	// everything works on views, so a smaller region does not reallocate any buffers
+	for (cv::Rect region : buffers.regions) {
+		cv::Rect rect = scaled_region(region, scale_buffers);
+		if (!rect.empty()) {
+			parallel_tiles(threads, config.grain, func, in(rect), out(rect));
+		}
+	}
+
+	// while the thermal limit caps the threads, the config being tuned isn't what was timed
+	if (timed && threads == config.threads) {
+		m_tuner.record(stage, scale_buffers.size, get_usec() - start_usec);
+	}
+}
+
+bool Vision::is_timed(const FrameBuffers& buffers, bool alone) const {
+	return alone && buffers.motion.whole_frame;
+}
+
+std::vector<Target> Vision::process(cv::Mat img, TargetType type) {
 	std::vector<Target> out;
+	process(img, type, out);
+	return out;
+}
+
+void Vision::process(cv::Mat img, TargetType type, std::vector<Target>& out) {
+	process(img, frame_settings(type), out);
+}
 
-	// image that will be used to show all found targets of all types
-	cv::Mat img_show;
+void Vision::process(cv::Mat img, const FrameSettings& settings, std::vector<Target>& out) {
+	preprocess(img, settings, m_buffers);
+	detect(img, m_buffers, out);
+}
+
+FrameSettings Vision::frame_settings(TargetType targets) {
+	// frame boundary, so it is safe to switch to new target data
+	if (m_target_mailbox.take(m_target_data)) {
+		lg::info("using target data version %llu", (unsigned long long) m_target_data->version);
+	}
+
+	return FrameSettings {
+		.target_data = m_target_data,
+		.targets = targets,
+		.quality = m_quality,
+		.roi = m_roi,
+	};
+}
+
+void Vision::preprocess(cv::Mat img, const FrameSettings& settings, FrameBuffers& buffers) {
+	// the display code is compiled out of the version used when not displaying
 	if (m_display) {
-		// only copy the data if display flag is set
-		img_show = img.clone();
+		preprocess_impl<true>(img, settings, buffers);
+	} else {
+		preprocess_impl<false>(img, settings, buffers);
 	}
+}
 
-	show("Input", img);
+template<bool Display>
+void Vision::preprocess_impl(cv::Mat img, const FrameSettings& settings, FrameBuffers& buffers) {
+	prepare_buffers(img, settings, buffers);
 
-	// values used for distance calulation that only need to be calculated once
-	// TODO: don't calculate these every frame
-	double img_width = img.size().width;
-	double img_height = img.size().height;
+	if constexpr (Display) {
+		show("Input", img);
+	}
 
-	double fovx = m_fov;
-	double fovy = fovx * img_width / img_height;
+	const auto& all_target_data = buffers.target_data->targets;
 
-	// slope of field of view line
-	double fov_slope = tan(fovy);
-	// height of the entire camera frame at a distance of 1m
-	double frame_height = 2.0 * fov_slope;
+	// work out which targets to search for
+	buffers.searched_targets.clear();
+	for (usize target_index = 0; target_index < all_target_data.size(); target_index ++) {
+		// an empty mask tells detect to skip this target
+		buffers.targets[target_index].mask = cv::Mat();
 
-	for (const auto& target_data : m_target_data) {
-		if (!target_data.is(type)) {
-			continue;
+		if (all_target_data[target_index].is(settings.targets) && buffers.searched_targets.size() < settings.quality.max_targets) {
+			buffers.searched_targets.push_back(target_index);
 		}
+	}
 
-		cv::Size size(img.cols, img.rows);
-
-		// TODO: find a way to configure what type of colorspace image is input
-		cv::Mat img_hsv(size, img.type());
-		time(target_data.hsv_name.c_str(), [&] () {
-			task(img, img_hsv, [] (cv::Mat in, cv::Mat out) {
-				cv::cvtColor(in, out, cv::COLOR_BGR2HSV, 8);
+	find_motion(img, settings, buffers);
+	find_regions(buffers);
+	update_graph(img, settings, buffers);
+
+	// nothing changed since these buffers were last used, so the masks from last time are still right
+	if (!buffers.motion.reuse) {
+		// stages sharing a wave can't be timed, so while tuning each one is run alone on frames that are timed
+		// this is skipped while the thermal limit caps the threads, since nothing would be recorded anyway
+		bool serialize = buffers.motion.whole_frame && limit_threads(m_threads) == m_threads && m_tuner.tuning();
+		run_waves(buffers.graph, false, serialize, [&] (const GraphStage& stage, bool alone) {
+			time_if(m_stage_logging, stage.name.c_str(), [&] () {
+				run_preprocess_stage<Display>(img, stage, settings, buffers, alone);
 			});
+
+			if constexpr (Display) {
+				for (usize output : stage.outputs) {
+					const auto& buffer = buffers.graph.buffers()[output];
+					if (!buffer.name.empty()) {
+						cv::Mat img_output = graph_image(img, output, buffers)(buffers.scales[stage.scale_index].roi);
+						show(buffer.name, img_output);
+					}
+				}
+			}
 		});
+	}
+
+	for (const auto& target : buffers.graph.desc().targets) {
+		auto& target_buffers = buffers.targets[target.target_index];
+		const cv::Rect& roi = buffers.scales[target.scale_index].roi;
+		target_buffers.mask = target.morphology ? target_buffers.morph(roi) : target_buffers.thresh(roi);
+		// morph is remade from thresh every frame, but motion gating only rethresholds what changed, so thresh has to be left as it is
+		target_buffers.mask_writable = target.morphology || !m_motion.has_value();
+	}
+}
+
+void Vision::update_graph(const cv::Mat& img, const FrameSettings& settings, FrameBuffers& buffers) {
+	auto& desc = buffers.graph_desc;
+	desc.frame_size = buffers.frame_size;
+	desc.frame_type = img.type();
+	desc.max_fused_targets = m_fused_kernels && img.type() == fused_input_type ? max_fused_targets : 0;
+
+	desc.scales.resize(buffers.scales.size());
+	for (usize i = 0; i < buffers.scales.size(); i ++) {
+		desc.scales[i] = GraphScale {
+			.scale = buffers.scales[i].scale,
+			.size = buffers.scales[i].size,
+		};
+	}
+
+	// assigning into the existing targets reuses their name strings, so this doesn't allocate once the targets have been seen
+	desc.targets.resize(buffers.searched_targets.size());
+	for (usize i = 0; i < buffers.searched_targets.size(); i ++) {
+		usize target_index = buffers.searched_targets[i];
+		auto& target = desc.targets[i];
+		target.target_index = target_index;
+		target.scale_index = buffers.target_scales[target_index];
+		// some detectors work better on the unfiltered threshold output, and lower quality levels skip morphology to save time
+		target.morphology = m_detectors[target_index]->uses_morphology() && settings.quality.morph_iterations > 0;
+		target.name = buffers.target_data->targets[target_index].name;
+	}
+
+	if (!(desc == buffers.graph.desc())) {
+		buffers.graph.plan(desc);
+		buffers.graph.log();
+	}
+
+	const auto& slots = buffers.graph.slots();
+	buffers.graph_slots.resize(slots.size());
+	for (usize i = 0; i < slots.size(); i ++) {
+		// a slot that is already big enough is kept, so dropping the quality scale doesn't reallocate anything
+		ensure_capacity(buffers.graph_slots[i], slots[i].size, slots[i].type);
+	}
+}
+
+template<typename F>
+void Vision::run_waves(const FrameGraph& graph, bool detect_stages, bool serialize, F&& run_stage) {
+	const auto& stages = graph.stages();
+	const auto& wave_starts = graph.wave_starts();
+
+	for (usize wave = 0; wave < graph.wave_count(); wave ++) {
+		usize start = wave_starts[wave];
+		usize end = wave_starts[wave + 1];
+
+		auto run = [&] (const GraphStage& stage) {
+			return is_detect_stage(stage.kind) == detect_stages && stage.threads != StageThreads::Serial;
+		};
+		int count = (int) std::count_if(stages.begin() + start, stages.begin() + end, run);
+
+		// tiled stages split themselves up further with the tuned config, so a wave of one tiled stage still uses every thread
+		if (count == 1 || serialize) {
+			for (usize i = start; i < end; i ++) {
+				if (run(stages[i])) {
+					run_stage(stages[i], true);
+				}
+			}
+		} else if (count > 1) {
+			parallel_for_index((int) (end - start), [&] (int i) {
+				const auto& stage = stages[start + i];
+				if (run(stage)) {
+					run_stage(stage, false);
+				}
+			}, target_threads());
+		}
+
+		for (usize i = start; i < end; i ++) {
+			const auto& stage = stages[i];
+			if (is_detect_stage(stage.kind) == detect_stages && stage.threads == StageThreads::Serial) {
+				run_stage(stage, true);
+			}
+		}
+	}
+}
 
-		cv::Mat img_thresh(size, CV_8U);
-		time(target_data.threshold_name.c_str(), [&] () {
-			task(img_hsv, img_thresh, [&] (cv::Mat in, cv::Mat out) {
+template<bool Display>
+void Vision::run_preprocess_stage(cv::Mat img, const GraphStage& stage, const FrameSettings& settings, FrameBuffers& buffers, bool alone) {
+	const auto& desc = buffers.graph.desc();
+	const auto& scale_buffers = buffers.scales[stage.scale_index];
+
+	switch (stage.kind) {
+		case StageKind::Resize: {
+			cv::Mat img_resized = graph_image(img, stage.outputs[0], buffers);
+			// everything works on views, so a smaller region does not reallocate any buffers
+			for (cv::Rect region : buffers.regions) {
+				cv::Rect rect = scaled_region(region, scale_buffers);
+				if (rect.empty()) {
+					continue;
+				}
+
+				cv::Rect img_rect = full_resolution_rect(rect, scale_buffers.scale) & cv::Rect(0, 0, img.cols, img.rows);
+				cv::Mat img_out = img_resized(rect);
+				cv::resize(img(img_rect), img_out, rect.size(), 0, 0, cv::INTER_AREA);
+			}
+			break;
+		}
+		case StageKind::Color: {
+			cv::Mat img_in = graph_image(img, stage.inputs[0], buffers);
+			cv::Mat img_hsv = graph_image(img, stage.outputs[0], buffers);
+			task(ParallelStage::Hsv, scale_buffers, buffers, alone, img_in, img_hsv, [] (cv::Mat in, cv::Mat out) {
+				cv::cvtColor(in, out, cv::COLOR_BGR2HSV, 8);
+			});
+			break;
+		}
+		case StageKind::Threshold: {
+			const auto& target_data = buffers.target_data->targets[desc.targets[stage.targets[0]].target_index];
+			cv::Mat img_hsv = graph_image(img, stage.inputs[0], buffers);
+			cv::Mat img_thresh = graph_image(img, stage.outputs[0], buffers);
+			task(ParallelStage::Threshold, scale_buffers, buffers, alone, img_hsv, img_thresh, [&] (cv::Mat in, cv::Mat out) {
 				cv::inRange(in, target_data.params.thresh_min, target_data.params.thresh_max, out);
 			});
-		});
-		show(target_data.threshold_name, img_thresh);
+			break;
+		}
+		case StageKind::FusedThreshold:
+			switch (stage.targets.size()) {
+				case 1:
+					fused_threshold_stage<1>(img, stage, buffers, alone);
+					break;
+				case 2:
+					fused_threshold_stage<2>(img, stage, buffers, alone);
+					break;
+				case 3:
+					fused_threshold_stage<3>(img, stage, buffers, alone);
+					break;
+				case 4:
+					fused_threshold_stage<4>(img, stage, buffers, alone);
+					break;
+				default:
+					static_assert(max_fused_targets == 4, "add cases for the new max_fused_targets");
+					break;
+			}
+			break;
+		case StageKind::Morph: {
+			const cv::Rect& roi = scale_buffers.roi;
+			cv::Mat img_thresh = graph_image(img, stage.inputs[0], buffers)(roi);
+			cv::Mat img_morph = graph_image(img, stage.outputs[0], buffers)(roi);
+			// morphology looks at neighbouring pixels, so it is always run on the whole roi
+			// TODO: pass kernel into morphologyEx instead of plain cv::Mat()
+			cv::morphologyEx(img_thresh, img_morph, cv::MORPH_OPEN, cv::Mat(), cv::Point(-1, -1), settings.quality.morph_iterations);
+			break;
+		}
+		default:
+			break;
+	}
+}
 
-		cv::Mat img_morph(size, CV_8U);
-		// TODO: pass kernel into morphologyEx instead of plain cv::Mat()
-		time(target_data.morphology_name.c_str(), [&] () {
-			cv::morphologyEx(img_thresh, img_morph, cv::MORPH_OPEN, cv::Mat());
-		});
-		show(target_data.morphology_name, img_morph);
+template<usize N>
+void Vision::fused_threshold_stage(cv::Mat img, const GraphStage& stage, FrameBuffers& buffers, bool alone) {
+	const auto& desc = buffers.graph.desc();
+	const auto& scale_buffers = buffers.scales[stage.scale_index];
 
-		// TODO: reserve eneough space in vector to prevent reallocations
-		std::vector<std::vector<cv::Point>> contours;
-		time(target_data.contour_name.c_str(), [&] () {
-			cv::findContours(img_morph, contours, cv::RETR_LIST, cv::CHAIN_APPROX_SIMPLE);
-		});
+	// the ranges are worked out when the target data changes, not every frame
+	std::array<HsvRange, N> ranges;
+	for (usize i = 0; i < N; i ++) {
+		ranges[i] = buffers.target_data->hsv_ranges[desc.targets[stage.targets[i]].target_index];
+	}
+
+	bool timed = is_timed(buffers, alone);
+	StageConfig config = m_tuner.config(ParallelStage::FusedThreshold, scale_buffers.size, timed);
+	int threads = limit_threads(config.threads);
+
+	cv::Mat img_in = graph_image(img, stage.inputs[0], buffers);
+	long start_usec = get_usec();
+	for (cv::Rect region : buffers.regions) {
+		cv::Rect rect = scaled_region(region, scale_buffers);
+		if (rect.empty()) {
+			continue;
+		}
+
+		std::array<cv::Mat, N> masks;
+		for (usize i = 0; i < N; i ++) {
+			masks[i] = graph_image(img, stage.outputs[i], buffers)(rect);
+		}
+
+		fused_hsv_in_range<N>(img_in(rect), ranges, masks, threads, config.grain);
+	}
+	if (timed && threads == config.threads) {
+		m_tuner.record(ParallelStage::FusedThreshold, scale_buffers.size, get_usec() - start_usec);
+	}
+}
+
+cv::Mat Vision::graph_image(cv::Mat img, usize buffer_index, FrameBuffers& buffers) const {
+	const auto& buffer = buffers.graph.buffers()[buffer_index];
+	switch (buffer.kind) {
+		case BufferKind::Source:
+			return img;
+		case BufferKind::Resized:
+		case BufferKind::Hsv:
+			return buffers.graph_slots[buffer.slot](cv::Rect(cv::Point(0, 0), buffer.size));
+		case BufferKind::Thresh:
+			return buffers.targets[buffers.graph.desc().targets[buffer.owner].target_index].thresh;
+		case BufferKind::Morph:
+			return buffers.targets[buffers.graph.desc().targets[buffer.owner].target_index].morph;
+		default:
+			return cv::Mat();
+	}
+}
 
-		// TODO: maybe thow out targets that score so low on a certain test
-		std::vector<IntermediateTarget> targets;
-		// move contours into target vector
-		for (auto& contour : contours) {
-			targets.push_back(IntermediateTarget(std::move(contour)));
+void Vision::find_motion(cv::Mat img, const FrameSettings& settings, FrameBuffers& buffers) {
+	auto& motion = buffers.motion;
+	motion.regions.clear();
+	motion.reuse = false;
+	motion.whole_frame = true;
+
+	if (!m_motion.has_value() || !compute_signature(img, *m_motion, motion.current)) {
+		motion.valid = false;
+		motion.regions.push_back(cv::Rect(cv::Point(0, 0), buffers.frame_size));
+		return;
+	}
+
+	// the masks can only be partly updated if they were made for the same targets in the same place
+	bool same_settings = motion.valid
+		&& motion.searched_targets == buffers.searched_targets
+		&& motion.quality_scale == settings.quality.scale
+		&& motion.morph_iterations == settings.quality.morph_iterations
+		&& motion.target_version == buffers.target_data->version
+		&& motion.rois.size() == buffers.scales.size();
+	for (usize i = 0; same_settings && i < buffers.scales.size(); i ++) {
+		same_settings = motion.rois[i] == buffers.scales[i].roi;
+	}
+
+	if (!same_settings) {
+		// everything is thresholded, so the whole signature is now up to date
+		motion.regions.push_back(cv::Rect(cv::Point(0, 0), buffers.frame_size));
+		motion.signature = motion.current;
+
+		// assign reuses the old memory once it is big enough
+		motion.searched_targets.assign(buffers.searched_targets.begin(), buffers.searched_targets.end());
+		motion.rois.resize(buffers.scales.size());
+		for (usize i = 0; i < buffers.scales.size(); i ++) {
+			motion.rois[i] = buffers.scales[i].roi;
 		}
+		motion.quality_scale = settings.quality.scale;
+		motion.morph_iterations = settings.quality.morph_iterations;
+		motion.target_version = buffers.target_data->version;
+		motion.valid = true;
+		motion.targets_valid = false;
+		return;
+	}
 
-		time(target_data.matching_name.c_str(), [&] () {
-			for (auto& target : targets) {
-				// contour matching with cv::matchShapes
-				double match_shapes_score = cv::matchShapes(target_data.template_contour, target.contour, cv::CONTOURS_MATCH_I3, 0.0);
-				target.score += match_shapes_score * target_data.weights.contour_match;
-
-				// compute fraction of bounding rectangle taken up by the actual contour
-				double area_frac = cv::contourArea(target.contour) / target.bounding_box.area();
-				// TODO: add a per target way to configure k
-				double frac_score = similarity(area_frac, target_data.template_area_frac, 70.0);
-				target.score += frac_score * target_data.weights.area_frac;
-
-				double aspect_ratio = (double) target.bounding_box.width / (double) target.bounding_box.height;
-				// make it so that doubling the aspec ratio results in a constant increase in score
-				double scaled_ratio = std::log2(aspect_ratio);
-				double aspect_score = similarity(scaled_ratio, target_data.template_aspect_ratio_scaled, 100.0);
-				target.score += aspect_ratio * target_data.weights.aspect_ratio;
+	motion.whole_frame = false;
+	usize changed_count = find_changed_tiles(motion.signature, motion.current, m_motion->threshold, motion.changed);
+	if (changed_count == 0) {
+		// if detect never ran on these masks, there is nothing to threshold but detection still has to be done
+		motion.reuse = motion.targets_valid;
+		return;
+	}
+
+	motion.targets_valid = false;
+	update_changed_tiles(motion.signature, motion.current, motion.changed);
+	changed_regions(motion.signature, motion.changed, motion.regions);
+}
+
+void Vision::find_regions(FrameBuffers& buffers) {
+	buffers.regions.clear();
+	for (cv::Rect region : buffers.motion.regions) {
+		for (cv::Rect included : buffers.included) {
+			cv::Rect rect = region & included;
+			if (!rect.empty()) {
+				buffers.regions.push_back(rect);
 			}
+		}
+	}
+
+	buffers.processed_pixels = 0;
+	if (buffers.motion.reuse) {
+		return;
+	}
+
+	for (usize scale_index = 0; scale_index < buffers.scales.size(); scale_index ++) {
+		bool used = std::any_of(buffers.searched_targets.begin(), buffers.searched_targets.end(), [&] (usize target_index) {
+			return buffers.target_scales[target_index] == scale_index;
 		});
+		if (!used) {
+			continue;
+		}
 
-		char text[32];
-		int font_face = cv::FONT_HERSHEY_SIMPLEX;
-		double font_scale = 0.5;
-		cv::Point text_point(40, 40);
+		for (cv::Rect region : buffers.regions) {
+			buffers.processed_pixels += scaled_region(region, buffers.scales[scale_index]).area();
+		}
+	}
+}
 
-		for (const auto& target : targets) {
-			// ignore targets that didn't score well enough
-			if (target.score < target_data.min_score) {
-				continue;
-			}
+void Vision::detect(cv::Mat img, FrameBuffers& buffers, std::vector<Target>& out) {
+	if (m_display) {
+		detect_impl<true>(img, buffers, out);
+	} else {
+		detect_impl<false>(img, buffers, out);
+	}
+}
 
-			auto rect = target.bounding_box;
-			double xpos = rect.x + rect.width / 2.0;
-			// TODO: figure out if top is 0 y or bottom is 0 y
-			double ypos = rect.y + rect.height / 2.0;
-
-			// converts xpos and ypos to be in the range -1.0 to 1.0
-			double xpos_normalized = (xpos - img_width / 2.0) * (2.0 / img_width);
-			double ypos_normalized = (ypos - img_height / 2.0) * (2.0 / img_height);
-
-			// calculate angle of target in degrees
-			double xangle = xpos_normalized * fovx;
-			double yangle = ypos_normalized * fovy;
-
-			// calculate expected height of target at 1m distance based on target_height and fovy
-			// fraction of the frame the target would take up at 1m distance
-			double height_fraction_1m = target_data.params.target_height / frame_height;
-			// the actual fraction of the frame that the object's height takes up
-			double height_fraction = rect.height / frame_height;
-			double distance = height_fraction_1m / height_fraction;
-
-			// TODO: account for camera position and angle
-			auto out_target = Target {
-				.type = target_data.target_type,
-				.distance = distance,
-				.angle = xangle,
-				.score = target.score,
+template<bool Display>
+void Vision::detect_impl(cv::Mat img, FrameBuffers& buffers, std::vector<Target>& out) {
+	out.clear();
+	usize old_out_capacity = out.capacity();
+
+	m_frame_size = buffers.frame_size;
+	m_camera.set_frame_size(m_frame_size);
+	m_processed_pixels = buffers.processed_pixels;
+
+	m_reused_targets = buffers.motion.reuse;
+	if (m_reused_targets) {
+		out.assign(buffers.motion.targets.begin(), buffers.motion.targets.end());
+		if (out.capacity() != old_out_capacity) {
+			m_buffer_allocations ++;
+		}
+		return;
+	}
+
+	// every target has its own detector and detection buffers, so the detectors can all run at once
+	run_waves(buffers.graph, true, false, [&] (const GraphStage& stage, bool) {
+		time_if(m_stage_logging, stage.name.c_str(), [&] () {
+			run_detect_stage<Display>(img, stage, buffers, out);
+		});
+	});
+
+	if (m_motion.has_value()) {
+		buffers.motion.targets.assign(out.begin(), out.end());
+		buffers.motion.targets_valid = true;
+	}
+
+	if (out.capacity() != old_out_capacity) {
+		m_buffer_allocations ++;
+	}
+}
+
+template<bool Display>
+void Vision::run_detect_stage(cv::Mat img, const GraphStage& stage, FrameBuffers& buffers, std::vector<Target>& out) {
+	const auto& desc = buffers.graph.desc();
+	const auto& all_target_data = buffers.target_data->targets;
+
+	switch (stage.kind) {
+		case StageKind::Label: {
+			usize target_index = desc.targets[stage.targets[0]].target_index;
+			auto& detector = *m_detectors[target_index];
+			auto& detection_buffers = m_detection_buffers[target_index];
+
+			DetectorFrame detector_frame {
+				.mask = buffers.targets[target_index].mask,
+				.mask_writable = buffers.targets[target_index].mask_writable,
+				.contours = detection_buffers.contours,
+				.targets = detection_buffers.targets,
+				.opencv_contours = m_opencv_contours,
+				.log_timing = m_stage_logging,
 			};
 
-			out.push_back(out_target);
+			long start_usec = get_usec();
+			detector.detect(all_target_data[target_index], detector_frame);
+			detector.record_time(get_usec() - start_usec);
+			break;
+		}
+		case StageKind::Score: {
+			usize target_index = desc.targets[stage.targets[0]].target_index;
+			const auto& target_data = all_target_data[target_index];
+			auto& detection_buffers = m_detection_buffers[target_index];
+			const auto& scale_buffers = buffers.scales[stage.scale_index];
+			double scale = scale_buffers.scale;
+			const cv::Rect& roi = scale_buffers.roi;
+
+			auto& found = detection_buffers.found;
+			usize old_found_capacity = found.capacity();
+			found.clear();
+			for (const auto& target : detection_buffers.targets) {
+				// ignore targets that didn't score well enough
+				if (target.score < target_data.min_score) {
+					continue;
+				}
+
+				// convert the box back to full resolution coordinates
+				const auto& box = target.bounding_box;
+				cv::Rect2d rect((box.x + roi.x) / scale, (box.y + roi.y) / scale, box.width / scale, box.height / scale);
+				found.push_back(make_target(target_data, rect, target.score));
+			}
+
+			if (found.capacity() != old_found_capacity) {
+				m_buffer_allocations ++;
+			}
+			break;
+		}
+		case StageKind::Sink: {
+			// merge the results in target order, so the output is the same as if the targets were run one after another
+			for (const auto& target : desc.targets) {
+				const auto& found = m_detection_buffers[target.target_index].found;
+				out.insert(out.end(), found.begin(), found.end());
+			}
 
-			if (m_display) {
-				// TODO: display distance, angle, and score for each target
-				cv::drawContours(img_show, std::vector<std::vector<cv::Point>>(1, target.contour), 0, cv::Scalar(0, 0, 255));
-				cv::rectangle(img_show, rect, target_data.bounding_box_color);
+			if constexpr (Display) {
+				// image that will be used to show all found targets of all types
+				cv::Mat& img_show = m_show;
+				ensure_buffer(img_show, img.size(), img.type());
+				img.copyTo(img_show);
+
+				for (const auto& target : desc.targets) {
+					const auto& target_data = all_target_data[target.target_index];
+					const auto& detection_buffers = m_detection_buffers[target.target_index];
+					const auto& scale_buffers = buffers.scales[target.scale_index];
+
+					// found has one target for each detection that scored well enough, in the same order
+					usize found_index = 0;
+					for (const auto& detection : detection_buffers.targets) {
+						if (detection.score < target_data.min_score) {
+							continue;
+						}
+						const auto& out_target = detection_buffers.found[found_index ++];
+
+						// TODO: display distance, angle, and score for each target
+						// contours are in the scaled image's coordinates, so they can only be drawn at full scale
+						if (detection.contour != IntermediateTarget::no_contour && scale_buffers.scale == 1.0) {
+							cv::Mat img_show_roi = img_show(scale_buffers.roi);
+							detection_buffers.contours.draw(img_show_roi, detection.contour, cv::Scalar(0, 0, 255));
+						}
+						cv::rectangle(img_show, out_target.bounding_box, target_data.bounding_box_color);
+					}
+				}
+
+				show("Targets", img_show);
 			}
+			break;
 		}
+		default:
+			break;
 	}
+}
 
-	show("Targets", img_show);
+void Vision::set_quality(const QualitySettings& quality) {
+	m_quality = quality;
+}
 
-	return out;
+void Vision::set_roi(std::optional<cv::Rect> roi) {
+	m_roi = roi;
+}
+
+std::optional<Target> Vision::target_from_box(TargetType type, cv::Rect box, double score) const {
+	for (const auto& target_data : m_target_data->targets) {
+		if (target_data.target_type == type) {
+			return make_target(target_data, box, score);
+		}
+	}
+
+	return {};
+}
+
+AutoTuner& Vision::tuner() {
+	return m_tuner;
+}
+
+u64 Vision::buffer_allocations() const {
+	return m_buffer_allocations;
+}
+
+Target Vision::make_target(const TargetSearchData& target_data, cv::Rect2d rect, double score) const {
+	// only the corners and center of the box are undistorted, which is much cheaper than undistorting the whole frame
+	cv::Point2d top_left = m_camera.undistort_point(cv::Point2d(rect.x, rect.y));
+	cv::Point2d top_right = m_camera.undistort_point(cv::Point2d(rect.x + rect.width, rect.y));
+	cv::Point2d bottom_left = m_camera.undistort_point(cv::Point2d(rect.x, rect.y + rect.height));
+	cv::Point2d bottom_right = m_camera.undistort_point(cv::Point2d(rect.x + rect.width, rect.y + rect.height));
+	cv::Point2d center = m_camera.undistort_point(cv::Point2d(rect.x + rect.width / 2.0, rect.y + rect.height / 2.0));
+
+	// undistorted points are the tangent of their angle from the center of view, so an object of height h at distance d is h / d tall
+	// distortion can make the sides of the box different heights, so they are averaged
+	double height = ((bottom_left.y - top_left.y) + (bottom_right.y - top_right.y)) / 2.0;
+	double distance = target_data.params.target_height / height;
+
+	// calculate angle of target in degrees
+	double xangle = atan(center.x) * 180.0 / M_PI;
+
+	// the rect may be slightly outside of the frame from rounding when it was scaled
+	cv::Rect bounding_box = cv::Rect(cvRound(rect.x), cvRound(rect.y), cvRound(rect.width), cvRound(rect.height))
+		& cv::Rect(0, 0, m_frame_size.width, m_frame_size.height);
+
+	// TODO: account for camera position and angle
+	return Target {
+		.type = target_data.target_type,
+		.distance = distance,
+		.angle = xangle,
+		.score = score,
+		.bounding_box = bounding_box,
+	};
+}
+
+void Vision::prepare_buffers(const cv::Mat& img, const FrameSettings& settings, FrameBuffers& buffers) {
+	cv::Size size(img.cols, img.rows);
+	double quality_scale = settings.quality.scale;
+
+	// copying the shared_ptr only bumps an atomic reference count
+	buffers.target_data = settings.target_data;
+	const auto& all_target_data = buffers.target_data->targets;
+
+	// work out which scales are needed, this only has to be done when the resolution, quality scale or target scales change
+	if (size != buffers.frame_size
+		|| buffers.target_scales.size() != all_target_data.size()
+		|| buffers.quality_scale != quality_scale
+		|| buffers.target_version != buffers.target_data->version) {
+		buffers.scales.clear();
+		buffers.target_scales.clear();
+		buffers.quality_scale = quality_scale;
+		buffers.target_version = buffers.target_data->version;
+
+		for (const auto& target_data : all_target_data) {
+			double scale = target_data.params.scale * quality_scale;
+
+			auto it = std::find_if(buffers.scales.begin(), buffers.scales.end(), [&] (const ScaleBuffers& scale_buffers) {
+				return scale_buffers.scale == scale;
+			});
+
+			if (it == buffers.scales.end()) {
+				buffers.target_scales.push_back(buffers.scales.size());
+				buffers.scales.push_back(ScaleBuffers {
+					.scale = scale,
+					.size = cv::Size(std::max(1, cvRound(size.width * scale)), std::max(1, cvRound(size.height * scale))),
+				});
+			} else {
+				buffers.target_scales.push_back(it - buffers.scales.begin());
+			}
+		}
+
+		m_exclusion.included_regions(size, buffers.included);
+	}
+	buffers.frame_size = size;
+
+	for (auto& scale_buffers : buffers.scales) {
+		cv::Rect full_rect(cv::Point(0, 0), scale_buffers.size);
+		if (settings.quality.roi_only && settings.roi.has_value()) {
+			scale_buffers.roi = scaled_rect(*settings.roi, scale_buffers.scale) & full_rect;
+			// an roi completely outside of the frame would leave nothing to process
+			if (scale_buffers.roi.empty()) {
+				scale_buffers.roi = full_rect;
+			}
+		} else {
+			scale_buffers.roi = full_rect;
+		}
+	}
+
+	buffers.targets.resize(all_target_data.size());
+	for (usize i = 0; i < all_target_data.size(); i ++) {
+		const auto& scale_buffers = buffers.scales[buffers.target_scales[i]];
+		auto& target_buffers = buffers.targets[i];
+		if (target_buffers.thresh.size() == scale_buffers.size) {
+			continue;
+		}
+
+		// the storage is sized for full quality, so a lower quality scale only needs a smaller view of it
+		double full_scale = all_target_data[i].params.scale * std::max(quality_scale, 1.0);
+		cv::Size full_size(
+			std::max(scale_buffers.size.width, cvRound(size.width * full_scale)),
+			std::max(scale_buffers.size.height, cvRound(size.height * full_scale))
+		);
+		ensure_capacity(target_buffers.thresh_storage, full_size, CV_8U);
+		ensure_capacity(target_buffers.morph_storage, full_size, CV_8U);
+
+		cv::Rect view(cv::Point(0, 0), scale_buffers.size);
+		target_buffers.thresh = target_buffers.thresh_storage(view);
+		target_buffers.morph = target_buffers.morph_storage(view);
+
+		// excluded pixels are never thresholded, so they have to start out empty to stay out of the masks
+		// the view may still hold a mask made at another scale, so this is done whenever it changes size and not only when it is allocated
+		if (!m_exclusion.empty()) {
+			target_buffers.thresh.setTo(0);
+		}
+	}
+}
+
+bool Vision::ensure_buffer(cv::Mat& buffer, cv::Size size, int type) {
+	if (buffer.size() != size || buffer.type() != type) {
+		buffer.create(size, type);
+		m_buffer_allocations ++;
+		return true;
+	}
+	return false;
+}
+
+bool Vision::ensure_capacity(cv::Mat& buffer, cv::Size size, int type) {
+	if (buffer.type() != type || buffer.cols < size.width || buffer.rows < size.height) {
+		return ensure_buffer(buffer, size, type);
+	}
+	return false;
 }
 
 void Vision::show(const std::string& name, cv::Mat& img) const {
@@ -324,17 +966,12 @@ void Vision::show_wait(const std::string& name, cv::Mat& img) const {
 	}
 }
 
-void Vision::task(cv::Mat in, cv::Mat out, std::function<void(cv::Mat, cv::Mat)> func) const {
-	if (m_threads > 1) {
-		parallel_process(in, out, func, m_threads);
-	} else {
-		func(in, out);
-	}
+int Vision::target_threads() const {
+	// highgui windows can only be used from one thread
+	return m_display ? 1 : limit_threads(m_threads);
 }
 
-double Vision::similarity(double a, double b, double k) {
-	// currently this is just a function I came up with by myself, I am not sure how good it is
-	double squared_diff = pow((a - b), 2);
-
-	return 1 / (1 + exp(k * squared_diff));
+int Vision::limit_threads(int threads) const {
+	int thread_limit = m_thread_limit;
+	return thread_limit > 0 ? std::min(threads, thread_limit) : threads;
 }
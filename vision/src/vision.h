@@ -4,10 +4,23 @@
 #include <opencv2/opencv.hpp>
 #include <opencv2/videoio.hpp>
 #include <optional>
+#include <atomic>
 #include <vector>
-#include <functional>
 #include "error.h"
 #include "types.h"
+#include "contour.h"
+#include "target.h"
+#include "detector.h"
+#include "quality.h"
+#include "parallel.h"
+#include "autotune.h"
+#include "motion.h"
+#include "exclusion.h"
+#include "camera_model.h"
+#include "fused_threshold.h"
+#include "snapshot.h"
+#include "graph.h"
+#include "util.h"
 
 // wrapper around opencv VideoCapture to quickly open and close with the correct arguments
 class VisionCamera {
@@ -21,8 +34,16 @@ class VisionCamera {
 
 		Error read_to(cv::Mat& mat);
 
+		// grabs and throws away up to count frames without decoding them
+		// used to drop frames that have been sitting in the camera's queue for too long to be worth processing
+		// this never waits for a new frame, and does nothing when reading from a file
+		Error skip_frames(u64 count);
+
 	private:
 		cv::VideoCapture m_cap;
+		// m_cap on its own, for cv::VideoCapture::waitAny, kept so checking for queued frames doesn't allocate
+		std::vector<cv::VideoCapture> m_wait_caps {};
+		std::vector<int> m_ready {};
 		std::optional<std::string> m_filename;
 		int m_cam_width;
 		int m_cam_height;
@@ -30,201 +51,326 @@ class VisionCamera {
 		bool m_enabled { false };
 };
 
-// bitflags for type of target
-enum class TargetType: u64 {
-	None = 0x0,
-	RedBall = 0x1,
-	BlueBall = 0x2,
-	All = 0x3,
+// settings for one processing scale, shared by every target processed at that scale
+// the resized and hsv images are transient buffers in the frame graph
+struct ScaleBuffers {
+	double scale;
+	cv::Size size;
+	// part of the scaled image that is processed this frame, the whole image unless a region of interest is set
+	cv::Rect roi;
 };
 
-// operations for the TargetType bitflags
-inline TargetType operator|(TargetType lhs, TargetType rhs) {
-	using T = std::underlying_type_t <TargetType>;
-	return static_cast<TargetType>(static_cast<T>(lhs) | static_cast<T>(rhs));
-}
-
-inline TargetType& operator|=(TargetType& lhs, TargetType rhs) {
-	lhs = lhs | rhs;
-	return lhs;
-}
-
-inline TargetType operator&(TargetType lhs, TargetType rhs) {
-	using T = std::underlying_type_t <TargetType>;
-	return static_cast<TargetType>(static_cast<T>(lhs) & static_cast<T>(rhs));
-}
-
-inline TargetType& operator&=(TargetType& lhs, TargetType rhs) {
-	lhs = lhs & rhs;
-	return lhs;
-}
-
-// returns true if the left hand side contains all the bits from the right hand side
-bool target_type_contains(TargetType input_type, TargetType contains_type);
-
-// returns a string view if the type is only one type, if it is mixed returns none
-std::optional<std::string_view> target_type_to_string(TargetType type);
-
-// represents a detected target
-struct Target {
-	TargetType type;
-	double distance;
-	double angle;
-	double score;
+// threshold output for one target, at the size of the target's scale
+struct TargetBuffers {
+	// views of the top left of thresh_storage and morph_storage
+	cv::Mat thresh;
+	cv::Mat morph;
+	// sized for the target's scale at full quality, so lowering the quality scale only takes a smaller view of them
+	cv::Mat thresh_storage;
+	cv::Mat morph_storage;
+	// view of the roi in thresh or morph that the detector should run on
+	// empty if the target is not being searched for this frame
+	cv::Mat mask;
+	// false if mask is thresh and motion gating needs it unchanged for the next frame
+	bool mask_writable { true };
 };
 
-struct IntermediateTarget {
-	IntermediateTarget(std::vector<cv::Point>&& contour);
+// state used to only rethreshold the parts of a frame that have changed since these buffers were last used
+struct MotionBuffers {
+	// signature of the frame each tile of the threshold masks came from
+	FrameSignature signature {};
+	// signature of the current frame
+	FrameSignature current {};
+	// 1 for each tile that has changed since it was last thresholded
+	std::vector<u8> changed {};
+	// areas of the full resolution frame to threshold this frame
+	std::vector<cv::Rect> regions {};
+	// what the masks were made with, they can only be partly updated if the next frame uses the same settings
+	std::vector<usize> searched_targets {};
+	std::vector<cv::Rect> rois {};
+	double quality_scale { 0.0 };
+	int morph_iterations { 0 };
+	u64 target_version { 0 };
+	// true once the masks and signature are from the same frame
+	bool valid { false };
+	// true if nothing changed, so the masks were not touched and detect can reuse the targets found last time
+	bool reuse { false };
+	// true if regions is the whole frame, so stage timings can be compared with frames that weren't gated
+	bool whole_frame { true };
+	// targets detect found in the current masks
+	std::vector<Target> targets {};
+	// false if the masks have changed since targets was written, which happens if a frame is preprocessed but then dropped
+	bool targets_valid { false };
+};
 
-	cv::Rect bounding_box;
-	std::vector<cv::Point> contour;
-	double score { 0.0 };
+// everything about the targets that can be changed while vision is running
+// a snapshot is never modified once it has been published, each change makes a whole new snapshot, see ParamUpdater
+struct TargetSnapshot {
+	// goes up by one with each new snapshot, so buffers can tell when the target data they were made with is out of date
+	u64 version { 0 };
+	std::vector<TargetSearchData> targets {};
+	// range of each target for the fused threshold kernels, in the same order as targets
+	std::vector<HsvRange> hsv_ranges {};
 };
 
-// paramaters for various stages in the vision pipeline
-struct PipelineParams {
-	// minimum and maximum hsv values for threshholding this object
-	// from https://docs.opencv.org/3.4/de/d25/imgproc_color_conversions.html
-	// NOTE: if input image is 8 bit rgb, the min and max values for h, s, and v area as follows:
-	// H: 180
-	// S: 255
-	// V: 255
-	// This is different from the normal H: 360, S: 100, V: 100 readings you will normally see,
-	// so be sure to scale these values to be in the correct range
-	cv::Scalar thresh_min;
-	cv::Scalar thresh_max;
-
-	// TODO: add morphology amount configuration
-
-	// height of the target, used for distance calculations
-	double target_height;
+// makes a snapshot of targets, and works out everything that depends on their paramaters
+// templates are not processed here, they should already be up to date
+std::shared_ptr<const TargetSnapshot> make_target_snapshot(std::vector<TargetSearchData>&& targets, u64 version);
+
+// what to look for in a frame and how much work to put into it
+struct FrameSettings {
+	// the target data to use, every stage of the frame uses the same snapshot even if a new one is published partway through
+	std::shared_ptr<const TargetSnapshot> target_data;
+	TargetType targets;
+	QualitySettings quality;
+	// only used if quality.roi_only is set
+	std::optional<cv::Rect> roi;
 };
 
-// weights for the scores of different operations to determine how closely the imsage matches the template
-struct ScoreWeights {
-	double contour_match;
-	double area_frac;
-	double aspect_ratio;
+// scratch buffers for the preprocessing half of a frame, which is everything up to and including morphology
+// these are reused every frame, they are only reallocated on the first frame, if the resolution or target scales change, or if the quality scale goes above 1
+// several of these can be used so one frame can be preprocessed while the previous frame is still in detection
+struct FrameBuffers {
+	// target data from the settings the buffers were last preprocessed with, detect uses this too
+	std::shared_ptr<const TargetSnapshot> target_data {};
+	// version of the target data the scales were worked out with
+	u64 target_version { 0 };
+	// one for each different scale used by the targets
+	std::vector<ScaleBuffers> scales {};
+	// index into scales for each target, in the same order as the target data
+	std::vector<usize> target_scales {};
+	// one for each target, in the same order as the target data
+	std::vector<TargetBuffers> targets {};
+	// indexes of the targets being searched for this frame
+	std::vector<usize> searched_targets {};
+	// quality scale the scales were worked out with
+	double quality_scale { 1.0 };
+	// size of the full resolution frame
+	cv::Size frame_size {};
+	MotionBuffers motion {};
+	// parts of the full resolution frame not covered by the exclusion mask
+	std::vector<cv::Rect> included {};
+	// parts of the full resolution frame to convert and threshold this frame, everything that changed and is not excluded
+	std::vector<cv::Rect> regions {};
+	// how many pixels went through color conversion and thresholding this frame, summed over every scale used
+	u64 processed_pixels { 0 };
+	// stages to run for the current settings, replanned only when graph_desc changes
+	FrameGraph graph {};
+	// filled in every frame and compared to the graph's description, kept here so its memory is reused
+	GraphDesc graph_desc {};
+	// memory for the graph's transient buffers, a slot is only reallocated if it has to grow
+	std::vector<cv::Mat> graph_slots {};
 };
 
-// data about a desired type of target used to help recognise it
-class TargetSearchData {
+// scratch buffers one target's detector uses
+// each target has its own so all the targets can be detected at the same time
+struct DetectionBuffers {
+	ContourStore contours {};
+	std::vector<IntermediateTarget> targets {};
+	// targets that scored well enough, in full resolution coordinates
+	std::vector<Target> found {};
+};
+
+class Vision {
 	public:
-		TargetSearchData(TargetType target_type, std::string&& name, cv::Scalar bounding_box_color, std::string&& template_name, PipelineParams params, double min_score, ScoreWeights weights);
+		// field of view is field of view of camera, it doesn't matter for the template images
+		Vision(double fov, int threads, bool display);
+		~Vision();
 
-		// returns true if this is the passed in target type
-		bool is(TargetType type) const;
+		void set_threads(int threads);
 
-		// type of target that this is
-		TargetType target_type;
+		// use cv::findContours instead of the built in contour tracer
+		// cv::findContours allocates every contour it finds, so this is only useful for comparing the two
+		void set_opencv_contours(bool opencv_contours);
 
-		// human readable name of this target
-		std::string name;
+		// use the fused hsv threshold kernels specialized for 8 bit bgr input when possible, on by default
+		// when off, every frame goes through the generic cvtColor and inRange path
+		void set_fused_kernels(bool fused_kernels);
 
-		// names of the various processing frames that will be displayed when the -d flag is specified
-		// these are here so that they are computed beforehand to avoid expensive allocation in hot loop
-		std::string hsv_name {};
-		std::string threshold_name {};
-		std::string morphology_name {};
-		std::string contour_name {};
-		std::string matching_name {};
+		// logs how long each stage of the frame graph and each detector step takes, on by default
+		// turned off for pipelines whose timings are collected some other way, so they don't flood the log
+		void set_stage_logging(bool stage_logging);
 
-		// color to use when displaying the bounding box
-		cv::Scalar bounding_box_color;
+		// caps how many threads any parallel stage uses without throwing away what the tuner has learned, 0 means no limit
+		// used to do less work when the cpu is getting hot, safe to call while the pipeline thread is running
+		void set_thread_limit(int thread_limit);
 
-		// name of the template file
-		// will try and open the template file in the passed in template directory
-		std::string template_name;
+		// compares each frame to the last frame processed with the same buffers, and only rethresholds the tiles that changed
+		// if no tiles changed, detection is skipped and the targets from last time are reused
+		// none turns this off, which is the default
+		void set_motion_gating(std::optional<MotionParams> params);
 
-		// paramaters for the vision pipeline
-		PipelineParams params;
+		// true if the last call to detect or process reused the previous targets because nothing in the frame changed
+		bool reused_targets() const;
 
-		// minumum score a controut must have to be considered a valid target
-		double min_score;
+		// parts of the frame that are never processed, this should be set before the first frame
+		void set_exclusion_mask(ExclusionMask&& mask);
 
-		ScoreWeights weights;
+		// use a camera model loaded from calibrate-camera's output instead of the field of view to work out target distances and angles
+		void set_camera_model(CameraModel&& camera);
 
-		// template contour to try and recognise
-		std::vector<cv::Point> template_contour {};
-		double template_area_frac { 0.0 };
-		double template_aspect_ratio_scaled { 0.0 };
-};
+		// how many pixels were converted and thresholded for the frame passed to the last call to detect or process
+		u64 processed_pixels() const;
 
-class Vision {
-	public:
-		// field of view is field of view of camera, it doesn't matter for the template images
-		Vision(double fov, int threads, bool display);
-		~Vision();
+		// sets which targets can be looked for, this must be called before process_templates and create_detectors
+		void set_target_data(const std::vector<TargetSearchData>& target_data);
 
-		void set_threads(int threads);
+		// the latest target data frame_settings has picked up
+		std::shared_ptr<const TargetSnapshot> target_data() const;
+
+		// replaces the target data starting at the next call to frame_settings or process, can be called from any thread
+		// the snapshot must have the same targets in the same order, only their paramaters can be different
+		void publish_target_data(std::shared_ptr<const TargetSnapshot> target_data);
 
 		// processess all templates to get required paramaters to look for targets
 		// returns error if any of the files cannot be opened
 		Error process_templates(const std::string& template_directory);
 
+		// creates the detector for every target from the DetectorRegistry
+		// if override_detector is set, it is used for every target instead of the target's own detector, which is useful for comparing detectors
+		// returns error if a detector does not exist
+		Error create_detectors(const std::optional<std::string>& override_detector = {});
+
+		// logs how long each target's detector has taken on average
+		void log_detector_stats() const;
+
 		// processess the image to find targets
 		// pass in targets bitflags to say which targets we can look for
-		std::vector<Target> process(cv::Mat img, TargetType targets) const;
+		std::vector<Target> process(cv::Mat img, TargetType targets);
+
+		// same as above, but writes the targets into out instead of returning a new vector
+		// out is cleared first, but its capacity is kept, so once it has grown big enough this will not allocate
+		void process(cv::Mat img, TargetType targets, std::vector<Target>& out);
+
+		// same as above, but with settings from frame_settings, so the caller knows exactly what the frame was processed with
+		void process(cv::Mat img, const FrameSettings& settings, std::vector<Target>& out);
+
+		// the settings process uses, with quality and roi from set_quality and set_roi
+		// this is where target data from publish_target_data is picked up, so it should only be called from the thread running the frame loop
+		FrameSettings frame_settings(TargetType targets);
+
+		// process is split into these two halves so consecutive frames can be pipelined
+		// preprocess only reads the target configuration and writes to buffers, so it can run on another thread at the same time as detect,
+		// as long as the two calls use different buffers
+		// when calling these directly, set_quality and set_roi have no effect, the settings are passed in instead
+
+		// converts and thresholds img for every target that is being searched for
+		void preprocess(cv::Mat img, const FrameSettings& settings, FrameBuffers& buffers);
+		// runs every target's detector on buffers that have been through preprocess, and writes found targets into out
+		// img must be the same image that was passed to preprocess
+		void detect(cv::Mat img, FrameBuffers& buffers, std::vector<Target>& out);
+
+		// changes how much work is done for each frame, takes effect on the next call to process
+		// lowering the scale only shrinks views of the scratch buffers, raising it above 1 reallocates them on the next frame
+		void set_quality(const QualitySettings& quality);
+
+		// area of the full resolution frame to look for targets in, only used if the quality settings have roi_only set
+		// if roi is none the whole frame is processed
+		void set_roi(std::optional<cv::Rect> roi);
+
+		// computes the distance and angle of a target of the given type that is at box in the last processed frame
+		// returns none if there is no target of that type
+		std::optional<Target> target_from_box(TargetType type, cv::Rect box, double score) const;
+
+		// finds the fastest way to split up each parallel stage
+		AutoTuner& tuner();
+
+		// the number of times a scratch buffer has had to be reallocated
+		// this should stop going up once the first frame has been processed at a given resolution
+		u64 buffer_allocations() const;
 
 	private:
+		// computes the distance and angle of a target at rect in the full resolution frame
+		Target make_target(const TargetSearchData& target_data, cv::Rect2d rect, double score) const;
+
+		// preprocess, with the display code compiled out when Display is false
+		template<bool Display>
+		void preprocess_impl(cv::Mat img, const FrameSettings& settings, FrameBuffers& buffers);
+		// detect, with the display code compiled out when Display is false
+		template<bool Display>
+		void detect_impl(cv::Mat img, FrameBuffers& buffers, std::vector<Target>& out);
+		// replans the frame graph if the searched targets, scales or input have changed, and makes sure its slots are big enough
+		void update_graph(const cv::Mat& img, const FrameSettings& settings, FrameBuffers& buffers);
+		// runs either the preprocess or the detect stages of graph one wave at a time
+		// the stages in a wave are run at the same time, and serial stages are run after the rest of their wave
+		// run_stage is called with each stage, and whether it is the only stage running, so it has the whole thread pool to itself
+		// if serialize is true, every stage is run alone one after another instead
+		template<typename F>
+		void run_waves(const FrameGraph& graph, bool detect_stages, bool serialize, F&& run_stage);
+		template<bool Display>
+		void run_preprocess_stage(cv::Mat img, const GraphStage& stage, const FrameSettings& settings, FrameBuffers& buffers, bool alone);
+		template<bool Display>
+		void run_detect_stage(cv::Mat img, const GraphStage& stage, FrameBuffers& buffers, std::vector<Target>& out);
+		// thresholds the targets of a fused stage straight from the bgr image with a kernel specialized for the number of targets
+		template<usize N>
+		void fused_threshold_stage(cv::Mat img, const GraphStage& stage, FrameBuffers& buffers, bool alone);
+		// the image an image buffer of the graph is stored in, at the full size of the buffer
+		cv::Mat graph_image(cv::Mat img, usize buffer_index, FrameBuffers& buffers) const;
+		// works out which regions of the frame need to be thresholded, and whether the masks can be reused as they are
+		void find_motion(cv::Mat img, const FrameSettings& settings, FrameBuffers& buffers);
+		// clips the regions motion gating found to the parts of the frame that aren't excluded
+		void find_regions(FrameBuffers& buffers);
+
+		// makes sure all the frame buffers are the right size for the input image and settings
+		void prepare_buffers(const cv::Mat& img, const FrameSettings& settings, FrameBuffers& buffers);
+		// reallocates buffer only if it is not already the correct size and type
+		// returns true if the buffer was reallocated
+		bool ensure_buffer(cv::Mat& buffer, cv::Size size, int type);
+		// reallocates buffer only if it is not already at least size and of the correct type
+		// returns true if the buffer was reallocated
+		bool ensure_capacity(cv::Mat& buffer, cv::Size size, int type);
+
 		void show(const std::string& name, cv::Mat& img) const;
 		void show_wait(const std::string& name, cv::Mat& img) const;
-		void task(cv::Mat in, cv::Mat out, std::function<void(cv::Mat, cv::Mat)> func) const;
-
-		// returns a score from 0 to 1 of how similar 2 numbers are to eachother
-		// the k value determines how fast the returned score falls off
-		// the higher it is, the faster it falls off
-		static double similarity(double a, double b, double k = 1.0);
-
-		// field of view of images being processed
-		double m_fov;
+		// how many threads to run targets on at the same time
+		int target_threads() const;
+		// threads after the thermal thread limit is applied
+		int limit_threads(int threads) const;
+		// runs a per pixel operation on the part of in and out covered by each of the frame's regions,
+		// split up however the tuner has found to be fastest for stage at the size of the scale
+		// in and out are the full size images of the scale, so the tuned config doesn't change when only an roi is processed
+		// alone is true if no other stage is running at the same time
+		template<typename F>
+		void task(ParallelStage stage, const ScaleBuffers& scale_buffers, const FrameBuffers& buffers, bool alone, cv::Mat in, cv::Mat out, F&& func);
+		// true if a stage's time this frame should be given to the tuner
+		// the tuner compares configs by the time of a whole frame with the thread pool to itself,
+		// so nothing is recorded if motion gating only processed part of the frame, or if other stages in the wave were sharing the pool
+		// waves are serialized while tuning, so every stage still gets timed
+		bool is_timed(const FrameBuffers& buffers, bool alone) const;
+
+		// used to work out where targets are, made from the field of view unless a calibration is loaded
+		CameraModel m_camera;
 		// how man threads to use for processing certain operations in parallell
 		int m_threads;
 		// true to display the frames for debugging
 		bool m_display;
-
-		// change this to change which targets we can look for
-		// maybe when vision is mature these can be read in from a file
-		std::vector<TargetSearchData> m_target_data {
-			TargetSearchData(
-				TargetType::RedBall,
-				"Red Ball",
-				// this is in bgr
-				cv::Scalar(0, 0, 255),
-				"red-ball-template.png",
-				PipelineParams {
-					// observed min: H: 130, S: 80, V: 132
-					// observed max: H: 142, S: 182, V: 243
-					.thresh_min = cv::Scalar(130, 75, 127),
-					.thresh_max = cv::Scalar(142, 187, 248),
-					.target_height = 1.0,
-				},
-				1.5,
-				ScoreWeights {
-					.contour_match = 1.0,
-					.area_frac = 1.0,
-					.aspect_ratio = 1.0,
-				}
-			),
-			TargetSearchData(
-				TargetType::BlueBall,
-				"Blue Ball",
-				// this is in bgr
-				cv::Scalar(255, 0, 0),
-				"blue-ball-template.png",
-				PipelineParams {
-					// observed min: H: 12, S: 165, V: 145
-					// observed max: H: 20, S: 221, V: 250
-					.thresh_min = cv::Scalar(12, 160, 140),
-					.thresh_max = cv::Scalar(20, 226, 255),
-					.target_height = 1.0,
-				},
-				1.5,
-				ScoreWeights {
-					.contour_match = 1.0,
-					.area_frac = 1.0,
-					.aspect_ratio = 1.0,
-				}
-			),
-		};
+		bool m_opencv_contours { false };
+		bool m_fused_kernels { true };
+		bool m_stage_logging { true };
+		std::atomic<int> m_thread_limit { 0 };
+		std::optional<MotionParams> m_motion {};
+		bool m_reused_targets { false };
+		ExclusionMask m_exclusion {};
+		u64 m_processed_pixels { 0 };
+		AutoTuner m_tuner;
+		QualitySettings m_quality { full_quality };
+		std::optional<cv::Rect> m_roi {};
+
+		// used by process, the pipeline has its own frame buffers
+		FrameBuffers m_buffers {};
+		// one for each target, in the same order as the target data
+		std::vector<DetectionBuffers> m_detection_buffers {};
+		// image used to show all found targets of all types, only used if display flag is set
+		cv::Mat m_show;
+		// detector for each target, in the same order as the target data
+		std::vector<std::unique_ptr<TargetDetector>> m_detectors {};
+		// size of the last frame that went through detection
+		cv::Size m_frame_size {};
+		// atomic since preprocess may be allocating on a different thread than detect
+		std::atomic<u64> m_buffer_allocations { 0 };
+
+		// every target that can be looked for, set from the target config
+		// only the frame loop thread uses this, other threads publish new snapshots into m_target_mailbox
+		std::shared_ptr<const TargetSnapshot> m_target_data {};
+		SnapshotMailbox<TargetSnapshot> m_target_mailbox {};
 };